@@ -0,0 +1,216 @@
+/*
+ * cache.c
+ *
+ * optional local content cache for downloads (-C <dir>).
+ *
+ * A cached object is a plain file named <escaped key>@<size>@<mtime>@<sum>,
+ * the fingerprint comes from rados_striper_stat and the whole object sum
+ * of the stored chunk sums (crc32c.h), so a hit costs a stat and an xattr
+ * read on the cluster and one fstat locally. The mtime only has seconds,
+ * the sum tells apart an object rewritten within the same second with the
+ * same size. An object rewritten simply misses and its old entry ages out.
+ *
+ * The directory is bounded by -Z <MB>: before storing, the least recently
+ * used entries (oldest file mtime, refreshed on every hit) are unlinked.
+ * Hits are served with a reflink when the file system can, otherwise with
+ * copy_file_range, so the data does not pass through user space.
+ * Several striprados processes may share one directory, eviction and
+ * insertion take an flock on <dir>/.lock. A .tmp.<pid> file is only
+ * written under that lock, the ones eviction finds were left by a crash.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include "striprados.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define CACHE_NAME_MAX 255
+
+struct cache_entry {
+	char name[CACHE_NAME_MAX + 1];
+	time_t mtime;
+	uint64_t size;
+};
+
+/* keys may contain '/' and anything else: escape them as %XX */
+static int cache_name(char *name, const char *key, uint64_t size, time_t mtime, uint32_t sum) {
+	char *p = name;
+	const unsigned char *k;
+	int n;
+
+	for (k = (const unsigned char *)key; *k; k++) {
+		if (p - name > CACHE_NAME_MAX - 48)
+			return -1;
+		if (*k == '/' || *k == '%' || *k == '@' || *k <= ' ' || *k >= 0x7f || (k == (const unsigned char *)key && *k == '.'))
+			p += sprintf(p, "%%%02X", *k);
+		else
+			*p++ = *k;
+	}
+	n = sprintf(p, "@%" PRIu64 "@%ld@%08x", size, (long)mtime, sum);
+	return p - name + n;
+}
+
+/* copy size bytes from in to out, both at offset 0 */
+int copy_fd(int in, int out, uint64_t size) {
+	loff_t in_off = 0, out_off = 0;
+	char *buf;
+	ssize_t n;
+
+	if (ioctl(out, FICLONE, in) == 0)
+		return 0;
+#ifdef __NR_copy_file_range
+	while (!quit && (uint64_t)in_off < size) {
+		n = syscall(__NR_copy_file_range, in, &in_off, out, &out_off, size - in_off, 0);
+		if (n <= 0)
+			break;
+	}
+	if ((uint64_t)in_off == size)
+		return 0;
+#endif
+	/* old kernel or cross device: plain copy of what is left */
+	buf = malloc(BUFFSIZE);
+	if (buf == NULL)
+		return -1;
+	while (!quit && (uint64_t)in_off < size) {
+		n = pread(in, buf, BUFFSIZE, in_off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || pwrite(out, buf, n, out_off) != n)
+			break;
+		in_off += n;
+		out_off += n;
+	}
+	free(buf);
+	return (uint64_t)in_off == size ? 0 : -1;
+}
+
+/* serve key from the cache into fd, returns -1 on a miss */
+int cache_fetch(const char *dir, const char *key, uint64_t size, time_t mtime, uint32_t sum, int fd) {
+	char name[CACHE_NAME_MAX + 1];
+	struct stat st;
+	int dfd, cfd, ret = -1;
+
+	if (cache_name(name, key, size, mtime, sum) < 0)
+		return -1;
+	dfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0)
+		return -1;
+	cfd = openat(dfd, name, O_RDONLY);
+	close(dfd);
+	if (cfd < 0)
+		return -1;
+	if (fstat(cfd, &st) == 0 && (uint64_t)st.st_size == size) {
+		ret = copy_fd(cfd, fd, size);
+		/* refresh the LRU position */
+		if (ret == 0)
+			futimens(cfd, NULL);
+	}
+	close(cfd);
+	return ret;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+	const struct cache_entry *x = a, *y = b;
+	return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* unlink the oldest entries until need more bytes fit under limit */
+static void cache_evict(int dfd, uint64_t limit, uint64_t need) {
+	struct cache_entry *entries = NULL, *tmp;
+	struct dirent *de;
+	struct stat st;
+	uint64_t total = 0;
+	int n = 0, cap = 0, i, fd;
+	DIR *d;
+
+	fd = dup(dfd);
+	if (fd < 0 || (d = fdopendir(fd)) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		/* we hold the lock, no writer is busy with it */
+		if (strncmp(de->d_name, ".tmp.", 5) == 0) {
+			unlinkat(dfd, de->d_name, 0);
+			continue;
+		}
+		if (de->d_name[0] == '.')
+			continue;
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 256;
+			tmp = realloc(entries, cap * sizeof(struct cache_entry));
+			if (tmp == NULL)
+				break;
+			entries = tmp;
+		}
+		strncpy(entries[n].name, de->d_name, CACHE_NAME_MAX);
+		entries[n].name[CACHE_NAME_MAX] = '\0';
+		entries[n].mtime = st.st_mtime;
+		entries[n].size = st.st_blocks * 512;
+		total += entries[n].size;
+		n++;
+	}
+	closedir(d);
+
+	qsort(entries, n, sizeof(struct cache_entry), cmp_entry);
+	for (i = 0; i < n && total + need > limit; i++) {
+		if (unlinkat(dfd, entries[i].name, 0) == 0)
+			total -= entries[i].size;
+	}
+	free(entries);
+}
+
+/* keep a copy of the downloaded object in fd, failures only cost the cache */
+void cache_store(const char *dir, uint64_t limit, const char *key, uint64_t size, time_t mtime, uint32_t sum, int fd) {
+	char name[CACHE_NAME_MAX + 1], tmp[64];
+	int dfd, lfd, cfd;
+
+	if (size > limit || cache_name(name, key, size, mtime, sum) < 0)
+		return;
+	mkdir(dir, 0755);
+	dfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		debug("can not open cache directory %s\n", dir);
+		return;
+	}
+	lfd = openat(dfd, ".lock", O_RDWR | O_CREAT, 0644);
+	if (lfd < 0 || flock(lfd, LOCK_EX) < 0)
+		goto out;
+
+	cache_evict(dfd, limit, size);
+
+	/* write under a temporary name so that readers never see a partial file */
+	snprintf(tmp, sizeof(tmp), ".tmp.%d", (int)getpid());
+	cfd = openat(dfd, tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (cfd < 0)
+		goto out;
+	if (copy_fd(fd, cfd, size) == 0 && renameat(dfd, tmp, dfd, name) == 0)
+		debug("%s cached\n", key);
+	else
+		unlinkat(dfd, tmp, 0);
+	close(cfd);
+out:
+	if (lfd >= 0)
+		close(lfd);
+	close(dfd);
+}
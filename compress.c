@@ -0,0 +1,403 @@
+/*
+ * compress.c
+ *
+ * optional lz4 compression of uploads (-z). The data is cut in CZ_CHUNK
+ * pieces, every piece is still stored at its logical offset so that the
+ * striper size, ranged reads and the layout stay as they are; only the
+ * bytes written shrink and the rest of the chunk is left as a hole.
+ *
+ * The head object carries the codec (CODEC_XATTR) and the chunk map
+ * (CMAP_XATTR): the stored length of every chunk. 0 is a chunk of
+ * zeros, the logical length a raw chunk written without any copy, any
+ * other value an lz4 block. A sample of each chunk is looked at first,
+ * data that looks random (video, archives) is not even tried.
+ *
+ * Chunks are compressed and decompressed by CZ_THREADS worker threads,
+ * run_parallel hands them out (crypt.c uses them as well).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <lz4.h>
+#include "striprados.h"
+#include "reactor.h"
+
+#define CZ_THREADS 4
+/* bytes looked at to guess whether a chunk compresses */
+#define CZ_SAMPLES 16
+#define CZ_SAMPLE_LEN 256
+#define CMAP_HEADER 20
+
+/* one batch of jobs at a time runs on the workers, the caller helps */
+static pthread_once_t cz_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cz_batch = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cz_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cz_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cz_done = PTHREAD_COND_INITIALIZER;
+static void (*cz_fn)(void *arg, int i);
+static void *cz_arg;
+static int cz_n, cz_next, cz_finished;
+
+/* run one job and account for it, cz_mutex held on entry and exit */
+static void cz_run_one(void) {
+	void (*fn)(void *, int) = cz_fn;
+	void *arg = cz_arg;
+	int i = cz_next++;
+	pthread_mutex_unlock(&cz_mutex);
+	fn(arg, i);
+	pthread_mutex_lock(&cz_mutex);
+	if (++cz_finished == cz_n)
+		pthread_cond_broadcast(&cz_done);
+}
+
+static void *cz_worker(void *unused) {
+	pthread_mutex_lock(&cz_mutex);
+	for (;;) {
+		while (cz_next >= cz_n)
+			pthread_cond_wait(&cz_work, &cz_mutex);
+		cz_run_one();
+	}
+	return NULL;
+}
+
+static void cz_start(void) {
+	pthread_t t;
+	int i;
+	for (i = 0; i < CZ_THREADS; i++) {
+		if (pthread_create(&t, NULL, cz_worker, NULL) == 0)
+			pthread_detach(t);
+	}
+}
+
+void run_parallel(void (*fn)(void *arg, int i), void *arg, int n) {
+	pthread_once(&cz_once, cz_start);
+	pthread_mutex_lock(&cz_batch);
+	pthread_mutex_lock(&cz_mutex);
+	cz_fn = fn;
+	cz_arg = arg;
+	cz_n = n;
+	cz_next = 0;
+	cz_finished = 0;
+	pthread_cond_broadcast(&cz_work);
+	while (cz_next < cz_n)
+		cz_run_one();
+	while (cz_finished < cz_n)
+		pthread_cond_wait(&cz_done, &cz_mutex);
+	pthread_mutex_unlock(&cz_mutex);
+	pthread_mutex_unlock(&cz_batch);
+}
+
+/*
+ * a flat byte histogram means random data. sum(count^2) is n^2/256 for
+ * uniform bytes and grows quickly for text, tables and padding.
+ */
+static int looks_compressible(const char *buf, size_t len) {
+	uint32_t hist[256];
+	uint64_t n = 0, sq = 0;
+	size_t step, pos, i;
+	int s;
+
+	memset(hist, 0, sizeof(hist));
+	step = len / CZ_SAMPLES;
+	for (s = 0; s < CZ_SAMPLES; s++) {
+		pos = s * step;
+		for (i = 0; i < CZ_SAMPLE_LEN && pos + i < len; i++) {
+			hist[(unsigned char)buf[pos + i]]++;
+			n++;
+		}
+	}
+	for (i = 0; i < 256; i++)
+		sq += (uint64_t)hist[i] * hist[i];
+	return sq * 256 * 4 > n * n * 5;
+}
+
+struct cz_job {
+	const char *src;
+	char *zbuf;
+	size_t len;
+	uint32_t chunk;
+	size_t bound;
+	const char **out;
+	uint32_t *outlen;
+};
+
+static void compress_one(void *arg, int i) {
+	struct cz_job *job = (struct cz_job *)arg;
+	const char *src = job->src + (size_t)i * job->chunk;
+	size_t len = job->len - (size_t)i * job->chunk < job->chunk ? job->len - (size_t)i * job->chunk : job->chunk;
+	char *dst = job->zbuf + (size_t)i * job->bound;
+	int z;
+
+	job->out[i] = src;
+	job->outlen[i] = len;
+	if (buffer_is_zero(src, len)) {
+		job->outlen[i] = 0;
+		return;
+	}
+	if (!looks_compressible(src, len))
+		return;
+	z = LZ4_compress_default(src, dst, len, job->bound);
+	/* keep it raw unless it saves at least an eighth */
+	if (z > 0 && (size_t)z < len - len / 8) {
+		job->out[i] = dst;
+		job->outlen[i] = z;
+	}
+}
+
+size_t compress_bound(size_t len) {
+	return (len / CZ_CHUNK + 1) * LZ4_COMPRESSBOUND(CZ_CHUNK);
+}
+
+/*
+ * compress buf, logical bytes [offset, offset + len) of the object, into
+ * zbuf (compress_bound(len) bytes). out/outlen receive what to write for
+ * every chunk, the stored lengths go into the map as well.
+ */
+int compress_buffer(struct chunk_map *map, const char *buf, size_t len, uint64_t offset, char *zbuf, const char **out, uint32_t *outlen) {
+	struct cz_job job;
+	int n = (len + CZ_CHUNK - 1) / CZ_CHUNK, i;
+	uint32_t first = offset / CZ_CHUNK;
+
+	if (offset % CZ_CHUNK || first + n > map->count)
+		return -1;
+	job.src = buf;
+	job.zbuf = zbuf;
+	job.len = len;
+	job.chunk = CZ_CHUNK;
+	job.bound = LZ4_COMPRESSBOUND(CZ_CHUNK);
+	job.out = out;
+	job.outlen = outlen;
+	run_parallel(compress_one, &job, n);
+	for (i = 0; i < n; i++)
+		map->lens[first + i] = outlen[i];
+	return n;
+}
+
+struct dz_job {
+	const struct chunk_map *map;
+	uint64_t offset;
+	size_t len;
+	char *buf;
+	const char *zbuf;
+	int failed;
+};
+
+static void decompress_one(void *arg, int i) {
+	struct dz_job *job = (struct dz_job *)arg;
+	uint32_t c = job->offset / job->map->chunk + i;
+	size_t rel = (size_t)i * job->map->chunk;
+	size_t len = job->len - rel < job->map->chunk ? job->len - rel : job->map->chunk;
+	uint32_t stored = job->map->lens[c];
+
+	if (stored == 0)
+		memset(job->buf + rel, 0, len);
+	else if (stored != len && LZ4_decompress_safe(job->zbuf + rel, job->buf + rel, stored, len) != (int)len)
+		job->failed = 1;
+}
+
+/* turn the chunks read by cmap_read_chunks into logical data in buf */
+int decompress_buffer(const struct chunk_map *map, uint64_t offset, size_t len, char *buf, const char *zbuf) {
+	struct dz_job job;
+	job.map = map;
+	job.offset = offset;
+	job.len = len;
+	job.buf = buf;
+	job.zbuf = zbuf;
+	job.failed = 0;
+	run_parallel(decompress_one, &job, (len + map->chunk - 1) / map->chunk);
+	return job.failed ? -1 : 0;
+}
+
+/*
+ * aio reads of the chunks covering [offset, offset + len), offset chunk
+ * aligned: raw chunks straight into buf, lz4 blocks into zbuf at the
+ * same place. Returns the number of completions, expect receives the
+ * bytes each of them has to return, or -1 with nothing in flight. With
+ * q the completions count for that reactor request.
+ */
+int cmap_read_chunks(rados_striper_t striper, const char *key, const struct chunk_map *map, uint64_t offset, size_t len,
+		char *buf, char *zbuf, rados_completion_t *comps, size_t *expect, struct reactor_req *q) {
+	uint32_t c = offset / map->chunk;
+	size_t rel, clen;
+	int n = 0, ret;
+
+	for (rel = 0; rel < len; rel += map->chunk, c++) {
+		clen = len - rel < map->chunk ? len - rel : map->chunk;
+		if (map->lens[c] == 0)
+			continue;
+		if (q != NULL)
+			comps[n] = reactor_completion(q);
+		else if (rados_aio_create_completion(NULL, NULL, NULL, &comps[n]) < 0)
+			comps[n] = NULL;
+		if (comps[n] == NULL)
+			goto fail;
+		expect[n] = map->lens[c];
+		ret = rados_striper_aio_read(striper, key, comps[n], map->lens[c] == clen ? buf + rel : zbuf + rel,
+				map->lens[c], (uint64_t)c * map->chunk);
+		if (ret < 0) {
+			/* the completion never fires */
+			debug("error reading rados file %s at %" PRIu64 ": %d\n", key, (uint64_t)c * map->chunk, ret);
+			if (q != NULL)
+				reactor_unused(q, comps[n]);
+			else
+				rados_aio_release(comps[n]);
+			goto fail;
+		}
+		n++;
+	}
+	return n;
+fail:
+	/* the reads that went out still write into buf */
+	while (n-- > 0) {
+		rados_aio_wait_for_complete_and_cb(comps[n]);
+		rados_aio_release(comps[n]);
+	}
+	return -1;
+}
+
+/* len logical bytes at offset of a compressed object, synchronous */
+int read_logical(rados_striper_t striper, const char *key, const struct chunk_map *map, const struct crypt_info *ci,
+		char *buf, size_t len, uint64_t offset) {
+	uint64_t first = offset / map->chunk * map->chunk;
+	uint64_t end = offset + len > map->size ? map->size : offset + len;
+	/* whole chunks only, a lz4 block can not be cut */
+	uint64_t last = (end + map->chunk - 1) / map->chunk * map->chunk;
+	size_t span, i;
+	rados_completion_t *comps;
+	size_t *expect;
+	char *tmp = NULL, *ztmp = NULL;
+	int n, ret = -1;
+
+	if (offset >= map->size)
+		return 0;
+	span = (last > map->size ? map->size : last) - first;
+	tmp = malloc(span);
+	ztmp = malloc(span);
+	comps = calloc(span / map->chunk + 1, sizeof(rados_completion_t));
+	expect = calloc(span / map->chunk + 1, sizeof(size_t));
+	if (tmp == NULL || ztmp == NULL || comps == NULL || expect == NULL)
+		goto out;
+	n = cmap_read_chunks(striper, key, map, first, span, tmp, ztmp, comps, expect, NULL);
+	if (n < 0)
+		goto out;
+	ret = 0;
+	for (i = 0; i < (size_t)n; i++) {
+		rados_aio_wait_for_complete(comps[i]);
+		if (rados_aio_get_return_value(comps[i]) != (int)expect[i])
+			ret = -1;
+		rados_aio_release(comps[i]);
+	}
+	if (ret == 0 && ci != NULL && crypt_chunks(ci, map, first, span, tmp, ztmp) < 0)
+		ret = -1;
+	if (ret == 0 && decompress_buffer(map, first, span, tmp, ztmp) < 0)
+		ret = -1;
+	if (ret == 0) {
+		memcpy(buf, tmp + (offset - first), end - offset);
+		ret = end - offset;
+	}
+out:
+	free(tmp);
+	free(ztmp);
+	free(comps);
+	free(expect);
+	return ret;
+}
+
+int cmap_init(struct chunk_map *map, uint64_t size) {
+	map->chunk = CZ_CHUNK;
+	map->size = size;
+	map->count = (size + CZ_CHUNK - 1) / CZ_CHUNK;
+	map->lens = calloc(map->count ? map->count : 1, sizeof(uint32_t));
+	return map->lens ? 0 : -1;
+}
+
+void cmap_free(struct chunk_map *map) {
+	free(map->lens);
+	map->lens = NULL;
+}
+
+int cmap_store(rados_striper_t striper, const char *key, const struct chunk_map *map) {
+	size_t len = CMAP_HEADER + (size_t)map->count * 4;
+	char *buf = malloc(len);
+	uint32_t v32, i;
+	uint64_t v64;
+	int ret;
+
+	if (buf == NULL)
+		return -1;
+	memcpy(buf, "CMAP", 4);
+	v32 = htole32(map->chunk);
+	memcpy(buf + 4, &v32, 4);
+	v64 = htole64(map->size);
+	memcpy(buf + 8, &v64, 8);
+	v32 = htole32(map->count);
+	memcpy(buf + 16, &v32, 4);
+	for (i = 0; i < map->count; i++) {
+		v32 = htole32(map->lens[i]);
+		memcpy(buf + CMAP_HEADER + i * 4, &v32, 4);
+	}
+	ret = rados_striper_setxattr(striper, key, CMAP_XATTR, buf, len);
+	if (ret == 0)
+		ret = rados_striper_setxattr(striper, key, CODEC_XATTR, "lz4", 3);
+	free(buf);
+	return ret;
+}
+
+/*
+ * the chunk map of a compressed object of size bytes.
+ * 1: not compressed, 0: map loaded, -1: unusable (unknown codec, bad map)
+ */
+int cmap_load(rados_striper_t striper, const char *key, uint64_t size, struct chunk_map *map) {
+	char codec[16];
+	size_t len = CMAP_HEADER + ((size + CZ_CHUNK - 1) / CZ_CHUNK) * 4;
+	uint32_t v32, i;
+	uint64_t v64;
+	char *buf;
+	int ret;
+
+	memset(map, 0, sizeof(struct chunk_map));
+	ret = rados_striper_getxattr(striper, key, CODEC_XATTR, codec, sizeof(codec) - 1);
+	if (ret <= 0)
+		return 1;
+	codec[ret] = '\0';
+	if (strcmp(codec, "lz4") != 0) {
+		debug("%s is compressed with unknown codec %s\n", key, codec);
+		return -1;
+	}
+	buf = malloc(len);
+	if (buf == NULL)
+		return -1;
+	ret = rados_striper_getxattr(striper, key, CMAP_XATTR, buf, len);
+	if (ret < CMAP_HEADER || memcmp(buf, "CMAP", 4) != 0)
+		goto bad;
+	memcpy(&v32, buf + 4, 4);
+	map->chunk = le32toh(v32);
+	memcpy(&v64, buf + 8, 8);
+	map->size = le64toh(v64);
+	memcpy(&v32, buf + 16, 4);
+	map->count = le32toh(v32);
+	/* a read window of BUFFSIZE must hold whole chunks */
+	if (map->chunk < CZ_CHUNK || BUFFSIZE % map->chunk != 0 || map->size != size || map->count != (size + map->chunk - 1) / map->chunk ||
+			(size_t)ret != CMAP_HEADER + (size_t)map->count * 4)
+		goto bad;
+	map->lens = malloc(map->count * sizeof(uint32_t) + 1);
+	if (map->lens == NULL)
+		goto bad;
+	for (i = 0; i < map->count; i++) {
+		memcpy(&v32, buf + CMAP_HEADER + i * 4, 4);
+		map->lens[i] = le32toh(v32);
+		if (map->lens[i] > map->chunk)
+			goto bad;
+	}
+	free(buf);
+	return 0;
+bad:
+	debug("bad chunk map on %s\n", key);
+	cmap_free(map);
+	free(buf);
+	return -1;
+}
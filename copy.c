@@ -0,0 +1,387 @@
+/*
+ * copy.c
+ *
+ * "striprados cp <srcpool>/<key> <dstpool>/<key>" copies an object
+ * between pools, or to another key, without staging it on local disk.
+ * Both pools are opened on the one cluster connection. CP_WINDOW buffers
+ * of CP_PIECE bytes go round a ring: while a piece is written to the
+ * destination the next ones are already being read from the source.
+ *
+ * The stored bytes and the xattrs are copied as they are, so compressed
+ * or encrypted objects stay so and need no key. The destination gets the
+ * layout of its size and pool. "striprados cp <list>" copies every
+ * "<src> <dst>" line of the list, CP_PARALLEL objects at a time.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "crc32c.h"
+#include "striprados.h"
+
+#define CP_WINDOW 8
+#define CP_PIECE (4 << 20)
+#define CP_PARALLEL 4
+#define CP_MAX_POOLS 16
+/* xattrs libradosstriper keeps for itself */
+#define STRIPER_XATTR_PREFIX "striper."
+
+struct cp_pool {
+	char name[128];
+	rados_ioctx_t ioctx;
+	rados_striper_t striper;
+};
+
+struct cp_state {
+	rados_t rados;
+	pthread_mutex_t mutex;
+	struct cp_pool pools[CP_MAX_POOLS];
+	int npools;
+	/* the batch: pairs of "pool/key" */
+	char **src, **dst;
+	int n, next, copied;
+};
+
+struct cp_slot {
+	char *buf;
+	size_t len;
+	uint64_t offset;
+	rados_completion_t read, write;
+};
+
+/* split "pool/key" and open the pool once for all copies */
+static int cp_resolve(struct cp_state *st, const char *path, struct cp_pool **pool, const char **key) {
+	const char *slash = strchr(path, '/');
+	size_t len;
+	int i, ret = 0;
+
+	if (slash == NULL || slash == path || slash[1] == '\0' || (len = slash - path) >= sizeof(st->pools[0].name)) {
+		debug("%s is not <pool>/<key>\n", path);
+		return -1;
+	}
+	*key = slash + 1;
+	pthread_mutex_lock(&st->mutex);
+	for (i = 0; i < st->npools; i++) {
+		if (strlen(st->pools[i].name) == len && strncmp(st->pools[i].name, path, len) == 0)
+			break;
+	}
+	if (i == st->npools) {
+		if (i == CP_MAX_POOLS) {
+			debug("too many pools in one copy\n");
+			ret = -1;
+			goto out;
+		}
+		memcpy(st->pools[i].name, path, len);
+		st->pools[i].name[len] = '\0';
+		if (open_pool(st->rados, st->pools[i].name, &st->pools[i].ioctx, &st->pools[i].striper) < 0) {
+			ret = -1;
+			goto out;
+		}
+		st->npools++;
+	}
+	*pool = &st->pools[i];
+out:
+	pthread_mutex_unlock(&st->mutex);
+	return ret;
+}
+
+static int cp_wait(rados_completion_t *c) {
+	int ret;
+	if (*c == NULL)
+		return 0;
+	rados_aio_wait_for_complete(*c);
+	ret = rados_aio_get_return_value(*c);
+	rados_aio_release(*c);
+	*c = NULL;
+	return ret;
+}
+
+/* an op that could not be issued never completes, its completion goes at once */
+static int cp_issued(rados_completion_t *c, int ret) {
+	if (ret < 0) {
+		rados_aio_release(*c);
+		*c = NULL;
+	}
+	return ret;
+}
+
+static int cp_read(rados_striper_t striper, const char *key, struct cp_slot *s, uint64_t offset, size_t len) {
+	s->offset = offset;
+	s->len = len;
+	if (rados_aio_create_completion(NULL, NULL, NULL, &s->read) < 0) {
+		s->read = NULL;
+		return -1;
+	}
+	return cp_issued(&s->read, rados_striper_aio_read(striper, key, s->read, s->buf, len, offset));
+}
+
+/* the stored bytes, zero pieces stay holes of the truncated destination */
+static int cp_data(rados_striper_t from, const char *skey, rados_striper_t to, const char *dkey, uint64_t size, size_t piece) {
+	struct cp_slot slots[CP_WINDOW];
+	struct cp_slot *s, *prev;
+	uint64_t k, np = (size + piece - 1) / piece;
+	int i, ret = 0;
+
+	memset(slots, 0, sizeof(slots));
+	for (i = 0; i < CP_WINDOW; i++) {
+		slots[i].buf = malloc(piece);
+		if (slots[i].buf == NULL)
+			ret = -1;
+	}
+	for (k = 0; ret == 0 && k < np && k < CP_WINDOW; k++)
+		ret = cp_read(from, skey, &slots[k], k * piece, size - k * piece < piece ? size - k * piece : piece);
+
+	for (k = 0; ret == 0 && k < np && !quit; k++) {
+		s = &slots[k % CP_WINDOW];
+		if (cp_wait(&s->read) != (int)s->len) {
+			debug("failed to read %s at %" PRIu64 "\n", skey, s->offset);
+			ret = -1;
+			break;
+		}
+		if (!(sparse && k + 1 < np && buffer_is_zero(s->buf, s->len))) {
+			if (rados_aio_create_completion(NULL, NULL, NULL, &s->write) < 0) {
+				s->write = NULL;
+				ret = -1;
+				break;
+			}
+			if (cp_issued(&s->write, rados_striper_aio_write(to, dkey, s->write, s->buf, s->len, s->offset)) < 0) {
+				debug("failed to write %s at %" PRIu64 "\n", dkey, s->offset);
+				ret = -1;
+				break;
+			}
+		}
+		/* the buffer of the piece before is free once it is written */
+		if (k == 0)
+			continue;
+		prev = &slots[(k - 1) % CP_WINDOW];
+		if (cp_wait(&prev->write) < 0) {
+			debug("failed to write %s at %" PRIu64 "\n", dkey, prev->offset);
+			ret = -1;
+			break;
+		}
+		if (k - 1 + CP_WINDOW < np)
+			ret = cp_read(from, skey, prev, (k - 1 + CP_WINDOW) * piece,
+					size - (k - 1 + CP_WINDOW) * piece < piece ? size - (k - 1 + CP_WINDOW) * piece : piece);
+	}
+	for (i = 0; i < CP_WINDOW; i++) {
+		cp_wait(&slots[i].read);
+		if (cp_wait(&slots[i].write) < 0)
+			ret = -1;
+		free(slots[i].buf);
+	}
+	if (quit)
+		return -1;
+	return ret;
+}
+
+/* the codec and the cipher go last, they tell readers how to take the data */
+static int cp_xattrs(rados_striper_t from, const char *skey, rados_striper_t to, const char *dkey) {
+	rados_xattrs_iter_t iter;
+	const char *name, *val;
+	char codec[64], cipher[64];
+	size_t len, codec_len = 0, cipher_len = 0;
+	int ret;
+
+	ret = rados_striper_getxattrs(from, skey, &iter);
+	if (ret < 0)
+		return ret;
+	while (ret == 0 && rados_striper_getxattrs_next(iter, &name, &val, &len) == 0 && name != NULL) {
+		if (strncmp(name, STRIPER_XATTR_PREFIX, strlen(STRIPER_XATTR_PREFIX)) == 0)
+			continue;
+		if (strcmp(name, CODEC_XATTR) == 0 && len <= sizeof(codec)) {
+			memcpy(codec, val, len);
+			codec_len = len;
+		} else if (strcmp(name, CIPHER_XATTR) == 0 && len <= sizeof(cipher)) {
+			memcpy(cipher, val, len);
+			cipher_len = len;
+		} else {
+			ret = rados_striper_setxattr(to, dkey, name, val, len);
+		}
+	}
+	rados_striper_getxattrs_end(iter);
+	if (ret == 0 && codec_len)
+		ret = rados_striper_setxattr(to, dkey, CODEC_XATTR, codec, codec_len);
+	if (ret == 0 && cipher_len)
+		ret = rados_striper_setxattr(to, dkey, CIPHER_XATTR, cipher, cipher_len);
+	return ret;
+}
+
+static int cp_packed(struct cp_pool *src, const char *skey, rados_striper_t to, const char *dkey) {
+	char *data = NULL;
+	uint32_t len;
+	time_t mtime;
+	int ret;
+
+	if (pack_read(src->ioctx, skey, &data, &len, &mtime) < 0)
+		return -1;
+	ret = rados_striper_write_full(to, dkey, data, len);
+	free(data);
+	return ret;
+}
+
+static int cp_object(struct cp_pool *src, const char *skey, struct cp_pool *dst, const char *dkey) {
+	rados_striper_t to = dst->striper;
+	uint64_t size, align;
+	time_t mtime;
+	size_t piece = CP_PIECE;
+	int ret, own_striper, packed = 0;
+
+	if (src == dst && strcmp(skey, dkey) == 0) {
+		debug("%s/%s is copied onto itself\n", src->name, skey);
+		return -1;
+	}
+	ret = rados_striper_stat(src->striper, skey, &size, &mtime);
+	if (ret < 0 && pack_stat(src->ioctx, skey, &size, &mtime) == 0) {
+		packed = 1;
+	} else if (ret < 0) {
+		debug("no remote file or the file is not striped: %s/%s\n", src->name, skey);
+		return -1;
+	}
+
+	own_striper = layout_striper(dst->ioctx, size, &to);
+	if (own_striper < 0)
+		return -1;
+	/* nothing of an older object may survive under the new data */
+	rados_striper_trunc(to, dkey, 0);
+	rados_striper_rmxattr(to, dkey, SUMS_XATTR);
+	rados_striper_rmxattr(to, dkey, STRONG_XATTR);
+	rados_striper_rmxattr(to, dkey, DIGEST_XATTR);
+	rados_striper_rmxattr(to, dkey, CODEC_XATTR);
+	rados_striper_rmxattr(to, dkey, CMAP_XATTR);
+	rados_striper_rmxattr(to, dkey, CIPHER_XATTR);
+
+	if (packed) {
+		ret = cp_packed(src, skey, to, dkey);
+	} else {
+		/* whole stripes of an erasure coded destination */
+		align = pool_alignment(dst->ioctx);
+		if (align > 1)
+			piece = align > CP_PIECE ? align : CP_PIECE / align * align;
+		ret = size == 0 ? rados_striper_write_full(to, dkey, "", 0) : cp_data(src->striper, skey, to, dkey, size, piece);
+		if (ret == 0)
+			ret = cp_xattrs(src->striper, skey, to, dkey);
+	}
+	/* a packed copy would show up in the listing */
+	if (ret == 0)
+		pack_remove(dst->ioctx, dkey);
+	if (own_striper)
+		rados_striper_destroy(to);
+	if (ret < 0) {
+		debug("failed to copy %s/%s to %s/%s\n", src->name, skey, dst->name, dkey);
+		return -1;
+	}
+	debug("%s/%s copied to %s/%s\n", src->name, skey, dst->name, dkey);
+	return 0;
+}
+
+static int cp_pair(struct cp_state *st, const char *from, const char *to) {
+	struct cp_pool *src, *dst;
+	const char *skey, *dkey;
+	if (cp_resolve(st, from, &src, &skey) < 0 || cp_resolve(st, to, &dst, &dkey) < 0)
+		return -1;
+	return cp_object(src, skey, dst, dkey);
+}
+
+static void *cp_worker(void *arg) {
+	struct cp_state *st = (struct cp_state *)arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&st->mutex);
+		i = quit ? st->n : st->next++;
+		pthread_mutex_unlock(&st->mutex);
+		if (i >= st->n)
+			break;
+		if (cp_pair(st, st->src[i], st->dst[i]) == 0) {
+			pthread_mutex_lock(&st->mutex);
+			st->copied++;
+			pthread_mutex_unlock(&st->mutex);
+		}
+	}
+	return NULL;
+}
+
+static int cp_batch(struct cp_state *st, const char *list) {
+	pthread_t threads[CP_PARALLEL];
+	char *line = NULL, src[1024], dst[1024], **p;
+	size_t len = 0;
+	int i, started = 0, lineno = 0, ret = 0, cap = 0;
+	FILE *fp = fopen(list, "r");
+
+	if (fp == NULL) {
+		debug("can not open %s\n", list);
+		return -1;
+	}
+	while (getline(&line, &len, fp) != -1) {
+		lineno++;
+		if (sscanf(line, "%1023s %1023s", src, dst) != 2) {
+			if (sscanf(line, "%1023s", src) == 1) {
+				debug("bad copy line %s:%d, expected \"<pool>/<key> <pool>/<key>\"\n", list, lineno);
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		if (st->n == cap) {
+			cap = cap ? cap * 2 : 64;
+			if ((p = realloc(st->src, cap * sizeof(char *))) != NULL)
+				st->src = p;
+			if (p == NULL || (p = realloc(st->dst, cap * sizeof(char *))) == NULL) {
+				ret = -1;
+				break;
+			}
+			st->dst = p;
+		}
+		st->src[st->n] = strdup(src);
+		st->dst[st->n] = strdup(dst);
+		st->n++;
+	}
+	free(line);
+	fclose(fp);
+
+	for (i = 0; ret == 0 && i < CP_PARALLEL && i < st->n; i++) {
+		if (pthread_create(&threads[i], NULL, cp_worker, st) != 0)
+			break;
+		started++;
+	}
+	if (ret == 0 && started == 0 && st->n > 0)
+		ret = -1;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	if (started > 0)
+		debug("%d of %d objects copied\n", st->copied, st->n);
+	if (st->copied < st->n)
+		ret = -1;
+
+	for (i = 0; i < st->n; i++) {
+		free(st->src[i]);
+		free(st->dst[i]);
+	}
+	free(st->src);
+	free(st->dst);
+	return ret;
+}
+
+/* dst NULL: from is a list of "<src> <dst>" lines */
+int do_cp(rados_t rados, const char *from, const char *to) {
+	struct cp_state st;
+	int i, ret;
+
+	memset(&st, 0, sizeof(st));
+	st.rados = rados;
+	pthread_mutex_init(&st.mutex, NULL);
+	if (to != NULL)
+		ret = cp_pair(&st, from, to);
+	else
+		ret = cp_batch(&st, from);
+	for (i = 0; i < st.npools; i++) {
+		rados_striper_destroy(st.pools[i].striper);
+		rados_ioctx_destroy(st.pools[i].ioctx);
+	}
+	pthread_mutex_destroy(&st.mutex);
+	return ret;
+}
@@ -0,0 +1,280 @@
+/*
+ * crc32c.c
+ *
+ * the hardware path feeds 8 bytes per crc32 instruction, the fallback is
+ * the usual slicing-by-8 table. Both give the standard CRC32C, so sums
+ * written on one machine verify on any other.
+ *
+ * The strong digests next to the sums are SHA-256 from libcrypto.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <endian.h>
+#include <openssl/evp.h>
+#include "crc32c.h"
+
+#define POLY 0x82f63b78
+
+static uint32_t table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t v;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v = le64toh(v) ^ crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+			table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+			table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+			table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc, v;
+	while (len && ((uintptr_t)p & 7)) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+#endif
+
+static void crc32c_init(void) {
+	uint32_t c;
+	int i, j;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = table[0][table[j - 1][i] & 0xff] ^ (table[j - 1][i] >> 8);
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_impl(~crc, (const unsigned char *)buf, len);
+}
+
+int sums_init(struct chunk_sums *s, uint64_t total) {
+	memset(s, 0, sizeof(struct chunk_sums));
+	s->chunk = SUMS_MIN_CHUNK;
+	while (total / s->chunk >= SUMS_MAX_COUNT)
+		s->chunk <<= 1;
+	s->capacity = total / s->chunk + 1;
+	s->crcs = malloc(s->capacity * sizeof(uint32_t));
+	return s->crcs ? 0 : -1;
+}
+
+int sums_strong(struct chunk_sums *s) {
+	s->strong = malloc(s->capacity * STRONG_LEN);
+	s->md = EVP_MD_CTX_new();
+	if (s->strong == NULL || s->md == NULL || EVP_DigestInit_ex(s->md, EVP_sha256(), NULL) != 1)
+		return -1;
+	return 0;
+}
+
+/* the digest of the chunk just finished, the next one starts */
+static int strong_push(struct chunk_sums *s) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	if (EVP_DigestFinal_ex(s->md, md, &len) != 1 || EVP_DigestInit_ex(s->md, EVP_sha256(), NULL) != 1)
+		return -1;
+	memcpy(s->strong + (size_t)s->count * STRONG_LEN, md, STRONG_LEN);
+	return 0;
+}
+
+static int sums_push(struct chunk_sums *s, uint32_t crc) {
+	uint32_t *tmp;
+	unsigned char *stmp;
+	/* a growing source can outrun the size guessed at init */
+	if (s->count == s->capacity) {
+		tmp = realloc(s->crcs, s->capacity * 2 * sizeof(uint32_t));
+		if (tmp == NULL)
+			return -1;
+		s->crcs = tmp;
+		if (s->strong != NULL) {
+			stmp = realloc(s->strong, (size_t)s->capacity * 2 * STRONG_LEN);
+			if (stmp == NULL)
+				return -1;
+			s->strong = stmp;
+		}
+		s->capacity *= 2;
+	}
+	if (s->md != NULL && strong_push(s) < 0)
+		return -1;
+	s->crcs[s->count++] = crc;
+	return 0;
+}
+
+int sums_update(struct chunk_sums *s, const void *buf, size_t len) {
+	const char *p = buf;
+	size_t in, n;
+	while (len > 0) {
+		in = s->size % s->chunk;
+		n = s->chunk - in < len ? s->chunk - in : len;
+		s->crc = crc32c(s->crc, p, n);
+		if (s->md != NULL && EVP_DigestUpdate(s->md, p, n) != 1)
+			return -1;
+		s->size += n;
+		p += n;
+		len -= n;
+		if (s->size % s->chunk == 0) {
+			if (sums_push(s, s->crc) < 0)
+				return -1;
+			s->crc = 0;
+		}
+	}
+	return 0;
+}
+
+int sums_zero(struct chunk_sums *s, uint64_t len) {
+	static const char zeros[65536];
+	size_t n;
+	for (; len > 0; len -= n) {
+		n = len < sizeof(zeros) ? len : sizeof(zeros);
+		if (sums_update(s, zeros, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int sums_finish(struct chunk_sums *s) {
+	if (s->count * (uint64_t)s->chunk < s->size)
+		return sums_push(s, s->crc);
+	return 0;
+}
+
+uint32_t sums_whole(const struct chunk_sums *s) {
+	uint32_t le, crc = 0;
+	uint32_t i;
+	for (i = 0; i < s->count; i++) {
+		le = htole32(s->crcs[i]);
+		crc = crc32c(crc, &le, sizeof(le));
+	}
+	return crc;
+}
+
+void sums_free(struct chunk_sums *s) {
+	free(s->crcs);
+	s->crcs = NULL;
+	free(s->strong);
+	s->strong = NULL;
+	EVP_MD_CTX_free(s->md);
+	s->md = NULL;
+}
+
+#define SUMS_HEADER 20
+
+char *sums_encode(const struct chunk_sums *s, size_t *len) {
+	char *buf = malloc(SUMS_HEADER + s->count * sizeof(uint32_t));
+	uint32_t v32;
+	uint64_t v64;
+	uint32_t i;
+	if (buf == NULL)
+		return NULL;
+	memcpy(buf, "C32C", 4);
+	v32 = htole32(s->chunk);
+	memcpy(buf + 4, &v32, 4);
+	v64 = htole64(s->size);
+	memcpy(buf + 8, &v64, 8);
+	v32 = htole32(s->count);
+	memcpy(buf + 16, &v32, 4);
+	for (i = 0; i < s->count; i++) {
+		v32 = htole32(s->crcs[i]);
+		memcpy(buf + SUMS_HEADER + i * 4, &v32, 4);
+	}
+	*len = SUMS_HEADER + s->count * sizeof(uint32_t);
+	return buf;
+}
+
+int sums_decode(struct chunk_sums *s, const char *buf, size_t len) {
+	uint32_t v32;
+	uint64_t v64;
+	uint32_t i;
+
+	memset(s, 0, sizeof(struct chunk_sums));
+	if (len < SUMS_HEADER || memcmp(buf, "C32C", 4) != 0)
+		return -1;
+	memcpy(&v32, buf + 4, 4);
+	s->chunk = le32toh(v32);
+	memcpy(&v64, buf + 8, 8);
+	s->size = le64toh(v64);
+	memcpy(&v32, buf + 16, 4);
+	s->count = le32toh(v32);
+	if (s->chunk == 0 || len != SUMS_HEADER + (size_t)s->count * 4 ||
+			s->count != (s->size + s->chunk - 1) / s->chunk)
+		return -1;
+	s->capacity = s->count ? s->count : 1;
+	s->crcs = malloc(s->capacity * sizeof(uint32_t));
+	if (s->crcs == NULL)
+		return -1;
+	for (i = 0; i < s->count; i++) {
+		memcpy(&v32, buf + SUMS_HEADER + i * 4, 4);
+		s->crcs[i] = le32toh(v32);
+	}
+	return 0;
+}
+
+#define STRONG_HEADER 8
+
+char *strong_encode(const struct chunk_sums *s, size_t *len) {
+	char *buf = malloc(STRONG_HEADER + (size_t)s->count * STRONG_LEN);
+	uint32_t v32;
+	if (buf == NULL)
+		return NULL;
+	memcpy(buf, "S256", 4);
+	v32 = htole32(s->count);
+	memcpy(buf + 4, &v32, 4);
+	memcpy(buf + STRONG_HEADER, s->strong, (size_t)s->count * STRONG_LEN);
+	*len = STRONG_HEADER + (size_t)s->count * STRONG_LEN;
+	return buf;
+}
+
+int strong_decode(struct chunk_sums *s, const char *buf, size_t len) {
+	uint32_t v32;
+	if (len < STRONG_HEADER || memcmp(buf, "S256", 4) != 0)
+		return -1;
+	memcpy(&v32, buf + 4, 4);
+	/* the digests of other sums than these */
+	if (le32toh(v32) != s->count || len != STRONG_HEADER + (size_t)s->count * STRONG_LEN)
+		return -1;
+	free(s->strong);
+	s->strong = malloc(s->capacity * STRONG_LEN);
+	if (s->strong == NULL)
+		return -1;
+	memcpy(s->strong, buf + STRONG_HEADER, (size_t)s->count * STRONG_LEN);
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * crc32c.h
+ *
+ * CRC32C (Castagnoli) with the SSE4.2 crc32 instruction when the cpu has
+ * it, and per chunk sums of a stream as stored on the head object.
+ */
+
+#ifndef __crc32c_h__
+#define __crc32c_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* xattr on the head object holding the chunk sums of the whole object */
+#define SUMS_XATTR "striprados.crc32c"
+/* smallest chunk, the list is kept under SUMS_MAX_COUNT entries by doubling it */
+#define SUMS_MIN_CHUNK (2 << 20)
+#define SUMS_MAX_COUNT 16384
+/*
+ * xattr with a strong digest per chunk, the first STRONG_LEN bytes of its
+ * SHA-256: a crc32c match alone is no proof that a chunk is unchanged
+ */
+#define STRONG_XATTR "striprados.sha256s"
+#define STRONG_LEN 16
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+struct chunk_sums {
+	uint32_t chunk;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t size;
+	uint32_t *crcs;
+	/* running crc of the unfinished last chunk */
+	uint32_t crc;
+	/* count digests of STRONG_LEN and the running one, NULL unless sums_strong */
+	unsigned char *strong;
+	void *md;
+};
+
+/* total is the expected stream size, it only picks the chunk size */
+int sums_init(struct chunk_sums *s, uint64_t total);
+/* keep strong digests as well, right after sums_init */
+int sums_strong(struct chunk_sums *s);
+int sums_update(struct chunk_sums *s, const void *buf, size_t len);
+/* len zero bytes, for holes that are never read */
+int sums_zero(struct chunk_sums *s, uint64_t len);
+/* close the short last chunk, after the final update */
+int sums_finish(struct chunk_sums *s);
+/* whole object hash: crc32c over the chunk sums */
+uint32_t sums_whole(const struct chunk_sums *s);
+void sums_free(struct chunk_sums *s);
+
+/* the xattr value, little endian: "C32C" chunk size count crcs... */
+char *sums_encode(const struct chunk_sums *s, size_t *len);
+int sums_decode(struct chunk_sums *s, const char *buf, size_t len);
+/* the STRONG_XATTR value: "S256" count digests..., decoded into decoded sums */
+char *strong_encode(const struct chunk_sums *s, size_t *len);
+int strong_decode(struct chunk_sums *s, const char *buf, size_t len);
+
+#endif
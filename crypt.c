@@ -0,0 +1,205 @@
+/*
+ * crypt.c
+ *
+ * optional client side encryption (--key-file). AES-256 in CTR mode:
+ * the stored bytes at object offset o are the data xored with the key
+ * stream block (nonce + o / 16), so the size does not change and any
+ * range, compressed chunks included, is decrypted without reading the
+ * bytes before it. OpenSSL uses AES-NI when the cpu has it; buffers are
+ * cut in CRYPT_PIECE parts that run on the compression worker threads.
+ *
+ * A fresh random nonce is taken for every upload. The head object carries
+ * the cipher, the nonce and the id of the key (the first bytes of its
+ * sha256), never the key itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "striprados.h"
+
+#define CRYPT_PIECE (1 << 20)
+#define CRYPT_CIPHER "aes-256-ctr"
+
+/* the iv of the aes block at offset: nonce + offset / 16, big endian */
+static void crypt_iv(const struct crypt_info *ci, uint64_t offset, unsigned char *iv) {
+	uint64_t add = offset / 16;
+	unsigned int sum;
+	int i;
+	memcpy(iv, ci->nonce, CRYPT_NONCE_LEN);
+	for (i = CRYPT_NONCE_LEN - 1; i >= 0 && add; i--) {
+		sum = iv[i] + (add & 0xff);
+		iv[i] = sum;
+		add = (add >> 8) + (sum >> 8);
+	}
+}
+
+static int crypt_range(const struct crypt_info *ci, char *buf, size_t len, uint64_t offset) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	unsigned char iv[CRYPT_NONCE_LEN], skip[16];
+	int out, ret = -1;
+
+	if (ctx == NULL)
+		return -1;
+	crypt_iv(ci, offset, iv);
+	if (EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, ci->key->key, iv) != 1)
+		goto out;
+	/* an offset inside an aes block: throw away the key stream before it */
+	if (offset % 16 && EVP_EncryptUpdate(ctx, skip, &out, skip, offset % 16) != 1)
+		goto out;
+	if (EVP_EncryptUpdate(ctx, (unsigned char *)buf, &out, (unsigned char *)buf, len) != 1)
+		goto out;
+	ret = 0;
+out:
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
+
+struct crypt_job {
+	const struct crypt_info *ci;
+	char *buf;
+	size_t len;
+	uint64_t offset;
+	int failed;
+};
+
+static void crypt_one(void *arg, int i) {
+	struct crypt_job *job = (struct crypt_job *)arg;
+	size_t rel = (size_t)i * CRYPT_PIECE;
+	size_t len = job->len - rel < CRYPT_PIECE ? job->len - rel : CRYPT_PIECE;
+	if (crypt_range(job->ci, job->buf + rel, len, job->offset + rel) < 0)
+		job->failed = 1;
+}
+
+/* encrypt or decrypt in place len bytes stored at offset of the object */
+int crypt_buffer(const struct crypt_info *ci, char *buf, size_t len, uint64_t offset) {
+	struct crypt_job job;
+	if (len <= CRYPT_PIECE)
+		return crypt_range(ci, buf, len, offset);
+	job.ci = ci;
+	job.buf = buf;
+	job.len = len;
+	job.offset = offset;
+	job.failed = 0;
+	run_parallel(crypt_one, &job, (len + CRYPT_PIECE - 1) / CRYPT_PIECE);
+	return job.failed ? -1 : 0;
+}
+
+/* the stored chunks cmap_read_chunks put in buf and zbuf */
+int crypt_chunks(const struct crypt_info *ci, const struct chunk_map *map, uint64_t offset, size_t len, char *buf, char *zbuf) {
+	uint32_t c = offset / map->chunk;
+	size_t rel, clen;
+
+	for (rel = 0; rel < len; rel += map->chunk, c++) {
+		clen = len - rel < map->chunk ? len - rel : map->chunk;
+		if (map->lens[c] == 0)
+			continue;
+		if (crypt_buffer(ci, map->lens[c] == clen ? buf + rel : zbuf + rel, map->lens[c], (uint64_t)c * map->chunk) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* the key file holds 32 raw bytes or 64 hex digits */
+int crypt_load_key(const char *path, struct crypt_key *k) {
+	unsigned char raw[80], digest[EVP_MAX_MD_SIZE];
+	unsigned int dlen;
+	size_t n;
+	int i, hi, lo;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		debug("can not open key file %s\n", path);
+		return -1;
+	}
+	n = fread(raw, 1, sizeof(raw), fp);
+	fclose(fp);
+	while (n > CRYPT_KEY_LEN && (raw[n - 1] == '\n' || raw[n - 1] == '\r'))
+		n--;
+	if (n == CRYPT_KEY_LEN) {
+		memcpy(k->key, raw, CRYPT_KEY_LEN);
+	} else if (n == CRYPT_KEY_LEN * 2) {
+		for (i = 0; i < CRYPT_KEY_LEN; i++) {
+			hi = hex_value(raw[i * 2]);
+			lo = hex_value(raw[i * 2 + 1]);
+			if (hi < 0 || lo < 0)
+				goto bad;
+			k->key[i] = hi << 4 | lo;
+		}
+	} else {
+		goto bad;
+	}
+	if (EVP_Digest(k->key, CRYPT_KEY_LEN, digest, &dlen, EVP_sha256(), NULL) != 1)
+		goto bad;
+	for (i = 0; i < CRYPT_KEYID_LEN / 2; i++)
+		sprintf(k->id + i * 2, "%02x", digest[i]);
+	return 0;
+bad:
+	debug("key file %s must hold 32 bytes or 64 hex digits\n", path);
+	memset(raw, 0, sizeof(raw));
+	return -1;
+}
+
+int crypt_new(const struct crypt_key *k, struct crypt_info *ci) {
+	ci->key = k;
+	return RAND_bytes(ci->nonce, CRYPT_NONCE_LEN) == 1 ? 0 : -1;
+}
+
+/* the cipher goes last, it marks the object as encrypted */
+int crypt_store(rados_striper_t striper, const char *key, const struct crypt_info *ci) {
+	int ret = rados_striper_setxattr(striper, key, NONCE_XATTR, (const char *)ci->nonce, CRYPT_NONCE_LEN);
+	if (ret == 0)
+		ret = rados_striper_setxattr(striper, key, KEYID_XATTR, ci->key->id, CRYPT_KEYID_LEN);
+	if (ret == 0)
+		ret = rados_striper_setxattr(striper, key, CIPHER_XATTR, CRYPT_CIPHER, strlen(CRYPT_CIPHER));
+	return ret;
+}
+
+/* the three xattrs of an encrypted object, checked against the loaded key */
+int crypt_parse(struct crypt_info *ci, const char *key, const char *cipher, size_t cipher_len,
+		const char *nonce, size_t nonce_len, const char *keyid, size_t keyid_len) {
+	if (cipher_len != strlen(CRYPT_CIPHER) || memcmp(cipher, CRYPT_CIPHER, cipher_len) != 0) {
+		debug("%s is encrypted with an unknown cipher\n", key);
+		return -1;
+	}
+	if (crypt_key == NULL) {
+		debug("%s is encrypted, a key is needed (--key-file)\n", key);
+		return -1;
+	}
+	if (nonce_len != CRYPT_NONCE_LEN || keyid_len != CRYPT_KEYID_LEN) {
+		debug("bad encryption header on %s\n", key);
+		return -1;
+	}
+	if (memcmp(keyid, crypt_key->id, CRYPT_KEYID_LEN) != 0) {
+		debug("%s is encrypted with key %.*s, not %s\n", key, CRYPT_KEYID_LEN, keyid, crypt_key->id);
+		return -1;
+	}
+	ci->key = crypt_key;
+	memcpy(ci->nonce, nonce, CRYPT_NONCE_LEN);
+	return 0;
+}
+
+/* 1: not encrypted, 0: ci is ready, -1: can not be decrypted */
+int crypt_load(rados_striper_t striper, const char *key, struct crypt_info *ci) {
+	char cipher[32], nonce[CRYPT_NONCE_LEN], keyid[CRYPT_KEYID_LEN];
+	int clen, nlen, klen;
+
+	clen = rados_striper_getxattr(striper, key, CIPHER_XATTR, cipher, sizeof(cipher));
+	if (clen <= 0)
+		return 1;
+	nlen = rados_striper_getxattr(striper, key, NONCE_XATTR, nonce, sizeof(nonce));
+	klen = rados_striper_getxattr(striper, key, KEYID_XATTR, keyid, sizeof(keyid));
+	return crypt_parse(ci, key, cipher, clen, nonce, nlen < 0 ? 0 : nlen, keyid, klen < 0 ? 0 : klen);
+}
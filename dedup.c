@@ -0,0 +1,248 @@
+/*
+ * dedup.c
+ *
+ * opt-in upload dedup (-D). The local file is hashed first with the same
+ * chunk sums put_fd stores (crc32c.h) and with SHA-256. A 32 bit sum can
+ * collide, skipping an upload on it would lose data, so content is only
+ * taken as equal when the SHA-256 matches too. Uploads with -D leave it
+ * in DIGEST_XATTR, every writer of an object drops it first.
+ *
+ *	- if the target key already holds an object of that size with the
+ *	  same chunk sums and digest, nothing is written;
+ *	- otherwise the index object DEDUP_INDEX maps "<sha256>:<size>"
+ *	  to the last key uploaded with that content. A candidate is only
+ *	  trusted after its stored chunk sums and digest match too, and the
+ *	  new key is reported as its duplicate without transferring any data.
+ *
+ * The index is a hint: entries of deleted or rewritten keys fail the
+ * comparison and are replaced by the next upload.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include "crc32c.h"
+#include "striprados.h"
+
+#define DEDUP_INDEX "striprados.dedup.index"
+
+#define SUMS_THREADS 4
+
+struct sums_job {
+	int fd;
+	struct chunk_sums *s;
+	uint64_t size;
+	uint32_t next;
+	int failed;
+};
+
+static void *sums_worker(void *arg) {
+	struct sums_job *job = (struct sums_job *)arg;
+	struct chunk_sums *s = job->s;
+	uint64_t offset, len, done;
+	uint32_t i;
+	ssize_t n;
+	char *buf = malloc(s->chunk < BUFFSIZE ? s->chunk : BUFFSIZE);
+	EVP_MD_CTX *md = s->strong ? EVP_MD_CTX_new() : NULL;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int dlen;
+
+	if (buf == NULL || (s->strong && md == NULL)) {
+		job->failed = 1;
+		free(buf);
+		EVP_MD_CTX_free(md);
+		return NULL;
+	}
+	while (!quit && !job->failed && (i = __sync_fetch_and_add(&job->next, 1)) < s->count) {
+		offset = (uint64_t)i * s->chunk;
+		len = job->size - offset < s->chunk ? job->size - offset : s->chunk;
+		s->crcs[i] = 0;
+		if (md != NULL && EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1)
+			job->failed = 1;
+		for (done = 0; done < len && !job->failed; done += n) {
+			n = pread(job->fd, buf, len - done < BUFFSIZE ? len - done : BUFFSIZE, offset + done);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n <= 0) {
+				job->failed = 1;
+				break;
+			}
+			s->crcs[i] = crc32c(s->crcs[i], buf, n);
+			if (md != NULL && EVP_DigestUpdate(md, buf, n) != 1)
+				job->failed = 1;
+		}
+		if (md != NULL && !job->failed) {
+			if (EVP_DigestFinal_ex(md, digest, &dlen) == 1)
+				memcpy(s->strong + (size_t)i * STRONG_LEN, digest, STRONG_LEN);
+			else
+				job->failed = 1;
+		}
+	}
+	free(buf);
+	EVP_MD_CTX_free(md);
+	return NULL;
+}
+
+/*
+ * chunk sums of the first size bytes of fd, hashed by SUMS_THREADS threads.
+ * chunk 0 picks the chunk size put_fd would use, strong adds the digests.
+ */
+int sums_file(int fd, uint64_t size, uint32_t chunk, int strong, struct chunk_sums *s) {
+	pthread_t threads[SUMS_THREADS];
+	struct sums_job job;
+	int i, n;
+
+	if (sums_init(s, size) < 0)
+		return -1;
+	if (chunk != 0)
+		s->chunk = chunk;
+	s->count = (size + s->chunk - 1) / s->chunk;
+	if (s->count > s->capacity) {
+		free(s->crcs);
+		s->capacity = s->count;
+		s->crcs = malloc(s->capacity * sizeof(uint32_t));
+		if (s->crcs == NULL)
+			return -1;
+	}
+	s->size = size;
+	if (strong && (s->strong = malloc((size_t)s->capacity * STRONG_LEN)) == NULL) {
+		sums_free(s);
+		return -1;
+	}
+
+	job.fd = fd;
+	job.s = s;
+	job.size = size;
+	job.next = 0;
+	job.failed = 0;
+	for (n = 0; n < SUMS_THREADS; n++) {
+		if (pthread_create(&threads[n], NULL, sums_worker, &job) != 0)
+			break;
+	}
+	if (n == 0)
+		sums_worker(&job);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	if (job.failed || quit) {
+		sums_free(s);
+		return -1;
+	}
+	return 0;
+}
+
+/* the chunk sums put_fd would store and the SHA-256 of the first size bytes of fd, in one pass */
+int hash_file(int fd, uint64_t size, struct chunk_sums *s, unsigned char *digest) {
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	char *buf = malloc(BUFFSIZE);
+	uint64_t done = 0;
+	unsigned int dlen;
+	ssize_t n;
+	int ret = -1;
+
+	if (sums_init(s, size) < 0 || ctx == NULL || buf == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+		goto out;
+	while (!quit && done < size) {
+		n = pread(fd, buf, size - done < BUFFSIZE ? size - done : BUFFSIZE, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || sums_update(s, buf, n) < 0 || EVP_DigestUpdate(ctx, buf, n) != 1)
+			goto out;
+		done += n;
+	}
+	if (done == size && sums_finish(s) == 0 && EVP_DigestFinal_ex(ctx, digest, &dlen) == 1)
+		ret = 0;
+out:
+	if (ret < 0)
+		sums_free(s);
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return ret;
+}
+
+/* does key hold exactly the data summed in local */
+static int same_content(rados_striper_t striper, const char *key, const struct chunk_sums *local, const unsigned char *digest) {
+	struct chunk_sums remote;
+	unsigned char stored[DIGEST_LEN];
+	int same;
+	if (sums_load(striper, key, local->size, &remote) < 0)
+		return 0;
+	same = remote.chunk == local->chunk && remote.count == local->count &&
+		memcmp(remote.crcs, local->crcs, local->count * sizeof(uint32_t)) == 0;
+	sums_free(&remote);
+	/* the sums are only a quick no, equal content needs the digest */
+	return same && rados_striper_getxattr(striper, key, DIGEST_XATTR, (char *)stored, DIGEST_LEN) == DIGEST_LEN &&
+		memcmp(stored, digest, DIGEST_LEN) == 0;
+}
+
+static void index_key(char *name, const struct chunk_sums *local, const unsigned char *digest) {
+	int i;
+	for (i = 0; i < DIGEST_LEN; i++)
+		name += sprintf(name, "%02x", digest[i]);
+	sprintf(name, ":%" PRIu64, local->size);
+}
+
+/*
+ * returns 1 when key already holds the data, 2 with *dup set when another
+ * key does, 0 when the data has to be uploaded
+ */
+int dedup_lookup(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const struct chunk_sums *local,
+		const unsigned char *digest, char **dup) {
+	char name[DIGEST_LEN * 2 + 32];
+	const char *keys[1] = {name};
+	rados_read_op_t op;
+	rados_omap_iter_t iter;
+	char *k, *v;
+	size_t len;
+	int prval = 0, ret = 0;
+
+	*dup = NULL;
+	if (same_content(striper, key, local, digest))
+		return 1;
+
+	index_key(name, local, digest);
+	op = rados_create_read_op();
+	rados_read_op_omap_get_vals_by_keys(op, keys, 1, &iter, &prval);
+	if (rados_read_op_operate(op, ioctx, DEDUP_INDEX, 0) == 0 && prval == 0) {
+		if (rados_omap_get_next(iter, &k, &v, &len) == 0 && k != NULL && v != NULL) {
+			*dup = strndup(v, len);
+			if (*dup != NULL && strcmp(*dup, key) != 0 && same_content(striper, *dup, local, digest))
+				ret = 2;
+		}
+		rados_omap_get_end(iter);
+	}
+	rados_release_read_op(op);
+	if (ret != 2) {
+		free(*dup);
+		*dup = NULL;
+	}
+	return ret;
+}
+
+/* remember key as the holder of the content in local */
+int dedup_record(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const struct chunk_sums *local,
+		const unsigned char *digest) {
+	char name[DIGEST_LEN * 2 + 32];
+	const char *keys[1] = {name};
+	const char *vals[1] = {key};
+	size_t lens[1] = {strlen(key)};
+	rados_write_op_t op;
+	int ret;
+
+	ret = rados_striper_setxattr(striper, key, DIGEST_XATTR, (const char *)digest, DIGEST_LEN);
+	if (ret < 0)
+		return ret;
+	index_key(name, local, digest);
+	op = rados_create_write_op();
+	rados_write_op_omap_set(op, keys, vals, lens, 1);
+	ret = rados_write_op_operate(op, ioctx, DEDUP_INDEX, NULL, 0);
+	rados_release_write_op(op);
+	return ret;
+}
@@ -0,0 +1,174 @@
+/*
+ * delta.c
+ *
+ * delta re-upload (-U): rewrite only the chunks of an object that differ
+ * from the local file. The local file is hashed in parallel with the
+ * chunk size of the sums stored on the object (crc32c.h), every chunk
+ * whose crc32c or strong digest differs is written at its offset, runs
+ * of changed chunks are merged into writes of up to BUFFSIZE. A crc32c
+ * match alone could be a collision and leave stale data behind. At the end the object is
+ * truncated to the new size, growth needs no extra step since the new
+ * tail chunks are all "changed".
+ *
+ * Objects without usable sums or digests fall back to a full overwrite,
+ * which stores both.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "crc32c.h"
+#include "striprados.h"
+
+#define DELTA_WINDOW 4
+
+struct delta_write {
+	char *buf;
+	rados_completion_t completion;
+	int busy;
+	double issued;
+};
+
+static int delta_wait(struct delta_write *w, const char *key) {
+	int ret;
+	if (!w->busy)
+		return 0;
+	rados_aio_wait_for_safe(w->completion);
+	qos_done(w->issued);
+	ret = rados_aio_get_return_value(w->completion);
+	rados_aio_release(w->completion);
+	w->busy = 0;
+	if (ret < 0)
+		debug("failed to write %s errno: %d\n", key, ret);
+	return ret;
+}
+
+/* chunk i is unchanged: same crc32c and digest over the same length */
+static int same_chunk(const struct chunk_sums *local, const struct chunk_sums *remote, uint32_t i) {
+	uint64_t end = (uint64_t)(i + 1) * local->chunk;
+	if (i >= remote->count || local->crcs[i] != remote->crcs[i] ||
+			memcmp(local->strong + (size_t)i * STRONG_LEN, remote->strong + (size_t)i * STRONG_LEN, STRONG_LEN) != 0)
+		return 0;
+	return (end <= local->size ? end : local->size) == (end <= remote->size ? end : remote->size);
+}
+
+int put_delta(rados_striper_t striper, const char *key, int fd, uint64_t size, uint16_t concurrent) {
+	struct chunk_sums remote, local;
+	struct delta_write writes[DELTA_WINDOW];
+	uint64_t remote_size, offset, end, written = 0;
+	uint32_t i, j, changed = 0;
+	time_t mtime;
+	ssize_t n;
+	size_t step = write_step();
+	char codec[16];
+	int slot = 0, ret = 0;
+
+	/* chunks of a compressed object are not at their logical length, an encrypted one needs a fresh nonce */
+	if (compression || crypt_key || rados_striper_getxattr(striper, key, CODEC_XATTR, codec, sizeof(codec)) > 0 ||
+			rados_striper_getxattr(striper, key, CIPHER_XATTR, codec, sizeof(codec)) > 0) {
+		debug("%s is compressed or encrypted, uploading all of it\n", key);
+		return put_fd(striper, key, fd, size, concurrent, 1);
+	}
+	if (rados_striper_stat(striper, key, &remote_size, &mtime) < 0 ||
+			sums_load(striper, key, remote_size, &remote) < 0) {
+		debug("%s has no stored checksums, uploading all of it\n", key);
+		return put_fd(striper, key, fd, size, concurrent, 1);
+	}
+	if (strong_load(striper, key, &remote) < 0) {
+		debug("%s has no stored digests, uploading all of it\n", key);
+		sums_free(&remote);
+		return put_fd(striper, key, fd, size, concurrent, 1);
+	}
+
+	if (sums_file(fd, size, remote.chunk, 1, &local) < 0) {
+		debug("failed to hash the local file\n");
+		sums_free(&remote);
+		return -1;
+	}
+
+	memset(writes, 0, sizeof(writes));
+	for (i = 0; i < DELTA_WINDOW; i++) {
+		writes[i].buf = malloc(BUFFSIZE);
+		if (writes[i].buf == NULL) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	/* the object is inconsistent with its sums until the end */
+	rados_striper_rmxattr(striper, key, SUMS_XATTR);
+	rados_striper_rmxattr(striper, key, STRONG_XATTR);
+	rados_striper_rmxattr(striper, key, DIGEST_XATTR);
+
+	for (i = 0; !quit && ret == 0 && i < local.count; i = j) {
+		if (same_chunk(&local, &remote, i)) {
+			j = i + 1;
+			continue;
+		}
+		/* merge the run of changed chunks starting at i */
+		for (j = i + 1; j < local.count && (uint64_t)(j - i) * local.chunk < BUFFSIZE; j++) {
+			if (same_chunk(&local, &remote, j))
+				break;
+		}
+		changed += j - i;
+		offset = (uint64_t)i * local.chunk;
+		end = (uint64_t)j * local.chunk < size ? (uint64_t)j * local.chunk : size;
+		/* full stripes on erasure coded pools, the extra bytes are unchanged ones */
+		if (write_align > 1) {
+			offset = offset / write_align * write_align;
+			end = (end + write_align - 1) / write_align * write_align;
+			if (end > size)
+				end = size;
+		}
+
+		/* chunks of huge objects are larger than BUFFSIZE */
+		for (; ret == 0 && offset < end; offset += n) {
+			if ((ret = delta_wait(&writes[slot], key)) < 0)
+				break;
+			n = pread(fd, writes[slot].buf, end - offset < step ? end - offset : step, offset);
+			if (n <= 0) {
+				debug("failed to read from file\n");
+				ret = -1;
+				break;
+			}
+			if (rados_aio_create_completion(NULL, NULL, NULL, &writes[slot].completion) < 0) {
+				ret = -1;
+				break;
+			}
+			writes[slot].issued = qos_wait(n);
+			ret = rados_striper_aio_write(striper, key, writes[slot].completion, writes[slot].buf, n, offset);
+			if (ret < 0) {
+				/* the completion never fires */
+				debug("failed to write %s errno: %d\n", key, ret);
+				rados_aio_release(writes[slot].completion);
+				break;
+			}
+			writes[slot].busy = 1;
+			written += n;
+			slot = (slot + 1) % DELTA_WINDOW;
+		}
+	}
+
+out:
+	for (i = 0; i < DELTA_WINDOW; i++) {
+		if (delta_wait(&writes[i], key) < 0)
+			ret = -1;
+		free(writes[i].buf);
+	}
+
+	if (ret == 0 && !quit && size < remote_size)
+		ret = rados_striper_trunc(striper, key, size);
+	if (ret == 0 && !quit) {
+		if (sums_store(striper, key, &local) < 0)
+			debug("failed to store checksums of %s\n", key);
+		debug("%s: %u of %u chunks changed, %" PRIu64 " bytes written\n", key, changed, local.count, written);
+	}
+	sums_free(&local);
+	sums_free(&remote);
+	if (quit)
+		return -1;
+	return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * du.c
+ *
+ * "striprados du -p <pool> [--depth N] [--delimiter /]" sums the objects
+ * and bytes of a pool per key prefix: the key up to its N-th delimiter,
+ * or up to its last one when it has fewer, keys without any count under
+ * the delimiter alone. The output is sorted by prefix:
+ *
+ *	<prefix>|<objects>|<bytes>
+ *
+ * DU_THREADS threads list their own slice of the pool and read the
+ * sizes of the head objects with meta batches. Each one sums into a
+ * hash table of its own; the tables are merged at the end, so memory
+ * grows with the number of prefixes, not with the number of objects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "striprados.h"
+
+#define DU_THREADS 8
+/* objects listed per call */
+#define DU_PAGE 1024
+#define DU_WINDOW 64
+
+struct du_entry {
+	char *prefix;
+	uint64_t objects;
+	uint64_t bytes;
+	struct du_entry *next;
+};
+
+struct du_table {
+	struct du_entry **buckets;
+	uint32_t nbuckets;
+	uint32_t n;
+};
+
+struct du_thread {
+	pthread_t thread;
+	rados_ioctx_t ioctx;
+	rados_object_list_cursor start, finish;
+	const char *delimiter;
+	int depth;
+	struct du_table table;
+	int failed;
+};
+
+/* FNV-1a */
+static uint32_t du_hash(const char *s, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int du_grow(struct du_table *t) {
+	uint32_t nbuckets = t->nbuckets ? t->nbuckets * 2 : 256, i, h;
+	struct du_entry **buckets = calloc(nbuckets, sizeof(struct du_entry *));
+	struct du_entry *e, *next;
+
+	if (buckets == NULL)
+		return -1;
+	for (i = 0; i < t->nbuckets; i++) {
+		for (e = t->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			h = du_hash(e->prefix, strlen(e->prefix)) & (nbuckets - 1);
+			e->next = buckets[h];
+			buckets[h] = e;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->nbuckets = nbuckets;
+	return 0;
+}
+
+static int du_add(struct du_table *t, const char *prefix, size_t len, uint64_t objects, uint64_t bytes) {
+	struct du_entry *e;
+	uint32_t h;
+
+	if (t->n >= t->nbuckets && du_grow(t) < 0)
+		return -1;
+	h = du_hash(prefix, len) & (t->nbuckets - 1);
+	for (e = t->buckets[h]; e != NULL; e = e->next) {
+		if (strncmp(e->prefix, prefix, len) == 0 && e->prefix[len] == '\0')
+			break;
+	}
+	if (e == NULL) {
+		e = calloc(1, sizeof(struct du_entry));
+		if (e == NULL || (e->prefix = strndup(prefix, len)) == NULL) {
+			free(e);
+			return -1;
+		}
+		e->next = t->buckets[h];
+		t->buckets[h] = e;
+		t->n++;
+	}
+	e->objects += objects;
+	e->bytes += bytes;
+	return 0;
+}
+
+static void du_free(struct du_table *t) {
+	struct du_entry *e, *next;
+	uint32_t i;
+	for (i = 0; i < t->nbuckets; i++) {
+		for (e = t->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e->prefix);
+			free(e);
+		}
+	}
+	free(t->buckets);
+}
+
+/* the length of the prefix key is counted under */
+static size_t du_prefix(const char *key, const char *delimiter, int depth) {
+	size_t dlen = strlen(delimiter), end = 0;
+	const char *p = key, *q;
+	int d;
+
+	for (d = 0; d < depth && (q = strstr(p, delimiter)) != NULL; d++) {
+		end = q - key + dlen;
+		p = q + dlen;
+	}
+	return end;
+}
+
+static void du_one(void *arg, const char *key, int ret, const struct object_meta *m) {
+	struct du_thread *t = (struct du_thread *)arg;
+	/* removed while we were listing */
+	if (ret == -ENOENT)
+		return;
+	if (ret < 0) {
+		debug("%s stat failed errno: %d\n", key, ret);
+		t->failed = 1;
+		return;
+	}
+	if (du_add(&t->table, key, du_prefix(key, t->delimiter, t->depth), 1, m->size) < 0)
+		t->failed = 1;
+}
+
+static void *du_worker(void *arg) {
+	struct du_thread *t = (struct du_thread *)arg;
+	rados_object_list_item items[DU_PAGE];
+	rados_object_list_cursor cursor = t->start, next;
+	struct meta_batch *batch;
+	int i, n, length;
+
+	batch = meta_batch_new(t->ioctx, DU_WINDOW, du_one, t);
+	if (batch == NULL) {
+		t->failed = 1;
+		return NULL;
+	}
+	while (!quit && !t->failed && rados_object_list_cursor_cmp(t->ioctx, cursor, t->finish) < 0) {
+		n = rados_object_list(t->ioctx, cursor, t->finish, DU_PAGE, NULL, 0, items, &next);
+		if (n < 0) {
+			debug("error reading list\n");
+			t->failed = 1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if ((length = is_head_object(items[i].oid)) > 0 && key_selected(items[i].oid, length))
+				meta_batch_add(batch, items[i].oid, length);
+		}
+		rados_object_list_free(n, items);
+		rados_object_list_cursor_free(t->ioctx, cursor);
+		cursor = next;
+	}
+	rados_object_list_cursor_free(t->ioctx, cursor);
+	meta_batch_finish(batch);
+	return NULL;
+}
+
+static int du_packed(const char *key, uint64_t len, void *arg) {
+	struct du_thread *t = (struct du_thread *)arg;
+	if (!key_selected(key, strlen(key)))
+		return 0;
+	return du_add(&t->table, key, du_prefix(key, t->delimiter, t->depth), 1, len);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+	return strcmp((*(struct du_entry * const *)a)->prefix, (*(struct du_entry * const *)b)->prefix);
+}
+
+int do_du(rados_ioctx_t ioctx, const char *delimiter, int depth, FILE *out) {
+	struct du_thread threads[DU_THREADS], all;
+	struct du_entry *e, **sorted = NULL;
+	rados_object_list_cursor begin, end;
+	uint64_t objects = 0, bytes = 0;
+	uint32_t i, n = 0;
+	int started = 0, ret = 0;
+
+	if (delimiter == NULL || delimiter[0] == '\0' || depth < 0) {
+		debug("du needs a delimiter and a depth of 0 or more\n");
+		return -1;
+	}
+	memset(threads, 0, sizeof(threads));
+	memset(&all, 0, sizeof(all));
+	all.delimiter = delimiter;
+	all.depth = depth;
+	begin = rados_object_list_begin(ioctx);
+	end = rados_object_list_end(ioctx);
+	for (i = 0; i < DU_THREADS; i++) {
+		threads[i].ioctx = ioctx;
+		threads[i].delimiter = delimiter;
+		threads[i].depth = depth;
+		rados_object_list_slice(ioctx, begin, end, i, DU_THREADS, &threads[i].start, &threads[i].finish);
+		if (pthread_create(&threads[i].thread, NULL, du_worker, &threads[i]) != 0) {
+			rados_object_list_cursor_free(ioctx, threads[i].start);
+			rados_object_list_cursor_free(ioctx, threads[i].finish);
+			ret = -1;
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < (uint32_t)started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		rados_object_list_cursor_free(ioctx, threads[i].finish);
+		if (threads[i].failed)
+			ret = -1;
+	}
+	rados_object_list_cursor_free(ioctx, begin);
+	rados_object_list_cursor_free(ioctx, end);
+
+	/* merge, the small files of the packs go straight into the result */
+	for (i = 0; i < (uint32_t)started; i++) {
+		for (n = 0; n < threads[i].table.nbuckets; n++) {
+			for (e = threads[i].table.buckets[n]; ret == 0 && e != NULL; e = e->next)
+				ret = du_add(&all.table, e->prefix, strlen(e->prefix), e->objects, e->bytes);
+		}
+		du_free(&threads[i].table);
+	}
+	if (ret == 0 && pack_each(ioctx, du_packed, &all) < 0)
+		ret = -1;
+	if (ret < 0 || quit)
+		goto out;
+
+	sorted = malloc((all.table.n ? all.table.n : 1) * sizeof(struct du_entry *));
+	if (sorted == NULL) {
+		ret = -1;
+		goto out;
+	}
+	for (n = 0, i = 0; i < all.table.nbuckets; i++) {
+		for (e = all.table.buckets[i]; e != NULL; e = e->next)
+			sorted[n++] = e;
+	}
+	qsort(sorted, n, sizeof(struct du_entry *), cmp_entry);
+	for (i = 0; i < n; i++) {
+		fprintf(out, "%s|%" PRIu64 "|%" PRIu64 "\n", sorted[i]->prefix[0] ? sorted[i]->prefix : delimiter,
+				sorted[i]->objects, sorted[i]->bytes);
+		objects += sorted[i]->objects;
+		bytes += sorted[i]->bytes;
+	}
+	debug("%" PRIu64 " objects, %" PRIu64 " bytes in %u prefixes\n", objects, bytes, n);
+out:
+	free(sorted);
+	du_free(&all.table);
+	return ret < 0 || quit ? -1 : 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * follow.c
+ *
+ * "striprados -u <key> <file> --follow": upload a file that is still
+ * being written, like tail -f. inotify wakes us up when the writer
+ * appends, new bytes are batched into whole stripes (STRIPEUNIT *
+ * STRIPECOUNT) and written at their offsets with aio, a short tail is
+ * only flushed after FOLLOW_IDLE_FLUSH quiet seconds. The upload ends when
+ * the writer closes the file, when the file is removed or renamed, or
+ * after timeout seconds without growth.
+ *
+ * The final size is unknown, the chunk sums are kept with the smallest
+ * chunk while they fit in SUMS_MAX_COUNT. A longer recording is hashed
+ * once more from the file at the end, with the chunk of its size.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "crc32c.h"
+#include "striprados.h"
+
+#define FOLLOW_WINDOW 4
+#define FOLLOW_UNIT (STRIPEUNIT * STRIPECOUNT)
+#define FOLLOW_IDLE_FLUSH 2
+
+struct follow_buf {
+	char *buf;
+	size_t fill;
+	rados_completion_t completion;
+	int busy;
+};
+
+struct follow_state {
+	rados_striper_t striper;
+	const char *key;
+	struct follow_buf bufs[FOLLOW_WINDOW];
+	int slot;
+	uint64_t written;
+	int failed;
+	/* NULL unless uploads are encrypted */
+	struct crypt_info *ci;
+};
+
+static void follow_wait(struct follow_state *st, struct follow_buf *b) {
+	int ret;
+	if (!b->busy)
+		return;
+	rados_aio_wait_for_safe(b->completion);
+	ret = rados_aio_get_return_value(b->completion);
+	rados_aio_release(b->completion);
+	b->busy = 0;
+	if (ret < 0) {
+		debug("failed to write %s errno: %d\n", st->key, ret);
+		st->failed = 1;
+	}
+}
+
+/* write the first len bytes of the current buffer, the rest moves to the next one */
+static void follow_submit(struct follow_state *st, size_t len) {
+	struct follow_buf *cur = &st->bufs[st->slot];
+	struct follow_buf *next = &st->bufs[(st->slot + 1) % FOLLOW_WINDOW];
+
+	if (len == 0)
+		return;
+	if (st->ci && crypt_buffer(st->ci, cur->buf, len, st->written) < 0) {
+		st->failed = 1;
+		return;
+	}
+	if (rados_aio_create_completion(NULL, NULL, NULL, &cur->completion) < 0) {
+		st->failed = 1;
+		return;
+	}
+	if (rados_striper_aio_write(st->striper, st->key, cur->completion, cur->buf, len, st->written) < 0) {
+		/* the completion never fires */
+		debug("failed to write %s\n", st->key);
+		rados_aio_release(cur->completion);
+		st->failed = 1;
+		return;
+	}
+	cur->busy = 1;
+	st->written += len;
+
+	follow_wait(st, next);
+	next->fill = cur->fill - len;
+	memcpy(next->buf, cur->buf + len, next->fill);
+	st->slot = (st->slot + 1) % FOLLOW_WINDOW;
+	if (progress) {
+		debug("%" PRIu64 " bytes\r", st->written);
+		fflush(stderr);
+	}
+}
+
+int put_follow(rados_striper_t striper, const char *key, const char *filename, int timeout) {
+	struct follow_state st;
+	struct follow_buf *cur;
+	struct chunk_sums sums;
+	struct crypt_info ci;
+	struct pollfd pfd;
+	struct stat sb;
+	char events[4096];
+	struct inotify_event *ev;
+	uint64_t total = 0;
+	time_t last_growth;
+	int fd, ifd, i, done = 0, rehash = 0;
+	ssize_t n;
+	/* whole stripes of an erasure coded pool in every write while the file grows */
+	size_t step = write_step(), unit = FOLLOW_UNIT;
+
+	if (write_align > 1)
+		unit = (unit + write_align - 1) / write_align * write_align;
+	if (unit > step)
+		unit = step;
+	memset(&st, 0, sizeof(st));
+	memset(&sums, 0, sizeof(sums));
+	st.striper = striper;
+	st.key = key;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		debug("error reading file %s\n", filename);
+		return -1;
+	}
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0 || inotify_add_watch(ifd, filename, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		debug("can not watch %s errno: %d\n", filename, errno);
+		if (ifd >= 0)
+			close(ifd);
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < FOLLOW_WINDOW; i++) {
+		st.bufs[i].buf = malloc(BUFFSIZE);
+		if (st.bufs[i].buf == NULL)
+			st.failed = 1;
+	}
+	if (crypt_key) {
+		st.ci = &ci;
+		if (crypt_new(crypt_key, &ci) < 0)
+			st.failed = 1;
+	}
+	/* chunk digests for a later -U only */
+	if (st.failed || sums_init(&sums, 0) < 0 || (delta && !crypt_key && sums_strong(&sums) < 0)) {
+		st.failed = 1;
+		goto out;
+	}
+
+	rados_striper_trunc(striper, key, 0);
+	rados_striper_rmxattr(striper, key, SUMS_XATTR);
+	rados_striper_rmxattr(striper, key, STRONG_XATTR);
+	rados_striper_rmxattr(striper, key, DIGEST_XATTR);
+	rados_striper_rmxattr(striper, key, CODEC_XATTR);
+	rados_striper_rmxattr(striper, key, CMAP_XATTR);
+	rados_striper_rmxattr(striper, key, CIPHER_XATTR);
+	last_growth = time(NULL);
+
+	while (!quit && !st.failed) {
+		cur = &st.bufs[st.slot];
+		n = read(fd, cur->buf + cur->fill, step - cur->fill);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			debug("failed to read from file\n");
+			st.failed = 1;
+			break;
+		}
+		if (n > 0) {
+			if (!rehash)
+				sums_update(&sums, cur->buf + cur->fill, n);
+			if (!rehash && sums.count >= SUMS_MAX_COUNT) {
+				/* too long for the smallest chunk */
+				sums_free(&sums);
+				rehash = 1;
+			}
+			cur->fill += n;
+			total += n;
+			last_growth = time(NULL);
+			if (cur->fill == step)
+				follow_submit(&st, step);
+			continue;
+		}
+
+		/* caught up with the writer: send the whole stripes we have */
+		follow_submit(&st, cur->fill / unit * unit);
+		cur = &st.bufs[st.slot];
+
+		if (fstat(fd, &sb) == 0 && (uint64_t)sb.st_size < total) {
+			debug("%s was truncated while following it\n", filename);
+			st.failed = 1;
+			break;
+		}
+		if (done || time(NULL) - last_growth >= timeout)
+			break;
+		if (cur->fill > 0 && time(NULL) - last_growth >= FOLLOW_IDLE_FLUSH)
+			follow_submit(&st, cur->fill);
+
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		while ((n = read(ifd, events, sizeof(events))) > 0) {
+			for (i = 0; i < n; i += sizeof(struct inotify_event) + ev->len) {
+				ev = (struct inotify_event *)(events + i);
+				/* read what is left once more, then stop */
+				if (ev->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF))
+					done = 1;
+			}
+		}
+	}
+
+	if (!st.failed && !quit)
+		follow_submit(&st, st.bufs[st.slot].fill);
+
+out:
+	for (i = 0; i < FOLLOW_WINDOW; i++) {
+		follow_wait(&st, &st.bufs[i]);
+		free(st.bufs[i].buf);
+	}
+	rados_striper_aio_flush(striper);
+	if (!st.failed && !quit) {
+		if (total == 0) {
+			debug("%s stayed empty\n", filename);
+			st.failed = 1;
+		} else if (st.ci && crypt_store(striper, key, st.ci) < 0) {
+			debug("failed to store the encryption header of %s\n", key);
+			st.failed = 1;
+		/* no sums of the plaintext on an encrypted object, they would confirm a guessed file */
+		} else if (st.ci == NULL && rehash && sums_file(fd, total, 0, delta, &sums) < 0) {
+			debug("failed to hash %s\n", filename);
+		} else if (st.ci == NULL && sums_store(striper, key, &sums) < 0) {
+			debug("failed to store checksums of %s\n", key);
+		}
+		debug("%s: followed %" PRIu64 " bytes\n", key, st.written);
+	}
+	if (sums.crcs)
+		sums_free(&sums);
+	close(ifd);
+	close(fd);
+	if (quit)
+		return -1;
+	return st.failed ? -1 : 0;
+}
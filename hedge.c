@@ -0,0 +1,423 @@
+/*
+ * hedge.c
+ *
+ * deadlines for the reads of a download. Without them one slow OSD holds
+ * every read of the get window it serves for up to rados_osd_op_timeout.
+ *
+ * When a striped read is not back by its deadline the same range is read
+ * a second time straight from the rados objects behind it, with
+ * LIBRADOS_OPERATION_BALANCE_READS so that a replica may answer. The one
+ * that completes first is used; the reads of the other one are cancelled
+ * where librados can (not those of the striper) and its buffer is parked
+ * until they are done. A download does not wait for those: a hedge with
+ * reads still out is retired, and hedge_drain waits for them before the
+ * ioctx goes away. A range that fails is read again up to HEDGE_TRIES
+ * times, after a doubling pause with jitter.
+ *
+ * The deadline is --read-deadline <ms>, or HEDGE_FACTOR times the moving
+ * average of the reads of this download, at least HEDGE_MIN seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "striprados.h"
+
+#define HEDGE_TRIES 3
+#define HEDGE_FACTOR 3
+#define HEDGE_MIN 0.2
+/* until the first read is back */
+#define HEDGE_FIRST 2.0
+#define HEDGE_BACKOFF 0.1
+
+int read_deadline = 0;
+
+/* a stripe unit of the range, read by ops[op] */
+struct hedge_extent {
+	uint64_t objoff;
+	size_t rel, len, bytes;
+	int rval, op;
+};
+
+/* one read op per rados object behind the range */
+struct hedge_op {
+	rados_read_op_t op;
+	rados_completion_t completion;
+	uint64_t objno;
+};
+
+/* the hedge of one range */
+struct hedge_reads {
+	struct hedge_op *ops;
+	struct hedge_extent *ext;
+	/* ops that went out, extents */
+	int nops, next;
+};
+
+/* a read that lost, kept until it is done with its buffer */
+struct hedge_parked {
+	char *buf;
+	rados_completion_t primary;
+	struct hedge_reads *reads;
+	struct hedge_parked *next;
+};
+
+struct hedge {
+	rados_ioctx_t ioctx;
+	const char *key;
+	struct layout layout;
+	/* 1 when the layout is read, -1 when it can not be: no hedging */
+	int loaded;
+	double avg;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct hedge_parked *parked;
+	/* on the retired list */
+	struct hedge *next;
+};
+
+/* hedges whose reads that lost were still out when their download ended */
+static struct hedge *retired;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct hedge *hedge_new(rados_ioctx_t ioctx, const char *key) {
+	struct hedge *h = calloc(1, sizeof(struct hedge));
+	pthread_condattr_t attr;
+
+	if (h == NULL)
+		return NULL;
+	h->ioctx = ioctx;
+	h->key = key;
+	pthread_mutex_init(&h->mutex, NULL);
+	/* deadlines are on the clock of qos_now */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&h->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return h;
+}
+
+/* the callback of every completion a hedge waits for */
+void hedge_wake(rados_completion_t c, void *arg) {
+	struct hedge *h = (struct hedge *)arg;
+	pthread_mutex_lock(&h->mutex);
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->mutex);
+}
+
+static int reads_done(struct hedge_reads *r) {
+	int i;
+	for (i = 0; r != NULL && i < r->nops; i++) {
+		if (!rados_aio_is_complete(r->ops[i].completion))
+			return 0;
+	}
+	return 1;
+}
+
+/* until the primary read (when c is not NULL) or all the hedge reads are done, or the deadline when it is not 0 */
+static void hedge_sleep(struct hedge *h, rados_completion_t c, struct hedge_reads *r, double deadline) {
+	struct timespec ts;
+	double until;
+
+	pthread_mutex_lock(&h->mutex);
+	while (!(c != NULL && rados_aio_is_complete(c)) && !(r != NULL && reads_done(r))) {
+		if (deadline && (quit || qos_now() >= deadline))
+			break;
+		until = deadline ? deadline : qos_now() + 1;
+		ts.tv_sec = (time_t)until;
+		ts.tv_nsec = (long)((until - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&h->cond, &h->mutex, &ts);
+	}
+	pthread_mutex_unlock(&h->mutex);
+}
+
+/* callbacks still running must not find the hedge freed */
+static void reads_free(struct hedge_reads *r) {
+	int i;
+	if (r == NULL)
+		return;
+	for (i = 0; i < r->nops; i++) {
+		rados_aio_wait_for_complete_and_cb(r->ops[i].completion);
+		rados_aio_release(r->ops[i].completion);
+		rados_release_read_op(r->ops[i].op);
+	}
+	free(r->ops);
+	free(r->ext);
+	free(r);
+}
+
+static void park(struct hedge *h, char *buf, rados_completion_t primary, struct hedge_reads *r) {
+	struct hedge_parked *k = malloc(sizeof(struct hedge_parked));
+	if (k == NULL) {
+		/* nowhere to keep it, wait here */
+		if (primary != NULL) {
+			rados_aio_wait_for_complete_and_cb(primary);
+			rados_aio_release(primary);
+		}
+		reads_free(r);
+		free(buf);
+		return;
+	}
+	k->buf = buf;
+	k->primary = primary;
+	k->reads = r;
+	k->next = h->parked;
+	h->parked = k;
+}
+
+/* free the parked reads that are done, all of them waiting when all is set */
+static void reap(struct hedge *h, int all) {
+	struct hedge_parked **pk = &h->parked, *k;
+	while ((k = *pk) != NULL) {
+		if (!all && ((k->primary != NULL && !rados_aio_is_complete(k->primary)) || !reads_done(k->reads))) {
+			pk = &k->next;
+			continue;
+		}
+		if (k->primary != NULL) {
+			rados_aio_wait_for_complete_and_cb(k->primary);
+			rados_aio_release(k->primary);
+		}
+		reads_free(k->reads);
+		free(k->buf);
+		*pk = k->next;
+		free(k);
+	}
+}
+
+static int hedge_layout(struct hedge *h) {
+	struct object_meta m;
+	if (h->loaded == 0) {
+		h->loaded = meta_fetch(h->ioctx, h->key, &m) == 0 && layout_valid(&m.layout) ? 1 : -1;
+		h->layout = m.layout;
+	}
+	return h->loaded == 1 ? 0 : -1;
+}
+
+static void hedge_sample(struct hedge *h, double issued) {
+	double t = qos_now() - issued;
+	h->avg = h->avg ? h->avg * 0.8 + t * 0.2 : t;
+}
+
+static double hedge_deadline(struct hedge *h) {
+	double d;
+	if (read_deadline > 0)
+		return read_deadline / 1000.0;
+	d = h->avg ? h->avg * HEDGE_FACTOR : HEDGE_FIRST;
+	return d < HEDGE_MIN ? HEDGE_MIN : d;
+}
+
+/* read [off, off + len) into buf from the objects behind it, NULL when not all reads went out */
+static struct hedge_reads *hedge_issue(struct hedge *h, char *buf, size_t len, uint64_t off) {
+	uint64_t su = h->layout.stripe_unit, sc = h->layout.stripe_count, spo = h->layout.object_size / su;
+	uint64_t pos, blockno, stripeno, objno, clen;
+	struct hedge_reads *r = calloc(1, sizeof(struct hedge_reads));
+	struct hedge_op *ops = NULL, *o;
+	struct hedge_extent *e;
+	char *name = malloc(strlen(h->key) + 17 + 1);
+	size_t done;
+	int i, j, nops = 0, max = len / su + 2;
+
+	if (r == NULL || name == NULL)
+		goto fail;
+	ops = calloc(max, sizeof(struct hedge_op));
+	r->ext = calloc(max, sizeof(struct hedge_extent));
+	if (ops == NULL || r->ext == NULL)
+		goto fail;
+	/* the mapping of libradosstriper */
+	for (done = 0; done < len; done += clen) {
+		pos = off + done;
+		blockno = pos / su;
+		stripeno = blockno / sc;
+		objno = stripeno / spo * sc + blockno % sc;
+		clen = su - pos % su < len - done ? su - pos % su : len - done;
+		for (i = 0; i < nops && ops[i].objno != objno; i++)
+			;
+		if (i == nops)
+			ops[nops++].objno = objno;
+		e = &r->ext[r->next++];
+		e->objoff = stripeno % spo * su + pos % su;
+		e->rel = done;
+		e->len = clen;
+		e->op = i;
+	}
+	r->ops = ops;
+	for (i = 0; i < nops; i++) {
+		o = &ops[i];
+		o->op = rados_create_read_op();
+		if (o->op == NULL)
+			break;
+		if (rados_aio_create_completion(h, hedge_wake, NULL, &o->completion) < 0) {
+			rados_release_read_op(o->op);
+			break;
+		}
+		for (j = 0; j < r->next; j++) {
+			e = &r->ext[j];
+			if (e->op == i)
+				rados_read_op_read(o->op, e->objoff, e->len, buf + e->rel, &e->bytes, &e->rval);
+		}
+		sprintf(name, "%s.%016" PRIx64, h->key, o->objno);
+		if (rados_aio_read_op_operate(o->op, h->ioctx, o->completion, name, LIBRADOS_OPERATION_BALANCE_READS) < 0) {
+			rados_aio_release(o->completion);
+			rados_release_read_op(o->op);
+			break;
+		}
+		r->nops++;
+	}
+	free(name);
+	if (r->nops == nops)
+		return r;
+	/* the ones that went out still write into buf */
+	park(h, buf, NULL, r);
+	return NULL;
+fail:
+	free(name);
+	free(ops);
+	if (r != NULL)
+		free(r->ext);
+	free(r);
+	free(buf);
+	return NULL;
+}
+
+/* objects that are missing or short read as zeros, as through the striper */
+static int hedge_result(struct hedge_reads *r, char *buf) {
+	struct hedge_extent *e;
+	int i, ret;
+	for (i = 0; i < r->next; i++) {
+		e = &r->ext[i];
+		ret = rados_aio_get_return_value(r->ops[e->op].completion);
+		if (ret == -ENOENT) {
+			memset(buf + e->rel, 0, e->len);
+			continue;
+		}
+		if (ret < 0 || e->rval < 0)
+			return -1;
+		if (e->bytes < e->len)
+			memset(buf + e->rel + e->bytes, 0, e->len - e->bytes);
+	}
+	return 0;
+}
+
+/* the striped read c, hedged after the deadline; *buf is swapped when the hedge wins */
+static int hedge_race(struct hedge *h, rados_completion_t c, char **buf, size_t len, uint64_t off, double issued) {
+	struct hedge_reads *r = NULL;
+	char *spare = NULL;
+	int i, ret;
+
+	hedge_sleep(h, c, NULL, issued + hedge_deadline(h));
+	if (!rados_aio_is_complete(c) && !quit && hedge_layout(h) == 0) {
+		reap(h, 0);
+		spare = malloc(len);
+		if (spare != NULL && (r = hedge_issue(h, spare, len, off)) != NULL)
+			debug("%s: read at %" PRIu64 " is late, hedging\n", h->key, off);
+	}
+	/* the first that succeeds */
+	for (;;) {
+		if (rados_aio_is_complete(c) && (r == NULL || rados_aio_get_return_value(c) == (int)len))
+			break;
+		if (r != NULL && reads_done(r)) {
+			if (hedge_result(r, spare) == 0) {
+				park(h, *buf, c, NULL);
+				reads_free(r);
+				*buf = spare;
+				hedge_sample(h, issued);
+				return len;
+			}
+			reads_free(r);
+			free(spare);
+			r = NULL;
+			continue;
+		}
+		/* once the primary failed only the hedge can still win */
+		hedge_sleep(h, rados_aio_is_complete(c) ? NULL : c, r, 0);
+	}
+	if (r != NULL) {
+		for (i = 0; i < r->nops; i++)
+			rados_aio_cancel(h->ioctx, r->ops[i].completion);
+		park(h, spare, NULL, r);
+	}
+	rados_aio_wait_for_complete_and_cb(c);
+	ret = rados_aio_get_return_value(c);
+	rados_aio_release(c);
+	if (ret == (int)len)
+		hedge_sample(h, issued);
+	return ret;
+}
+
+/*
+ * wait for the striped read c of [off, off + len) into *buf, whose
+ * callback calls hedge_wake, released here. len on success.
+ */
+int hedge_read(struct hedge *h, rados_striper_t striper, rados_completion_t c, char **buf, size_t len, uint64_t off, double issued) {
+	int ret, try;
+
+	for (try = 1; ; try++) {
+		ret = hedge_race(h, c, buf, len, off, issued);
+		if (ret == (int)len || try == HEDGE_TRIES || quit)
+			return ret;
+		debug("read of %s at %" PRIu64 " failed: %d, retrying\n", h->key, off, ret);
+		qos_sleep(HEDGE_BACKOFF * (1 << (try - 1)) * (0.5 + (double)rand() / RAND_MAX));
+		if (rados_aio_create_completion(h, hedge_wake, NULL, &c) < 0)
+			return -ENOMEM;
+		issued = qos_now();
+		ret = rados_striper_aio_read(striper, h->key, c, *buf, len, off);
+		if (ret < 0) {
+			/* never queued, so it never completes */
+			rados_aio_release(c);
+			return ret;
+		}
+	}
+}
+
+static void hedge_destroy(struct hedge *h) {
+	pthread_mutex_destroy(&h->mutex);
+	pthread_cond_destroy(&h->cond);
+	free(h);
+}
+
+/* a download does not wait for the reads it did not use, see hedge_drain */
+void hedge_free(struct hedge *h) {
+	struct hedge **pr, *r;
+
+	if (h == NULL)
+		return;
+	reap(h, 0);
+	pthread_mutex_lock(&retired_mutex);
+	/* the ones retired before that are done by now */
+	for (pr = &retired; (r = *pr) != NULL; ) {
+		reap(r, 0);
+		if (r->parked == NULL) {
+			*pr = r->next;
+			hedge_destroy(r);
+		} else {
+			pr = &r->next;
+		}
+	}
+	if (h->parked != NULL) {
+		/* the callbacks of its reads still use its mutex */
+		h->key = NULL;
+		h->next = retired;
+		retired = h;
+		h = NULL;
+	}
+	pthread_mutex_unlock(&retired_mutex);
+	if (h != NULL)
+		hedge_destroy(h);
+}
+
+/* wait for the reads of every retired hedge, before the ioctx is destroyed */
+void hedge_drain(void) {
+	struct hedge *r;
+
+	pthread_mutex_lock(&retired_mutex);
+	while ((r = retired) != NULL) {
+		retired = r->next;
+		reap(r, 1);
+		hedge_destroy(r);
+	}
+	pthread_mutex_unlock(&retired_mutex);
+}
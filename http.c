@@ -0,0 +1,776 @@
+/*
+ * http.c
+ *
+ * "striprados http": a small event driven HTTP/1.1 server for local
+ * players. GET /<pool>/<key> answers with the object, honouring a single
+ * "Range: bytes=" range, HEAD answers from the striper.size xattr only.
+ *
+ * One epoll loop owns all connections. A range is cut into STRIPEUNIT
+ * sized pieces and up to HTTP_WINDOW of them are read in parallel with
+ * rados_striper_aio_read, so the first bytes of a seek arrive after a
+ * single aio round trip. The size lookup is issued together with the
+ * first reads. Completions only wake the loop up through an eventfd, all
+ * connection state is touched by the loop thread alone.
+ */
+
+#define _GNU_SOURCE /* memmem, accept4 */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "list.h"
+#include "striprados.h"
+
+#define HTTP_ADDR "127.0.0.1:8080"
+#define HTTP_REQ_MAX 8192
+#define HTTP_HEADER_MAX 1024
+#define HTTP_CHUNK STRIPEUNIT
+/* two full stripes in flight per connection */
+#define HTTP_WINDOW (STRIPECOUNT * 2)
+#define HTTP_EVENTS 64
+
+enum http_state {
+	HTTP_READ_REQUEST,
+	HTTP_WAIT_SIZE,
+	HTTP_SENDING,
+	HTTP_CLOSING
+};
+
+struct http_pool {
+	struct list_head list;
+	char *name;
+	rados_ioctx_t ioctx;
+	rados_striper_t striper;
+};
+
+struct http_slot {
+	rados_completion_t completion;
+	char *buf;
+	/* decrypted already, a send may stop half way */
+	int plain;
+};
+
+struct http_conn {
+	int fd;
+	enum http_state state;
+	char in[HTTP_REQ_MAX];
+	size_t in_len;
+	char out[HTTP_HEADER_MAX];
+	size_t out_len;
+	size_t out_sent;
+
+	int keep_alive;
+	int head_only;
+	/* 0: whole object, 1: bytes=a-b or a-, 2: bytes=-n */
+	int range_type;
+	uint64_t range_first;
+	uint64_t range_last;
+
+	struct http_pool *pool;
+	char *key;
+
+	rados_completion_t size_completion;
+	char size_buf[32];
+	/* xattrs of the head object, fetched with the size: codec and cipher */
+	rados_completion_t meta_completion;
+	rados_read_op_t meta_op;
+	rados_xattrs_iter_t meta_iter;
+	int meta_rval;
+	int crypted;
+	struct crypt_info ci;
+	uint64_t size;
+	int size_known;
+
+	/* body is [start, end) */
+	uint64_t start;
+	uint64_t end;
+	/* reads are issued up to read_limit until the size is known */
+	uint64_t read_limit;
+	uint64_t chunks_issued;
+	uint64_t chunks_sent;
+	size_t chunk_sent_bytes;
+	struct http_slot slots[HTTP_WINDOW];
+
+	/* completion wake ups, protected by ready_mutex */
+	int queued;
+	struct list_head ready;
+
+	/* freed at the end of the event batch that may still refer to it */
+	int dead;
+	struct list_head dead_list;
+};
+
+static int epfd = -1;
+static int wakefd = -1;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(ready_list);
+static LIST_HEAD(pool_list);
+static LIST_HEAD(dead_list);
+static rados_t cluster;
+
+static void http_wakeup(rados_completion_t cb, void *arg) {
+	struct http_conn *conn = (struct http_conn *)arg;
+	uint64_t one = 1;
+	pthread_mutex_lock(&ready_mutex);
+	if (!conn->queued) {
+		conn->queued = 1;
+		list_add_tail(&conn->ready, &ready_list);
+	}
+	pthread_mutex_unlock(&ready_mutex);
+	if (write(wakefd, &one, sizeof(one)) < 0) {
+		/* the counter is already non zero, the loop will wake up */
+	}
+}
+
+static struct http_pool *get_pool(const char *name) {
+	struct http_pool *pool;
+	list_for_each_entry(pool, &pool_list, list) {
+		if (strcmp(pool->name, name) == 0)
+			return pool;
+	}
+	pool = calloc(1, sizeof(struct http_pool));
+	if (pool == NULL)
+		return NULL;
+	if (open_pool(cluster, name, &pool->ioctx, &pool->striper) < 0) {
+		if (pool->ioctx)
+			rados_ioctx_destroy(pool->ioctx);
+		free(pool);
+		return NULL;
+	}
+	pool->name = strdup(name);
+	list_add_tail(&pool->list, &pool_list);
+	return pool;
+}
+
+static int url_decode(char *s) {
+	char *out = s;
+	unsigned int c;
+	for (; *s; s++) {
+		if (*s == '%') {
+			if (sscanf(s + 1, "%2x", &c) != 1 || c == 0)
+				return -1;
+			*out++ = c;
+			s += 2;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+	return 0;
+}
+
+/* a slot whose aio is still running keeps the connection alive */
+static int conn_busy(struct http_conn *conn) {
+	int i;
+	if (conn->size_completion && !rados_aio_is_complete(conn->size_completion))
+		return 1;
+	if (conn->meta_completion && !rados_aio_is_complete(conn->meta_completion))
+		return 1;
+	for (i = 0; i < HTTP_WINDOW; i++) {
+		if (conn->slots[i].completion && !rados_aio_is_complete(conn->slots[i].completion))
+			return 1;
+	}
+	return 0;
+}
+
+static void release_completion(rados_completion_t *c) {
+	if (*c == NULL)
+		return;
+	/* the callback still holds a pointer to the connection */
+	rados_aio_wait_for_complete_and_cb(*c);
+	rados_aio_release(*c);
+	*c = NULL;
+}
+
+/* drop everything belonging to the current response */
+static void reset_response(struct http_conn *conn) {
+	int i;
+	release_completion(&conn->size_completion);
+	release_completion(&conn->meta_completion);
+	if (conn->meta_iter)
+		rados_getxattrs_end(conn->meta_iter);
+	conn->meta_iter = NULL;
+	if (conn->meta_op)
+		rados_release_read_op(conn->meta_op);
+	conn->meta_op = NULL;
+	conn->crypted = 0;
+	for (i = 0; i < HTTP_WINDOW; i++)
+		release_completion(&conn->slots[i].completion);
+	free(conn->key);
+	conn->key = NULL;
+	conn->pool = NULL;
+	conn->out_len = conn->out_sent = 0;
+	conn->size_known = 0;
+	conn->chunks_issued = conn->chunks_sent = 0;
+	conn->chunk_sent_bytes = 0;
+}
+
+static void conn_free(struct http_conn *conn) {
+	int i;
+	reset_response(conn);
+	for (i = 0; i < HTTP_WINDOW; i++)
+		free(conn->slots[i].buf);
+	pthread_mutex_lock(&ready_mutex);
+	if (conn->queued)
+		list_del(&conn->ready);
+	conn->queued = 0;
+	pthread_mutex_unlock(&ready_mutex);
+	conn->dead = 1;
+	list_add_tail(&conn->dead_list, &dead_list);
+}
+
+static void conn_close(struct http_conn *conn) {
+	if (conn->fd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	conn->state = HTTP_CLOSING;
+	/* freed once the last aio has called back, see http_progress */
+	if (!conn_busy(conn))
+		conn_free(conn);
+}
+
+static void simple_response(struct http_conn *conn, int code, const char *reason, const char *extra) {
+	int body_len = strlen(reason) + 1;
+	conn->out_len = snprintf(conn->out, sizeof(conn->out),
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %d\r\n"
+			"%s"
+			"Connection: %s\r\n\r\n",
+			code, reason, conn->head_only ? 0 : body_len, extra ? extra : "",
+			conn->keep_alive ? "keep-alive" : "close");
+	if (!conn->head_only)
+		conn->out_len += snprintf(conn->out + conn->out_len, sizeof(conn->out) - conn->out_len, "%s\n", reason);
+	conn->out_sent = 0;
+	conn->start = conn->end = 0;
+	conn->state = HTTP_SENDING;
+}
+
+/* issue reads for the next free slots in [start, read_limit) */
+static int issue_reads(struct http_conn *conn) {
+	struct http_slot *slot;
+	uint64_t offset;
+	size_t len;
+	while (conn->chunks_issued < conn->chunks_sent + HTTP_WINDOW) {
+		offset = conn->start + conn->chunks_issued * HTTP_CHUNK;
+		if (offset >= conn->read_limit)
+			break;
+		len = conn->read_limit - offset < HTTP_CHUNK ? conn->read_limit - offset : HTTP_CHUNK;
+		slot = &conn->slots[conn->chunks_issued % HTTP_WINDOW];
+		if (slot->completion != NULL)
+			break;
+		if (slot->buf == NULL && (slot->buf = malloc(HTTP_CHUNK)) == NULL)
+			return -1;
+		if (rados_aio_create_completion(conn, http_wakeup, NULL, &slot->completion) < 0)
+			return -1;
+		if (rados_striper_aio_read(conn->pool->striper, conn->key, slot->completion, slot->buf, len, offset) < 0) {
+			rados_aio_release(slot->completion);
+			slot->completion = NULL;
+			return -1;
+		}
+		slot->plain = 0;
+		conn->chunks_issued++;
+	}
+	return 0;
+}
+
+static int parse_range(struct http_conn *conn, const char *value) {
+	char *end;
+	while (*value == ' ')
+		value++;
+	if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL)
+		return 0;
+	value += 6;
+	if (*value == '-') {
+		conn->range_type = 2;
+		conn->range_last = strtoull(value + 1, &end, 10);
+		return end != value + 1 && conn->range_last > 0 ? 0 : -1;
+	}
+	conn->range_type = 1;
+	conn->range_first = strtoull(value, &end, 10);
+	if (end == value || *end != '-')
+		return -1;
+	value = end + 1;
+	if (*value == '\0' || *value == '\r') {
+		conn->range_last = UINT64_MAX;
+		return 0;
+	}
+	conn->range_last = strtoull(value, &end, 10);
+	if (end == value || conn->range_last < conn->range_first)
+		return -1;
+	return 0;
+}
+
+/* parse a complete request head of len bytes and start answering it */
+static void start_request(struct http_conn *conn, size_t len) {
+	char *line, *save = NULL, *method, *target, *version, *name, *value, *key;
+	char *words = NULL;
+	char size_oid[HTTP_REQ_MAX + 32];
+	int bad_range = 0;
+
+	conn->in[len - 2] = '\0';
+	conn->range_type = 0;
+	conn->keep_alive = 1;
+	conn->head_only = 0;
+
+	line = strtok_r(conn->in, "\r\n", &save);
+	method = line ? strtok_r(line, " ", &words) : NULL;
+	target = method ? strtok_r(NULL, " ", &words) : NULL;
+	version = target ? strtok_r(NULL, " ", &words) : NULL;
+	if (version == NULL || strncmp(version, "HTTP/1.", 7) != 0) {
+		conn->keep_alive = 0;
+		simple_response(conn, 400, "Bad Request", NULL);
+		return;
+	}
+	if (strcmp(version, "HTTP/1.0") == 0)
+		conn->keep_alive = 0;
+
+	while ((line = strtok_r(NULL, "\r\n", &save)) != NULL) {
+		name = line;
+		value = strchr(line, ':');
+		if (value == NULL)
+			continue;
+		*value++ = '\0';
+		while (*value == ' ')
+			value++;
+		if (strcasecmp(name, "Connection") == 0) {
+			if (strcasecmp(value, "close") == 0)
+				conn->keep_alive = 0;
+			else if (strcasecmp(value, "keep-alive") == 0)
+				conn->keep_alive = 1;
+		} else if (strcasecmp(name, "Range") == 0) {
+			bad_range = parse_range(conn, value) < 0;
+		}
+	}
+
+	if (strcmp(method, "HEAD") == 0)
+		conn->head_only = 1;
+	else if (strcmp(method, "GET") != 0) {
+		simple_response(conn, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+		return;
+	}
+
+	/* /<pool>/<key>, the key may contain further slashes */
+	if (target[0] != '/' || (key = strchr(target + 1, '/')) == NULL || key[1] == '\0') {
+		simple_response(conn, 404, "Not Found", NULL);
+		return;
+	}
+	*key++ = '\0';
+	if (url_decode(target + 1) < 0 || url_decode(key) < 0) {
+		simple_response(conn, 400, "Bad Request", NULL);
+		return;
+	}
+	if (bad_range) {
+		/* an unparsable range is ignored, as if it was not there */
+		conn->range_type = 0;
+	}
+
+	conn->pool = get_pool(target + 1);
+	if (conn->pool == NULL) {
+		simple_response(conn, 404, "Not Found", NULL);
+		return;
+	}
+	conn->key = strdup(key);
+	if (conn->key == NULL) {
+		conn->keep_alive = 0;
+		simple_response(conn, 500, "Internal Server Error", NULL);
+		return;
+	}
+
+	snprintf(size_oid, sizeof(size_oid), "%s.%016d", conn->key, 0);
+	memset(conn->size_buf, 0, sizeof(conn->size_buf));
+	if (rados_aio_create_completion(conn, http_wakeup, NULL, &conn->size_completion) < 0 ||
+			rados_aio_getxattr(conn->pool->ioctx, size_oid, conn->size_completion, "striper.size",
+				conn->size_buf, sizeof(conn->size_buf) - 1) < 0 ||
+			(conn->meta_op = rados_create_read_op()) == NULL ||
+			rados_aio_create_completion(conn, http_wakeup, NULL, &conn->meta_completion) < 0) {
+		conn->keep_alive = 0;
+		simple_response(conn, 500, "Internal Server Error", NULL);
+		return;
+	}
+	rados_read_op_getxattrs(conn->meta_op, &conn->meta_iter, &conn->meta_rval);
+	if (rados_aio_read_op_operate(conn->meta_op, conn->pool->ioctx, conn->meta_completion, size_oid, 0) < 0) {
+		conn->keep_alive = 0;
+		simple_response(conn, 500, "Internal Server Error", NULL);
+		return;
+	}
+	conn->state = HTTP_WAIT_SIZE;
+
+	/* start reading together with the size lookup when the offset is known */
+	if (!conn->head_only && conn->range_type != 2) {
+		conn->start = conn->range_type == 1 ? conn->range_first : 0;
+		conn->read_limit = conn->start + HTTP_WINDOW * HTTP_CHUNK;
+		if (conn->range_type == 1 && conn->range_last != UINT64_MAX && conn->range_last + 1 < conn->read_limit)
+			conn->read_limit = conn->range_last + 1;
+		issue_reads(conn);
+	}
+}
+
+/*
+ * ranges of a compressed object are not its stored bytes: 501. An
+ * encrypted one is decrypted on the way out, 403 without the right key.
+ */
+static int meta_ready(struct http_conn *conn) {
+	const char *name, *val, *cipher = NULL, *nonce = NULL, *keyid = NULL;
+	size_t len, cipher_len = 0, nonce_len = 0, keyid_len = 0;
+
+	if (rados_aio_get_return_value(conn->meta_completion) < 0 || conn->meta_rval < 0 || conn->meta_iter == NULL)
+		return 200;
+	while (rados_getxattrs_next(conn->meta_iter, &name, &val, &len) == 0 && name != NULL) {
+		if (strcmp(name, CODEC_XATTR) == 0)
+			return 501;
+		if (strcmp(name, CIPHER_XATTR) == 0) {
+			cipher = val;
+			cipher_len = len;
+		} else if (strcmp(name, NONCE_XATTR) == 0) {
+			nonce = val;
+			nonce_len = len;
+		} else if (strcmp(name, KEYID_XATTR) == 0) {
+			keyid = val;
+			keyid_len = len;
+		}
+	}
+	if (cipher == NULL)
+		return 200;
+	if (crypt_parse(&conn->ci, conn->key, cipher, cipher_len, nonce, nonce_len, keyid, keyid_len) < 0)
+		return 403;
+	conn->crypted = 1;
+	return 200;
+}
+
+/* the size is known: decide the body and build the response header */
+static int size_ready(struct http_conn *conn) {
+	int ret = rados_aio_get_return_value(conn->size_completion);
+	char extra[128];
+	uint64_t first, last;
+
+	if (ret <= 0) {
+		simple_response(conn, 404, "Not Found", NULL);
+		return 0;
+	}
+	ret = meta_ready(conn);
+	if (ret != 200) {
+		simple_response(conn, ret, ret == 403 ? "Forbidden" : "Not Implemented", NULL);
+		return 0;
+	}
+	sscanf(conn->size_buf, "%" SCNu64, &conn->size);
+	conn->size_known = 1;
+
+	first = 0;
+	last = conn->size - 1;
+	if (conn->range_type == 1) {
+		first = conn->range_first;
+		if (conn->range_last < last)
+			last = conn->range_last;
+	} else if (conn->range_type == 2) {
+		first = conn->range_last >= conn->size ? 0 : conn->size - conn->range_last;
+	}
+	if (conn->range_type != 0 && (conn->size == 0 || first >= conn->size)) {
+		snprintf(extra, sizeof(extra), "Content-Range: bytes */%" PRIu64 "\r\n", conn->size);
+		simple_response(conn, 416, "Range Not Satisfiable", extra);
+		return 0;
+	}
+
+	/* speculative reads started at range_first, which did not move */
+	conn->start = first;
+	conn->end = conn->size == 0 ? 0 : last + 1;
+	conn->read_limit = conn->head_only ? conn->start : conn->end;
+
+	if (conn->range_type != 0) {
+		conn->out_len = snprintf(conn->out, sizeof(conn->out),
+				"HTTP/1.1 206 Partial Content\r\n"
+				"Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n",
+				first, last, conn->size);
+	} else {
+		conn->out_len = snprintf(conn->out, sizeof(conn->out), "HTTP/1.1 200 OK\r\n");
+	}
+	conn->out_len += snprintf(conn->out + conn->out_len, sizeof(conn->out) - conn->out_len,
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %" PRIu64 "\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"Connection: %s\r\n\r\n",
+			conn->end - conn->start, conn->keep_alive ? "keep-alive" : "close");
+	conn->out_sent = 0;
+	conn->state = HTTP_SENDING;
+	if (conn->head_only)
+		conn->end = conn->start;
+	return issue_reads(conn);
+}
+
+/* write as much as the socket takes. 1: response done, 0: wait, -1: close */
+static int send_response(struct http_conn *conn) {
+	struct http_slot *slot;
+	uint64_t offset;
+	size_t avail;
+	ssize_t n;
+	int ret;
+
+	while (conn->out_sent < conn->out_len) {
+		n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		conn->out_sent += n;
+	}
+
+	while (conn->start + conn->chunks_sent * HTTP_CHUNK < conn->end) {
+		offset = conn->start + conn->chunks_sent * HTTP_CHUNK;
+		slot = &conn->slots[conn->chunks_sent % HTTP_WINDOW];
+		if (conn->chunks_sent >= conn->chunks_issued && issue_reads(conn) < 0)
+			return -1;
+		if (slot->completion == NULL || !rados_aio_is_complete(slot->completion))
+			return 0;
+		ret = rados_aio_get_return_value(slot->completion);
+		avail = conn->end - offset < HTTP_CHUNK ? conn->end - offset : HTTP_CHUNK;
+		if (ret < (int)avail) {
+			/* read error or the object shrank under us, the header is gone already */
+			debug("%s: short read at %" PRIu64 " ret %d\n", conn->key, offset, ret);
+			return -1;
+		}
+		if (conn->crypted && !slot->plain) {
+			if (crypt_buffer(&conn->ci, slot->buf, avail, offset) < 0)
+				return -1;
+			slot->plain = 1;
+		}
+		while (conn->chunk_sent_bytes < avail) {
+			n = send(conn->fd, slot->buf + conn->chunk_sent_bytes, avail - conn->chunk_sent_bytes, MSG_NOSIGNAL);
+			if (n < 0)
+				return errno == EAGAIN || errno == EINTR ? 0 : -1;
+			conn->chunk_sent_bytes += n;
+		}
+		release_completion(&slot->completion);
+		conn->chunk_sent_bytes = 0;
+		conn->chunks_sent++;
+		if (issue_reads(conn) < 0)
+			return -1;
+	}
+	return 1;
+}
+
+/* run the connection state machine as far as it goes */
+static void http_progress(struct http_conn *conn) {
+	char *head_end;
+	size_t head_len;
+	ssize_t n;
+	int ret;
+
+	if (conn->dead)
+		return;
+	for (;;) {
+		switch (conn->state) {
+		case HTTP_CLOSING:
+			if (!conn_busy(conn))
+				conn_free(conn);
+			return;
+
+		case HTTP_READ_REQUEST:
+			head_end = conn->in_len ? memmem(conn->in, conn->in_len, "\r\n\r\n", 4) : NULL;
+			if (head_end == NULL) {
+				if (conn->in_len == sizeof(conn->in)) {
+					conn_close(conn);
+					return;
+				}
+				n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+				if (n < 0 && (errno == EAGAIN || errno == EINTR))
+					return;
+				if (n <= 0) {
+					conn_close(conn);
+					return;
+				}
+				conn->in_len += n;
+				continue;
+			}
+			head_len = head_end - conn->in + 4;
+			/* pipelined bytes after the head are kept for the next request */
+			start_request(conn, head_len);
+			memmove(conn->in, conn->in + head_len, conn->in_len - head_len);
+			conn->in_len -= head_len;
+			continue;
+
+		case HTTP_WAIT_SIZE:
+			if (!rados_aio_is_complete(conn->size_completion) ||
+					!rados_aio_is_complete(conn->meta_completion))
+				return;
+			if (size_ready(conn) < 0) {
+				conn_close(conn);
+				return;
+			}
+			continue;
+
+		case HTTP_SENDING:
+			ret = send_response(conn);
+			if (ret == 0)
+				return;
+			if (ret < 0 || !conn->keep_alive) {
+				conn_close(conn);
+				return;
+			}
+			/* speculative reads past the end may still be running */
+			if (conn_busy(conn))
+				return;
+			reset_response(conn);
+			conn->state = HTTP_READ_REQUEST;
+			continue;
+		}
+	}
+}
+
+static int http_listen(const char *listen_addr) {
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	char *port;
+	int fd = -1, on = 1;
+
+	snprintf(host, sizeof(host), "%s", listen_addr);
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		debug("listen address must be <address:port>: %s\n", listen_addr);
+		return -1;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+		debug("can not resolve %s\n", listen_addr);
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 128) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		debug("can not listen on %s errno: %d\n", listen_addr, errno);
+	return fd;
+}
+
+static void http_accept(int lfd) {
+	struct epoll_event ev;
+	struct http_conn *conn;
+	int fd, on = 1;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		conn = calloc(1, sizeof(struct http_conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->state = HTTP_READ_REQUEST;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(conn);
+		}
+	}
+}
+
+int do_http(rados_t rados, const char *listen_addr) {
+	struct epoll_event ev, events[HTTP_EVENTS];
+	struct http_conn *conn, *next;
+	struct http_pool *pool, *tmp;
+	uint64_t count;
+	int lfd, n, i;
+	int ret = 0;
+
+	if (listen_addr == NULL)
+		listen_addr = HTTP_ADDR;
+	cluster = rados;
+	progress = 0;
+
+	lfd = http_listen(listen_addr);
+	if (lfd < 0)
+		return -1;
+	epfd = epoll_create1(0);
+	wakefd = eventfd(0, EFD_NONBLOCK);
+	if (epfd < 0 || wakefd < 0) {
+		debug("can not set up epoll errno: %d\n", errno);
+		ret = -1;
+		goto out;
+	}
+	/* data.ptr NULL is the listener, &wakefd the completion wake up */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wakefd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+	debug("serving http on %s\n", listen_addr);
+
+	while (!quit) {
+		n = epoll_wait(epfd, events, HTTP_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			debug("epoll_wait failed errno: %d\n", errno);
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				http_accept(lfd);
+			} else if (events[i].data.ptr == &wakefd) {
+				if (read(wakefd, &count, sizeof(count)) < 0) {
+					/* spurious wake up */
+				}
+				pthread_mutex_lock(&ready_mutex);
+				while (!list_empty(&ready_list)) {
+					conn = list_entry(ready_list.next, struct http_conn, ready);
+					list_del(&conn->ready);
+					conn->queued = 0;
+					pthread_mutex_unlock(&ready_mutex);
+					http_progress(conn);
+					pthread_mutex_lock(&ready_mutex);
+				}
+				pthread_mutex_unlock(&ready_mutex);
+			} else {
+				http_progress((struct http_conn *)events[i].data.ptr);
+			}
+		}
+		list_for_each_entry_safe(conn, next, &dead_list, dead_list) {
+			list_del(&conn->dead_list);
+			free(conn);
+		}
+	}
+
+out:
+	/* open connections are dropped with the process */
+	close(lfd);
+	if (epfd >= 0)
+		close(epfd);
+	if (wakefd >= 0)
+		close(wakefd);
+	list_for_each_entry_safe(pool, tmp, &pool_list, list) {
+		rados_striper_destroy(pool->striper);
+		rados_ioctx_destroy(pool->ioctx);
+		free(pool->name);
+		free(pool);
+	}
+	debug("http server stopped\n");
+	return ret;
+}
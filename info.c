@@ -0,0 +1,81 @@
+/*
+ * info.c
+ *
+ * "-i -" and "-i @<file>" print the info line of every key read from
+ * stdin or the file, one key per line, over the one connection. Up to
+ * INFO_WINDOW metadata reads (meta.c) are in flight; the lines come out
+ * in input order as the oldest one completes, so a long list streams.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "striprados.h"
+
+#define INFO_WINDOW 256
+
+struct info_args {
+	rados_ioctx_t ioctx;
+	FILE *out;
+	int missing;
+};
+
+static void info_one(void *arg, const char *key, int ret, const struct object_meta *m) {
+	struct info_args *a = (struct info_args *)arg;
+	uint64_t size = m->size;
+	time_t mtime = m->mtime;
+
+	/* a small file may live in a pack */
+	if (ret == -ENOENT)
+		ret = pack_stat(a->ioctx, key, &size, &mtime);
+	if (ret < 0) {
+		debug("no such object: %s\n", key);
+		a->missing++;
+	} else {
+		print_info(a->out, key, size, mtime);
+	}
+}
+
+int do_info_list(rados_ioctx_t ioctx, rados_striper_t striper, const char *list, FILE *out) {
+	struct info_args a;
+	struct meta_batch *batch;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+	int ret = 0;
+	FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+
+	if (fp == NULL) {
+		debug("can not open %s\n", list);
+		return -1;
+	}
+	a.ioctx = ioctx;
+	a.out = out;
+	a.missing = 0;
+	batch = meta_batch_new(ioctx, INFO_WINDOW, info_one, &a);
+	if (batch == NULL) {
+		if (fp != stdin)
+			fclose(fp);
+		return -1;
+	}
+	while (!quit && (n = getline(&line, &len, fp)) != -1) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+		if (n == 0)
+			continue;
+		if (meta_batch_add(batch, line, n) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	/* the rest, oldest first */
+	meta_batch_finish(batch);
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	if (a.missing)
+		debug("%d keys not found\n", a.missing);
+	return ret < 0 || a.missing || quit ? -1 : 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * layout.c
+ *
+ * the striper layout of an upload is picked from its size and the pool
+ * type. Small files fit in a single RADOS object, very large ones are
+ * spread over more objects at once. Erasure coded pools get larger
+ * stripe units, partial stripe writes are expensive there.
+ *
+ * The table can be replaced with --layout <file>, one rule per line,
+ * the first one matching wins:
+ *
+ *	# max_size stripe_unit stripe_count object_size [replicated|erasure]
+ *	4M 512K 1 4M
+ *	max 1M 8 64M erasure
+ *	concurrency 8
+ *
+ * the concurrency line sets the number of upload buffers in flight.
+ * "striprados tune" writes such a file from measurements.
+ *
+ * libradosstriper stores the layout on the head object when it creates
+ * it, reads and later writes of an object always use its own layout.
+ *
+ * On erasure coded pools every stripe unit is rounded up to the pool
+ * stripe width and uploads write in multiples of it (write_align), so
+ * the OSDs see full stripe writes instead of read-modify-write. The type
+ * and stripe width come from "osd pool ls detail" on the monitors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include "striprados.h"
+
+#define LAYOUT_MAX_RULES 64
+/* pg_pool_t::TYPE_ERASURE */
+#define POOL_TYPE_ERASURE 3
+#define POOL_INFO_MAX 16
+
+enum { POOL_ANY, POOL_REPLICATED, POOL_ERASURE };
+
+struct layout_rule {
+	uint64_t max_size;
+	int pool;
+	struct layout layout;
+};
+
+static struct layout_rule default_rules[] = {
+	{4ULL << 20, POOL_ERASURE, {1 << 20, 1, 4 << 20}},
+	{4ULL << 20, POOL_ANY, {STRIPEUNIT, 1, 4 << 20}},
+	{64ULL << 20, POOL_ANY, {STRIPEUNIT, STRIPECOUNT, 16 << 20}},
+	{4ULL << 30, POOL_ERASURE, {1 << 20, STRIPECOUNT, OBJECTSIZE}},
+	{4ULL << 30, POOL_ANY, {STRIPEUNIT, STRIPECOUNT, OBJECTSIZE}},
+	{UINT64_MAX, POOL_ANY, {1 << 20, STRIPECOUNT * 2, OBJECTSIZE}},
+};
+
+/* stripe width of the pool opened by open_pool, 0 when writes need no alignment */
+uint64_t write_align = 0;
+/* upload buffers in flight */
+int upload_concurrency = 4;
+
+static struct layout_rule *rules = default_rules;
+static int nrules = sizeof(default_rules) / sizeof(default_rules[0]);
+
+/* 512K, 4M, 1G or plain bytes; "max" is no limit */
+int parse_size(const char *s, uint64_t *v) {
+	char *end;
+	if (strcasecmp(s, "max") == 0) {
+		*v = UINT64_MAX;
+		return 0;
+	}
+	*v = strtoull(s, &end, 10);
+	if (end == s)
+		return -1;
+	switch (*end) {
+	case 'k': case 'K': *v <<= 10; end++; break;
+	case 'm': case 'M': *v <<= 20; end++; break;
+	case 'g': case 'G': *v <<= 30; end++; break;
+	}
+	return *end == '\0' ? 0 : -1;
+}
+
+int layout_valid(const struct layout *l) {
+	return l->stripe_unit > 0 && l->stripe_count > 0 && l->object_size >= l->stripe_unit &&
+		l->object_size % l->stripe_unit == 0;
+}
+
+int layout_load(const char *path) {
+	static struct layout_rule loaded[LAYOUT_MAX_RULES];
+	char line[256], f[5][64];
+	uint64_t su, sc, os;
+	int n = 0, fields, lineno = 0, settings = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		debug("can not open layout file %s\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		fields = sscanf(line, "%63s %63s %63s %63s %63s", f[0], f[1], f[2], f[3], f[4]);
+		if (fields <= 0 || f[0][0] == '#')
+			continue;
+		if (strcmp(f[0], "concurrency") == 0) {
+			if (fields != 2 || atoi(f[1]) < 1 || atoi(f[1]) > 256)
+				goto bad;
+			upload_concurrency = atoi(f[1]);
+			settings++;
+			continue;
+		}
+		if (n == LAYOUT_MAX_RULES || fields < 4 || parse_size(f[0], &loaded[n].max_size) < 0 ||
+				parse_size(f[1], &su) < 0 || parse_size(f[2], &sc) < 0 || parse_size(f[3], &os) < 0 ||
+				su > UINT32_MAX || sc > UINT32_MAX || os > UINT32_MAX)
+			goto bad;
+		loaded[n].layout.stripe_unit = su;
+		loaded[n].layout.stripe_count = sc;
+		loaded[n].layout.object_size = os;
+		if (!layout_valid(&loaded[n].layout))
+			goto bad;
+		if (fields < 5)
+			loaded[n].pool = POOL_ANY;
+		else if (strcmp(f[4], "replicated") == 0)
+			loaded[n].pool = POOL_REPLICATED;
+		else if (strcmp(f[4], "erasure") == 0)
+			loaded[n].pool = POOL_ERASURE;
+		else
+			goto bad;
+		n++;
+	}
+	fclose(fp);
+	if (n + settings == 0) {
+		debug("no layout rule in %s\n", path);
+		return -1;
+	}
+	if (n > 0) {
+		rules = loaded;
+		nrules = n;
+	}
+	return 0;
+bad:
+	debug("bad layout rule at %s:%d\n", path, lineno);
+	fclose(fp);
+	return -1;
+}
+
+/* every new object gets l, NULL goes back to the table */
+void layout_override(const struct layout *l) {
+	static struct layout_rule one;
+	static struct layout_rule *saved;
+	static int nsaved;
+
+	if (l == NULL) {
+		if (saved != NULL) {
+			rules = saved;
+			nrules = nsaved;
+			saved = NULL;
+		}
+		return;
+	}
+	if (saved == NULL) {
+		saved = rules;
+		nsaved = nrules;
+	}
+	one.max_size = UINT64_MAX;
+	one.pool = POOL_ANY;
+	one.layout = *l;
+	rules = &one;
+	nrules = 1;
+}
+
+static const char *json_ws(const char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	return p;
+}
+
+/* past the json value at p, NULL when it is cut short */
+static const char *json_skip(const char *p) {
+	int depth = 0;
+	for (p = json_ws(p); *p != '\0'; p++) {
+		if (*p == '"') {
+			for (p++; *p != '"'; p++) {
+				if (*p == '\0')
+					return NULL;
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+			}
+		} else if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']') {
+			/* the end of a number or word inside a container */
+			if (depth == 0)
+				return p;
+			depth--;
+		} else if (*p == ',' && depth == 0) {
+			return p;
+		}
+		if (depth == 0 && (*p == '"' || *p == '}' || *p == ']'))
+			return p + 1;
+	}
+	return depth == 0 ? p : NULL;
+}
+
+/* the value of field at the top level of the json object at p, NULL when it has none */
+static const char *json_field(const char *p, const char *field) {
+	size_t len = strlen(field);
+	const char *k;
+	int match;
+
+	p = json_ws(p);
+	if (*p != '{')
+		return NULL;
+	for (p = json_ws(p + 1); *p == '"'; p = json_ws(p + 1)) {
+		k = p + 1;
+		if ((p = json_skip(p)) == NULL)
+			return NULL;
+		match = (size_t)(p - 1 - k) == len && strncmp(k, field, len) == 0;
+		p = json_ws(p);
+		if (*p != ':')
+			return NULL;
+		p = json_ws(p + 1);
+		if (match)
+			return p;
+		if ((p = json_skip(p)) == NULL)
+			return NULL;
+		p = json_ws(p);
+		if (*p != ',')
+			return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * the type and stripe width of the pool from the osd map. The ioctx
+ * alignment calls only report pools that take no partial writes at all,
+ * an erasure coded pool with allow_ec_overwrites looks replicated there
+ * although every partial stripe write is a read-modify-write.
+ */
+static int pool_query(rados_ioctx_t ioctx, struct pool_info *pi) {
+	const char *cmd[] = {"{\"prefix\": \"osd pool ls\", \"detail\": \"detail\", \"format\": \"json\"}"};
+	char name[256], *out = NULL, *outs = NULL;
+	size_t outlen = 0, outslen = 0, len;
+	const char *p, *v;
+	int ret;
+
+	ret = rados_ioctx_get_pool_name(ioctx, name, sizeof(name));
+	if (ret < 0)
+		return ret;
+	len = strlen(name);
+	ret = rados_mon_command(rados_ioctx_get_cluster(ioctx), cmd, 1, "", 0, &out, &outlen, &outs, &outslen);
+	if (ret < 0)
+		goto out;
+	ret = -ENOENT;
+	p = out ? json_ws(out) : "";
+	if (*p != '[')
+		goto out;
+	for (p = json_ws(p + 1); *p == '{'; p = json_ws(p + 1)) {
+		v = json_field(p, "pool_name");
+		if (v != NULL && *v == '"' && strncmp(v + 1, name, len) == 0 && v[len + 1] == '"') {
+			v = json_field(p, "type");
+			pi->erasure = v != NULL && strtol(v, NULL, 10) == POOL_TYPE_ERASURE;
+			v = json_field(p, "stripe_width");
+			pi->stripe_width = pi->erasure && v != NULL ? strtoull(v, NULL, 10) : 0;
+			ret = 0;
+			break;
+		}
+		if ((p = json_skip(p)) == NULL)
+			break;
+		p = json_ws(p);
+		if (*p != ',')
+			break;
+	}
+out:
+	if (out)
+		rados_buffer_free(out);
+	if (outs)
+		rados_buffer_free(outs);
+	return ret;
+}
+
+/* the pools seen by this process, asked once each */
+int pool_lookup(rados_ioctx_t ioctx, struct pool_info *pi) {
+	static struct pool_info known[POOL_INFO_MAX];
+	static int nknown;
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	int64_t id = rados_ioctx_get_id(ioctx);
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < nknown && known[i].id != id; i++)
+		;
+	if (i < nknown) {
+		*pi = known[i];
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+	pi->id = id;
+	if (pool_query(ioctx, pi) < 0) {
+		/* no mon access: what the ioctx knows, pools without overwrites only */
+		debug("can not read the osd map, the pool type is guessed\n");
+		pi->erasure = rados_ioctx_pool_requires_alignment(ioctx);
+		pi->stripe_width = pi->erasure ? rados_ioctx_pool_required_alignment(ioctx) : 0;
+	}
+	if (nknown < POOL_INFO_MAX)
+		known[nknown++] = *pi;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+uint64_t pool_alignment(rados_ioctx_t ioctx) {
+	struct pool_info pi;
+	pool_lookup(ioctx, &pi);
+	return pi.stripe_width;
+}
+
+/* whole stripes of the pool in every stripe unit, whole units in every object */
+static void layout_align(struct layout *l, uint64_t align) {
+	if (align <= 1)
+		return;
+	l->stripe_unit = (l->stripe_unit + align - 1) / align * align;
+	l->object_size = (l->object_size + l->stripe_unit - 1) / l->stripe_unit * l->stripe_unit;
+}
+
+/* the layout of the striper open_pool sets up */
+void layout_default(rados_ioctx_t ioctx, struct layout *l) {
+	l->stripe_unit = STRIPEUNIT;
+	l->stripe_count = STRIPECOUNT;
+	l->object_size = OBJECTSIZE;
+	layout_align(l, pool_alignment(ioctx));
+}
+
+void layout_pick(rados_ioctx_t ioctx, uint64_t size, struct layout *l) {
+	struct pool_info pi;
+	int pool, i;
+
+	pool_lookup(ioctx, &pi);
+	pool = pi.erasure ? POOL_ERASURE : POOL_REPLICATED;
+	for (i = 0; i < nrules; i++) {
+		if (size <= rules[i].max_size && (rules[i].pool == POOL_ANY || rules[i].pool == pool)) {
+			*l = rules[i].layout;
+			layout_align(l, pi.stripe_width);
+			return;
+		}
+	}
+	layout_default(ioctx, l);
+}
+
+/* the largest write of an upload, BUFFSIZE cut down to whole stripes */
+size_t write_step(void) {
+	if (write_align <= 1 || write_align > BUFFSIZE)
+		return BUFFSIZE;
+	return BUFFSIZE / write_align * write_align;
+}
+
+int layout_apply(rados_striper_t striper, const struct layout *l) {
+	if (rados_striper_set_object_layout_stripe_unit(striper, l->stripe_unit) < 0 ||
+			rados_striper_set_object_layout_stripe_count(striper, l->stripe_count) < 0 ||
+			rados_striper_set_object_layout_object_size(striper, l->object_size) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * a striper creating new objects with the layout for size bytes.
+ * 1: a new one the caller destroys, 0: the default one fits, -1 error.
+ */
+int layout_striper(rados_ioctx_t ioctx, uint64_t size, rados_striper_t *striper) {
+	struct layout l, d;
+	rados_striper_t s;
+
+	layout_pick(ioctx, size, &l);
+	layout_default(ioctx, &d);
+	if (l.stripe_unit == d.stripe_unit && l.stripe_count == d.stripe_count && l.object_size == d.object_size)
+		return 0;
+	if (rados_striper_create(ioctx, &s) < 0)
+		return -1;
+	if (layout_apply(s, &l) < 0) {
+		rados_striper_destroy(s);
+		return -1;
+	}
+	*striper = s;
+	return 1;
+}
@@ -0,0 +1,259 @@
+/*
+ * meta.c
+ *
+ * the metadata of a striped object in one round trip: a single read op
+ * on its head object returns the stat (the mtime) and all xattrs, the
+ * size and layout of libradosstriper among them. rados_striper_stat
+ * reads them one by one.
+ *
+ * A meta_batch keeps up to window such ops in flight and hands the
+ * results to its callback in the order the keys were added, for the
+ * listing, -i, du and the expiry of old versions. Every op is a request
+ * of the shared reactor, so the stats of all batches count against its
+ * limits. meta_op_start issues a single one with a completion of the
+ * caller, for reactor.c requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "striprados.h"
+#include "reactor.h"
+
+#define XATTR_SIZE "striper.size"
+#define XATTR_STRIPE_UNIT "striper.layout.stripe_unit"
+#define XATTR_STRIPE_COUNT "striper.layout.stripe_count"
+#define XATTR_OBJECT_SIZE "striper.layout.object_size"
+
+struct meta_slot {
+	char *key;
+	rados_read_op_t op;
+	rados_completion_t completion;
+	rados_xattrs_iter_t iter;
+	uint64_t head_size;
+	time_t mtime;
+	int stat_rval, xattrs_rval;
+};
+
+/* one op of a batch, ends when the op is done */
+struct meta_req {
+	struct reactor_req req;
+	rados_ioctx_t ioctx;
+	/* valid in the first step only, the batch waits for the op itself */
+	struct meta_slot *s;
+};
+
+struct meta_batch {
+	struct reactor *r;
+	rados_ioctx_t ioctx;
+	meta_fn fn;
+	void *arg;
+	int window, next;
+	struct meta_slot *slots;
+};
+
+/* the xattr values are decimal strings without a terminating nul */
+static uint64_t xattr_number(const char *val, size_t len) {
+	char num[32];
+	if (len >= sizeof(num))
+		len = sizeof(num) - 1;
+	memcpy(num, val, len);
+	num[len] = '\0';
+	return strtoull(num, NULL, 10);
+}
+
+/* the read op with the completion in s, it stays with the caller on failure */
+static int meta_issue(rados_ioctx_t ioctx, struct meta_slot *s) {
+	char *head = malloc(strlen(s->key) + 17 + 1);
+	int ret = -1;
+
+	if (head == NULL)
+		return -1;
+	sprintf(head, "%s.%016d", s->key, 0);
+	s->iter = NULL;
+	s->op = rados_create_read_op();
+	if (s->op != NULL) {
+		rados_read_op_stat(s->op, &s->head_size, &s->mtime, &s->stat_rval);
+		rados_read_op_getxattrs(s->op, &s->iter, &s->xattrs_rval);
+		ret = rados_aio_read_op_operate(s->op, ioctx, s->completion, head, 0);
+	}
+	free(head);
+	return ret;
+}
+
+static int meta_start(rados_ioctx_t ioctx, struct meta_slot *s) {
+	int ret;
+	if (rados_aio_create_completion(NULL, NULL, NULL, &s->completion) < 0) {
+		s->completion = NULL;
+		return -1;
+	}
+	ret = meta_issue(ioctx, s);
+	if (ret < 0) {
+		rados_aio_release(s->completion);
+		s->completion = NULL;
+	}
+	return ret;
+}
+
+/* wait for the op and parse it, -ENOENT when there is no such striped object */
+static int meta_end(struct meta_slot *s, struct object_meta *m) {
+	const char *name, *val;
+	size_t len;
+	int ret = -EIO, sized = 0;
+
+	memset(m, 0, sizeof(*m));
+	if (s->completion != NULL) {
+		/* the reactor callback still touches its request */
+		rados_aio_wait_for_complete_and_cb(s->completion);
+		ret = rados_aio_get_return_value(s->completion);
+		rados_aio_release(s->completion);
+		s->completion = NULL;
+	}
+	if (ret >= 0)
+		ret = s->stat_rval < 0 ? s->stat_rval : s->xattrs_rval;
+	if (ret >= 0 && s->iter != NULL) {
+		m->mtime = s->mtime;
+		while (rados_getxattrs_next(s->iter, &name, &val, &len) == 0 && name != NULL) {
+			if (strcmp(name, XATTR_SIZE) == 0) {
+				m->size = xattr_number(val, len);
+				sized = 1;
+			} else if (strcmp(name, XATTR_STRIPE_UNIT) == 0) {
+				m->layout.stripe_unit = xattr_number(val, len);
+			} else if (strcmp(name, XATTR_STRIPE_COUNT) == 0) {
+				m->layout.stripe_count = xattr_number(val, len);
+			} else if (strcmp(name, XATTR_OBJECT_SIZE) == 0) {
+				m->layout.object_size = xattr_number(val, len);
+			}
+		}
+	}
+	if (s->iter != NULL)
+		rados_getxattrs_end(s->iter);
+	s->iter = NULL;
+	if (s->op != NULL)
+		rados_release_read_op(s->op);
+	s->op = NULL;
+	/* a head object without the size is not a striped object */
+	if (ret >= 0 && !sized)
+		ret = -ENOENT;
+	return ret < 0 ? ret : 0;
+}
+
+static int meta_req_step(struct reactor_req *r) {
+	struct meta_req *q = (struct meta_req *)r;
+	struct meta_slot *s = q->s;
+
+	if (r->state++ > 0)
+		return REQ_DONE;
+	s->completion = reactor_completion(r);
+	if (s->completion == NULL)
+		return REQ_DONE;
+	if (meta_issue(q->ioctx, s) < 0) {
+		reactor_unused(r, s->completion);
+		s->completion = NULL;
+		return REQ_DONE;
+	}
+	return REQ_MORE;
+}
+
+static void meta_req_done(struct reactor_req *r) {
+	free(r);
+}
+
+/* the op of s once the reactor admits it, a failed one ends as -EIO */
+static void meta_submit(struct meta_batch *b, struct meta_slot *s) {
+	struct meta_req *q = calloc(1, sizeof(struct meta_req));
+
+	s->completion = NULL;
+	if (q == NULL)
+		return;
+	q->req.step = meta_req_step;
+	q->req.done = meta_req_done;
+	q->ioctx = b->ioctx;
+	q->s = s;
+	reactor_start(b->r, NULL, &q->req);
+}
+
+int meta_fetch(rados_ioctx_t ioctx, const char *key, struct object_meta *m) {
+	struct meta_slot s;
+	memset(&s, 0, sizeof(s));
+	s.key = (char *)key;
+	/* a failed start ends as -EIO */
+	meta_start(ioctx, &s);
+	return meta_end(&s, m);
+}
+
+struct meta_slot *meta_op_start(rados_ioctx_t ioctx, const char *key, rados_completion_t c) {
+	struct meta_slot *s = calloc(1, sizeof(struct meta_slot));
+	if (s == NULL)
+		return NULL;
+	s->key = (char *)key;
+	s->completion = c;
+	if (meta_issue(ioctx, s) < 0) {
+		if (s->op != NULL)
+			rados_release_read_op(s->op);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+int meta_op_end(struct meta_slot *s, struct object_meta *m) {
+	int ret = meta_end(s, m);
+	free(s);
+	return ret;
+}
+
+struct meta_batch *meta_batch_new(rados_ioctx_t ioctx, int window, meta_fn fn, void *arg) {
+	struct meta_batch *b = calloc(1, sizeof(struct meta_batch));
+	if (b == NULL)
+		return NULL;
+	b->slots = calloc(window, sizeof(struct meta_slot));
+	b->r = reactor_shared();
+	if (b->slots == NULL || b->r == NULL) {
+		free(b->slots);
+		free(b);
+		return NULL;
+	}
+	b->ioctx = ioctx;
+	b->window = window;
+	b->fn = fn;
+	b->arg = arg;
+	return b;
+}
+
+static void meta_deliver(struct meta_batch *b, struct meta_slot *s) {
+	struct object_meta m;
+	int ret = meta_end(s, &m);
+	b->fn(b->arg, s->key, ret, &m);
+	free(s->key);
+	s->key = NULL;
+}
+
+/* may first hand the oldest key to the callback */
+int meta_batch_add(struct meta_batch *b, const char *key, size_t len) {
+	struct meta_slot *s = &b->slots[b->next];
+
+	if (s->key != NULL)
+		meta_deliver(b, s);
+	s->key = strndup(key, len);
+	if (s->key == NULL)
+		return -1;
+	/* a failed start is still delivered, as an error */
+	meta_submit(b, s);
+	b->next = (b->next + 1) % b->window;
+	return 0;
+}
+
+/* the rest in order, then the batch is freed */
+void meta_batch_finish(struct meta_batch *b) {
+	struct meta_slot *s;
+	int i;
+	for (i = 0; i < b->window; i++) {
+		s = &b->slots[(b->next + i) % b->window];
+		if (s->key != NULL)
+			meta_deliver(b, s);
+	}
+	free(b->slots);
+	free(b);
+}
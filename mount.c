@@ -0,0 +1,586 @@
+/*
+ * mount.c
+ *
+ * "striprados mount": expose the striped objects of a pool as a read only
+ * FUSE file system. Every head object becomes a file of the root
+ * directory, size and mtime come from rados_striper_stat.
+ *
+ * Reads go through an LRU cache of STRIPEUNIT sized blocks shared by all
+ * open files. A file read sequentially gets a growing read-ahead window,
+ * the blocks ahead are fetched with rados_striper_aio_read so that a
+ * player streaming a file rarely waits for the cluster.
+ *
+ * Compressed objects bypass the block cache: every file keeps the last
+ * chunk it decompressed, which a sequential reader goes through before
+ * the next one is fetched.
+ */
+
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+#include <fuse.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "list.h"
+#include "crc32c.h"
+#include "striprados.h"
+
+#define MOUNT_BLOCK STRIPEUNIT
+#define MOUNT_HASH 4096
+/* largest read-ahead window, in blocks */
+#define MOUNT_READAHEAD (STRIPECOUNT * 8)
+/* seconds a directory listing is reused */
+#define MOUNT_LIST_TTL 30
+
+/*
+ * what tells two uploads of a key apart: the mtime has whole seconds
+ * only, the size, the content sum and the nonce of an encrypted object
+ * complete it
+ */
+struct version {
+	uint64_t size;
+	time_t mtime;
+	/* crc32c of the whole object, 0 without sums */
+	uint32_t sum;
+	unsigned char nonce[CRYPT_NONCE_LEN];
+};
+
+struct block {
+	struct list_head hash;
+	struct list_head lru;
+	char *key;
+	struct version v;
+	uint64_t index;
+	char *data;
+	/* valid bytes, short at the end of an object, < 0 on error */
+	int len;
+	int loading;
+	int refs;
+	rados_completion_t completion;
+	/* the block is decrypted once loaded */
+	int crypted;
+	struct crypt_info ci;
+};
+
+struct mount_file {
+	char *key;
+	uint64_t size;
+	time_t mtime;
+	struct version v;
+	/* read-ahead state, a hint only so races do no harm */
+	uint64_t next_offset;
+	int ra_blocks;
+	/* compressed objects: the chunk map and the last chunk read */
+	int compressed;
+	struct chunk_map map;
+	int crypted;
+	struct crypt_info ci;
+	pthread_mutex_t chunk_mutex;
+	char *chunk;
+	uint64_t chunk_index;
+	int chunk_len;
+};
+
+static rados_ioctx_t mount_ioctx;
+static rados_striper_t mount_striper;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+static struct list_head buckets[MOUNT_HASH];
+static LIST_HEAD(lru);
+static int nblocks;
+static int max_blocks;
+
+/* the version of every key at its last open, the page cache is kept while it holds */
+struct seen {
+	struct list_head hash;
+	char *key;
+	struct version v;
+};
+static struct list_head seen_buckets[MOUNT_HASH];
+
+static pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char **names;
+static int nnames;
+static time_t names_time;
+
+/* keys may contain '/', which a file name can not: escape it as %2F */
+static char *key_to_name(const char *key, int len) {
+	char *name = malloc(len * 3 + 1), *p = name;
+	int i;
+	if (name == NULL)
+		return NULL;
+	for (i = 0; i < len; i++) {
+		if (key[i] == '/' || key[i] == '%')
+			p += sprintf(p, "%%%02X", (unsigned char)key[i]);
+		else
+			*p++ = key[i];
+	}
+	*p = '\0';
+	return name;
+}
+
+static char *path_to_key(const char *path) {
+	char *key, *p;
+	unsigned int c;
+	if (path[0] != '/' || path[1] == '\0' || strchr(path + 1, '/') != NULL)
+		return NULL;
+	key = strdup(path + 1);
+	if (key == NULL)
+		return NULL;
+	/* decode in place, the result is never longer */
+	p = key;
+	for (path = key; *path; path++) {
+		if (*path == '%' && sscanf(path + 1, "%2X", &c) == 1) {
+			*p++ = c;
+			path += 2;
+		} else {
+			*p++ = *path;
+		}
+	}
+	*p = '\0';
+	return key;
+}
+
+static unsigned int block_hash(const char *key, uint64_t index) {
+	unsigned int h = 5381;
+	while (*key)
+		h = h * 33 + (unsigned char)*key++;
+	return (h ^ (unsigned int)(index * 2654435761u)) % MOUNT_HASH;
+}
+
+static int version_equal(const struct version *a, const struct version *b) {
+	return a->size == b->size && a->mtime == b->mtime && a->sum == b->sum &&
+		memcmp(a->nonce, b->nonce, CRYPT_NONCE_LEN) == 0;
+}
+
+/* 1 when key had version v at its last open too, or was never opened */
+static int seen_version(const char *key, const struct version *v) {
+	static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+	unsigned int h = block_hash(key, 0);
+	struct seen *e;
+	int same = 1;
+
+	pthread_mutex_lock(&seen_mutex);
+	list_for_each_entry(e, &seen_buckets[h], hash) {
+		if (strcmp(e->key, key) == 0) {
+			same = version_equal(&e->v, v);
+			e->v = *v;
+			pthread_mutex_unlock(&seen_mutex);
+			return same;
+		}
+	}
+	e = malloc(sizeof(struct seen));
+	if (e == NULL || (e->key = strdup(key)) == NULL) {
+		free(e);
+		/* not remembered, the next open could not tell */
+		same = 0;
+	} else {
+		e->v = *v;
+		list_add(&e->hash, &seen_buckets[h]);
+	}
+	pthread_mutex_unlock(&seen_mutex);
+	return same;
+}
+
+static void free_block(struct block *b) {
+	list_del(&b->hash);
+	list_del(&b->lru);
+	nblocks--;
+	free(b->key);
+	free(b->data);
+	free(b);
+}
+
+/* make room for one more block, cache_mutex held */
+static int evict_one(void) {
+	struct block *b;
+	if (nblocks < max_blocks)
+		return 0;
+	list_for_each_entry_reverse(b, &lru, lru) {
+		if (b->refs == 0 && !b->loading) {
+			free_block(b);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void block_loaded(rados_completion_t c, void *arg) {
+	struct block *b = (struct block *)arg;
+	int len = rados_aio_get_return_value(c);
+	if (len > 0 && b->crypted && crypt_buffer(&b->ci, b->data, len, b->index * MOUNT_BLOCK) < 0)
+		len = -EIO;
+	pthread_mutex_lock(&cache_mutex);
+	b->len = len;
+	b->loading = 0;
+	b->completion = NULL;
+	pthread_cond_broadcast(&cache_loaded);
+	pthread_mutex_unlock(&cache_mutex);
+	rados_aio_release(c);
+}
+
+/*
+ * find or load block index of an object. With prefetch set the block is
+ * only started in the background and NULL is returned. The caller drops
+ * its reference with put_block.
+ */
+static struct block *get_block(struct mount_file *f, uint64_t index, int prefetch) {
+	unsigned int h = block_hash(f->key, index);
+	struct block *b;
+	uint64_t offset = index * MOUNT_BLOCK;
+	size_t len = f->size - offset < MOUNT_BLOCK ? f->size - offset : MOUNT_BLOCK;
+	int ret;
+
+	pthread_mutex_lock(&cache_mutex);
+	list_for_each_entry(b, &buckets[h], hash) {
+		if (b->index == index && version_equal(&b->v, &f->v) && strcmp(b->key, f->key) == 0) {
+			list_move(&b->lru, &lru);
+			if (prefetch) {
+				pthread_mutex_unlock(&cache_mutex);
+				return NULL;
+			}
+			b->refs++;
+			while (b->loading)
+				pthread_cond_wait(&cache_loaded, &cache_mutex);
+			pthread_mutex_unlock(&cache_mutex);
+			return b;
+		}
+	}
+
+	if (evict_one() < 0 && prefetch) {
+		/* every block is in use, read-ahead can wait */
+		pthread_mutex_unlock(&cache_mutex);
+		return NULL;
+	}
+	b = calloc(1, sizeof(struct block));
+	if (b == NULL || (b->data = malloc(MOUNT_BLOCK)) == NULL || (b->key = strdup(f->key)) == NULL) {
+		if (b) {
+			free(b->data);
+			free(b);
+		}
+		pthread_mutex_unlock(&cache_mutex);
+		return NULL;
+	}
+	b->index = index;
+	b->v = f->v;
+	b->crypted = f->crypted;
+	b->ci = f->ci;
+	b->loading = 1;
+	list_add(&b->hash, &buckets[h]);
+	list_add(&b->lru, &lru);
+	nblocks++;
+
+	if (prefetch) {
+		if (rados_aio_create_completion(b, block_loaded, NULL, &b->completion) < 0 ||
+				rados_striper_aio_read(mount_striper, f->key, b->completion, b->data, len, offset) < 0) {
+			if (b->completion)
+				rados_aio_release(b->completion);
+			free_block(b);
+		}
+		pthread_mutex_unlock(&cache_mutex);
+		return NULL;
+	}
+
+	b->refs++;
+	pthread_mutex_unlock(&cache_mutex);
+	ret = rados_striper_read(mount_striper, f->key, b->data, len, offset);
+	if (ret > 0 && b->crypted && crypt_buffer(&b->ci, b->data, ret, offset) < 0)
+		ret = -EIO;
+	pthread_mutex_lock(&cache_mutex);
+	b->len = ret;
+	b->loading = 0;
+	pthread_cond_broadcast(&cache_loaded);
+	pthread_mutex_unlock(&cache_mutex);
+	return b;
+}
+
+static void put_block(struct block *b) {
+	pthread_mutex_lock(&cache_mutex);
+	b->refs--;
+	/* failed reads are not cached, the next reader tries again */
+	if (b->refs == 0 && b->len < 0)
+		free_block(b);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+static int mount_getattr(const char *path, struct stat *st) {
+	uint64_t size;
+	time_t mtime;
+	char *key;
+	int ret;
+
+	memset(st, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+		return 0;
+	}
+	key = path_to_key(path);
+	if (key == NULL)
+		return -ENOENT;
+	ret = rados_striper_stat(mount_striper, key, &size, &mtime);
+	free(key);
+	if (ret < 0)
+		return ret;
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blksize = MOUNT_BLOCK;
+	st->st_blocks = (size + 511) / 512;
+	st->st_mtime = st->st_ctime = st->st_atime = mtime;
+	return 0;
+}
+
+/* refresh the cached listing of head objects when it is older than MOUNT_LIST_TTL */
+static int load_names(void) {
+	rados_list_ctx_t list_ctx;
+	const char *entry;
+	char **list = NULL, **tmp;
+	int n = 0, cap = 0, length, i;
+
+	if (names != NULL && time(NULL) - names_time < MOUNT_LIST_TTL)
+		return 0;
+	if (rados_objects_list_open(mount_ioctx, &list_ctx) < 0)
+		return -EIO;
+	while (rados_objects_list_next(list_ctx, &entry, NULL) != -ENOENT) {
+		if ((length = is_head_object(entry)) == 0)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 256;
+			tmp = realloc(list, cap * sizeof(char *));
+			if (tmp == NULL)
+				break;
+			list = tmp;
+		}
+		if ((list[n] = key_to_name(entry, length)) != NULL)
+			n++;
+	}
+	rados_objects_list_close(list_ctx);
+
+	for (i = 0; i < nnames; i++)
+		free(names[i]);
+	free(names);
+	names = list;
+	nnames = n;
+	names_time = time(NULL);
+	return 0;
+}
+
+static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	int i, ret;
+	if (strcmp(path, "/") != 0)
+		return -ENOENT;
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	pthread_mutex_lock(&names_mutex);
+	ret = load_names();
+	for (i = 0; ret == 0 && i < nnames; i++)
+		filler(buf, names[i], NULL, 0);
+	pthread_mutex_unlock(&names_mutex);
+	return ret;
+}
+
+static int mount_open(const char *path, struct fuse_file_info *fi) {
+	struct mount_file *f;
+	struct chunk_sums sums;
+	int ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	f = calloc(1, sizeof(struct mount_file));
+	if (f == NULL)
+		return -ENOMEM;
+	f->key = path_to_key(path);
+	if (f->key == NULL) {
+		free(f);
+		return -ENOENT;
+	}
+	ret = rados_striper_stat(mount_striper, f->key, &f->size, &f->mtime);
+	if (ret == 0) {
+		ret = cmap_load(mount_striper, f->key, f->size, &f->map);
+		f->compressed = ret == 0;
+		ret = ret < 0 ? -EIO : 0;
+	}
+	if (ret == 0) {
+		ret = crypt_load(mount_striper, f->key, &f->ci);
+		f->crypted = ret == 0;
+		ret = ret < 0 ? -EACCES : 0;
+		if (ret < 0 && f->compressed)
+			cmap_free(&f->map);
+	}
+	if (ret == 0 && f->compressed) {
+		f->chunk = malloc(f->map.chunk);
+		f->chunk_len = -1;
+		pthread_mutex_init(&f->chunk_mutex, NULL);
+		if (f->chunk == NULL) {
+			cmap_free(&f->map);
+			ret = -ENOMEM;
+		}
+	}
+	if (ret < 0) {
+		free(f->key);
+		free(f);
+		return ret;
+	}
+	f->v.size = f->size;
+	f->v.mtime = f->mtime;
+	if (f->crypted) {
+		memcpy(f->v.nonce, f->ci.nonce, CRYPT_NONCE_LEN);
+	} else if (sums_load(mount_striper, f->key, f->size, &sums) == 0) {
+		f->v.sum = sums_whole(&sums);
+		sums_free(&sums);
+	}
+	fi->fh = (uint64_t)(uintptr_t)f;
+	/* the pages the kernel kept are still good if the object did not change */
+	fi->keep_cache = seen_version(f->key, &f->v);
+	return 0;
+}
+
+static int read_compressed(struct mount_file *f, char *buf, size_t size, off_t offset) {
+	uint64_t index;
+	size_t done = 0, coff;
+	int n;
+
+	pthread_mutex_lock(&f->chunk_mutex);
+	while (done < size) {
+		index = (offset + done) / f->map.chunk;
+		coff = (offset + done) % f->map.chunk;
+		if (f->chunk_len < 0 || f->chunk_index != index) {
+			f->chunk_index = index;
+			f->chunk_len = read_logical(mount_striper, f->key, &f->map, f->crypted ? &f->ci : NULL, f->chunk, f->map.chunk, index * f->map.chunk);
+			if (f->chunk_len < 0) {
+				pthread_mutex_unlock(&f->chunk_mutex);
+				return done ? (int)done : -EIO;
+			}
+		}
+		n = (int)coff < f->chunk_len ? f->chunk_len - coff : 0;
+		if ((size_t)n > size - done)
+			n = size - done;
+		memcpy(buf + done, f->chunk + coff, n);
+		if (n == 0)
+			break;
+		done += n;
+	}
+	pthread_mutex_unlock(&f->chunk_mutex);
+	return done;
+}
+
+static int mount_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct mount_file *f = (struct mount_file *)(uintptr_t)fi->fh;
+	struct block *b;
+	uint64_t index, last;
+	size_t done = 0, boff;
+	int n, i;
+
+	if ((uint64_t)offset >= f->size)
+		return 0;
+	if (offset + size > f->size)
+		size = f->size - offset;
+	if (f->compressed)
+		return read_compressed(f, buf, size, offset);
+
+	/* sequential readers get a read-ahead window doubling up to MOUNT_READAHEAD */
+	if ((uint64_t)offset == f->next_offset)
+		f->ra_blocks = f->ra_blocks ? (f->ra_blocks * 2 > MOUNT_READAHEAD ? MOUNT_READAHEAD : f->ra_blocks * 2) : 1;
+	else
+		f->ra_blocks = 0;
+	f->next_offset = offset + size;
+
+	while (done < size) {
+		index = (offset + done) / MOUNT_BLOCK;
+		boff = (offset + done) % MOUNT_BLOCK;
+		b = get_block(f, index, 0);
+		if (b == NULL)
+			return done ? (int)done : -ENOMEM;
+		if (b->len < 0) {
+			n = b->len;
+			put_block(b);
+			return done ? (int)done : n;
+		}
+		n = (int)boff < b->len ? b->len - boff : 0;
+		if ((size_t)n > size - done)
+			n = size - done;
+		memcpy(buf + done, b->data + boff, n);
+		put_block(b);
+		if (n == 0)
+			break;
+		done += n;
+	}
+
+	last = (offset + size - 1) / MOUNT_BLOCK;
+	for (i = 1; i <= f->ra_blocks && (last + i) * MOUNT_BLOCK < f->size; i++)
+		get_block(f, last + i, 1);
+	return done;
+}
+
+static int mount_release(const char *path, struct fuse_file_info *fi) {
+	struct mount_file *f = (struct mount_file *)(uintptr_t)fi->fh;
+	if (f->compressed) {
+		cmap_free(&f->map);
+		free(f->chunk);
+		pthread_mutex_destroy(&f->chunk_mutex);
+	}
+	free(f->key);
+	free(f);
+	return 0;
+}
+
+static struct fuse_operations mount_ops = {
+	.getattr = mount_getattr,
+	.readdir = mount_readdir,
+	.open = mount_open,
+	.read = mount_read,
+	.release = mount_release,
+};
+
+int do_mount(rados_ioctx_t ioctx, rados_striper_t striper, const char *pool_name, const char *mountpoint, int cache_mb) {
+	char fsname[256];
+	char *fuse_argv[6];
+	int i, ret;
+
+	mount_ioctx = ioctx;
+	mount_striper = striper;
+	max_blocks = (int)(((uint64_t)cache_mb << 20) / MOUNT_BLOCK);
+	if (max_blocks < MOUNT_READAHEAD * 2)
+		max_blocks = MOUNT_READAHEAD * 2;
+	for (i = 0; i < MOUNT_HASH; i++) {
+		INIT_LIST_HEAD(&buckets[i]);
+		INIT_LIST_HEAD(&seen_buckets[i]);
+	}
+
+	/* stay in the foreground: the rados threads would not survive a fork */
+	snprintf(fsname, sizeof(fsname), "ro,default_permissions,fsname=striprados:%s", pool_name);
+	fuse_argv[0] = "striprados";
+	fuse_argv[1] = (char *)mountpoint;
+	fuse_argv[2] = "-f";
+	fuse_argv[3] = "-o";
+	fuse_argv[4] = fsname;
+	fuse_argv[5] = NULL;
+	/* fuse only takes over the signals nobody handles, it unmounts on them */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	debug("mounting pool %s on %s, %d blocks of cache\n", pool_name, mountpoint, max_blocks);
+	ret = fuse_main(5, fuse_argv, &mount_ops, NULL);
+
+	/* wait for read-ahead still in flight before dropping the cache */
+	rados_striper_aio_flush(mount_striper);
+	pthread_mutex_lock(&cache_mutex);
+	while (!list_empty(&lru)) {
+		struct block *b = list_entry(lru.next, struct block, lru);
+		while (b->loading)
+			pthread_cond_wait(&cache_loaded, &cache_mutex);
+		free_block(b);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return ret == 0 ? 0 : -1;
+}
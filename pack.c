@@ -0,0 +1,670 @@
+/*
+ * pack.c
+ *
+ * small files (up to PACK_MAX_FILE) can be packed: instead of a striped
+ * object with its lock, xattrs and a RADOS object of its own, the data is
+ * appended to a plain pack object "striprados.pack.<n>" of up to
+ * PACK_SIZE bytes. The omap of PACK_INDEX maps every packed key to
+ *
+ *	"<pack> <offset> <length> <crc32c> <mtime>"
+ *
+ * so a lookup is one omap read and one data read. Writers append under
+ * an exclusive lock on the index, a batch of files pays for it once.
+ * Index entries are written after the data they point at. The lock is a
+ * lease of PACK_LOCK_SECONDS: a writer renews it before every flush and
+ * every PACK_LOCK_SECONDS / 3 in between, and gives up the write once it
+ * could have run out, another writer may append at the same offset then.
+ *
+ * Deleting or packing a key again leaves its old bytes dead in the pack.
+ * "compact" copies the live entries of packs that are mostly dead into
+ * the current pack and removes them.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "crc32c.h"
+#include "striprados.h"
+
+#define PACK_INDEX "striprados.pack.index"
+#define PACK_PREFIX "striprados.pack."
+#define PACK_LOCK "striprados.pack.lock"
+/* number of the pack being appended to, on the index object */
+#define PACK_CURRENT_XATTR "striprados.pack.current"
+#define PACK_SIZE (64 << 20)
+/* data buffered before it is written to the pack */
+#define PACK_BATCH (4 << 20)
+#define PACK_LOCK_SECONDS 60
+/* a lease this close to running out is taken as lost */
+#define PACK_LOCK_MARGIN 10
+/* index entries read per omap request */
+#define PACK_PAGE 1000
+/* compact packs with at least this percentage of dead bytes */
+#define PACK_DEAD_PERCENT 50
+
+struct pack_entry {
+	uint32_t pack;
+	uint64_t offset;
+	uint32_t len;
+	uint32_t crc;
+	time_t mtime;
+};
+
+static void pack_name(uint32_t pack, char *name, size_t len) {
+	snprintf(name, len, PACK_PREFIX "%08u", pack);
+}
+
+static int entry_parse(const char *val, size_t len, struct pack_entry *e) {
+	char tmp[128];
+	long long mtime;
+	if (len == 0 || len >= sizeof(tmp))
+		return -1;
+	memcpy(tmp, val, len);
+	tmp[len] = '\0';
+	if (sscanf(tmp, "%u %" SCNu64 " %u %x %lld", &e->pack, &e->offset, &e->len, &e->crc, &mtime) != 5)
+		return -1;
+	e->mtime = mtime;
+	return 0;
+}
+
+static int entry_format(const struct pack_entry *e, char *buf, size_t len) {
+	return snprintf(buf, len, "%u %" PRIu64 " %u %08x %lld", e->pack, e->offset, e->len, e->crc, (long long)e->mtime);
+}
+
+/* the lock expires on its own if we die holding it, long runs renew it */
+static int pack_lock(rados_ioctx_t ioctx, char *cookie, size_t len) {
+	struct timeval duration = {PACK_LOCK_SECONDS, 0};
+	char host[64];
+	int ret, tries;
+
+	if (cookie[0] == '\0') {
+		gethostname(host, sizeof(host));
+		host[sizeof(host) - 1] = '\0';
+		snprintf(cookie, len, "%s.%ld", host, (long)getpid());
+	}
+	for (tries = 0; tries < PACK_LOCK_SECONDS * 10 && !quit; tries++) {
+		ret = rados_lock_exclusive(ioctx, PACK_INDEX, PACK_LOCK, cookie, "", &duration, 0);
+		if (ret != -EBUSY)
+			return ret;
+		usleep(100000);
+	}
+	debug("the pack index is locked by another writer\n");
+	return -EBUSY;
+}
+
+static void pack_unlock(rados_ioctx_t ioctx, const char *cookie) {
+	rados_unlock(ioctx, PACK_INDEX, PACK_LOCK, cookie);
+}
+
+/* 0 and the entry, -ENOENT when key is not packed */
+static int pack_lookup(rados_ioctx_t ioctx, const char *key, struct pack_entry *e) {
+	const char *keys[1] = {key};
+	rados_read_op_t op;
+	rados_omap_iter_t iter;
+	char *k, *v;
+	size_t len;
+	int prval = 0, ret = -ENOENT;
+
+	op = rados_create_read_op();
+	rados_read_op_omap_get_vals_by_keys(op, keys, 1, &iter, &prval);
+	if (rados_read_op_operate(op, ioctx, PACK_INDEX, 0) == 0 && prval == 0) {
+		if (rados_omap_get_next(iter, &k, &v, &len) == 0 && k != NULL && v != NULL)
+			ret = entry_parse(v, len, e) == 0 ? 0 : -EIO;
+		rados_omap_get_end(iter);
+	}
+	rados_release_read_op(op);
+	return ret;
+}
+
+/* the data of a packed key, malloced, its length in e->len */
+int pack_read(rados_ioctx_t ioctx, const char *key, char **data, uint32_t *len, time_t *mtime) {
+	struct pack_entry e;
+	char name[64];
+	char *buf;
+	int ret, retry;
+
+	/* a compaction may move the entry between the lookup and the read */
+	for (retry = 0; retry < 2; retry++) {
+		ret = pack_lookup(ioctx, key, &e);
+		if (ret < 0)
+			return ret;
+		buf = malloc(e.len ? e.len : 1);
+		if (buf == NULL)
+			return -ENOMEM;
+		pack_name(e.pack, name, sizeof(name));
+		ret = rados_read(ioctx, name, buf, e.len, e.offset);
+		if (ret == (int)e.len) {
+			if (crc32c(0, buf, e.len) != e.crc) {
+				debug("checksum mismatch in packed %s\n", key);
+				free(buf);
+				return -EIO;
+			}
+			*data = buf;
+			*len = e.len;
+			if (mtime)
+				*mtime = e.mtime;
+			return 0;
+		}
+		free(buf);
+	}
+	debug("failed to read packed %s errno: %d\n", key, ret);
+	return ret < 0 ? ret : -EIO;
+}
+
+/* the index entry with mtime and size for info */
+int pack_stat(rados_ioctx_t ioctx, const char *key, uint64_t *size, time_t *mtime) {
+	struct pack_entry e;
+	int ret = pack_lookup(ioctx, key, &e);
+	if (ret == 0) {
+		*size = e.len;
+		*mtime = e.mtime;
+	}
+	return ret;
+}
+
+int pack_get_fd(rados_ioctx_t ioctx, const char *key, int fd) {
+	char *data;
+	uint32_t len;
+	int ret = pack_read(ioctx, key, &data, &len, NULL);
+	if (ret < 0)
+		return ret;
+	ret = write_full(fd, data, len) < 0 ? -EIO : 0;
+	free(data);
+	return ret;
+}
+
+/* the appending side, shared by uploads and compaction */
+struct pack_writer {
+	rados_ioctx_t ioctx;
+	uint32_t pack;
+	/* bytes of the pack, buffered ones included */
+	uint64_t size;
+	char *buf;
+	size_t fill;
+	/* entries of the buffered data */
+	char **keys;
+	char **vals;
+	size_t *lens;
+	int n;
+	int cap;
+	/* of the lock we hold, and when it was last taken or renewed */
+	const char *cookie;
+	double locked;
+};
+
+/* right after pack_lock */
+static int writer_open(struct pack_writer *w, rados_ioctx_t ioctx, const char *cookie) {
+	char val[32], name[64];
+	uint64_t size;
+	time_t mtime;
+	int ret;
+
+	memset(w, 0, sizeof(struct pack_writer));
+	w->ioctx = ioctx;
+	w->cookie = cookie;
+	w->locked = qos_now();
+	ret = rados_getxattr(ioctx, PACK_INDEX, PACK_CURRENT_XATTR, val, sizeof(val) - 1);
+	if (ret > 0) {
+		val[ret] = '\0';
+		w->pack = strtoul(val, NULL, 10);
+	}
+	pack_name(w->pack, name, sizeof(name));
+	ret = rados_stat(ioctx, name, &size, &mtime);
+	if (ret < 0 && ret != -ENOENT)
+		return ret;
+	w->size = ret == 0 ? size : 0;
+	w->buf = malloc(PACK_BATCH);
+	return w->buf ? 0 : -ENOMEM;
+}
+
+/* the lease must not have run out, the offsets of the writer are only ours while it holds */
+static int writer_renew(struct pack_writer *w) {
+	struct timeval duration = {PACK_LOCK_SECONDS, 0};
+	double now = qos_now();
+	int ret;
+
+	if (now - w->locked >= PACK_LOCK_SECONDS - PACK_LOCK_MARGIN) {
+		debug("the pack lock ran out\n");
+		return -ETIMEDOUT;
+	}
+	ret = rados_lock_exclusive(w->ioctx, PACK_INDEX, PACK_LOCK, w->cookie, "", &duration, LIBRADOS_LOCK_FLAG_RENEW);
+	if (ret < 0) {
+		debug("failed to renew the pack lock errno: %d\n", ret);
+		return ret;
+	}
+	w->locked = now;
+	return 0;
+}
+
+/* renew on a time budget, for work that does not flush */
+static int writer_keep(struct pack_writer *w) {
+	if (qos_now() - w->locked < PACK_LOCK_SECONDS / 3)
+		return 0;
+	return writer_renew(w);
+}
+
+/* data first, then the entries pointing at it */
+static int writer_flush(struct pack_writer *w) {
+	char name[64];
+	rados_write_op_t op;
+	int ret = 0, i;
+
+	if (w->fill > 0 || w->n > 0)
+		ret = writer_renew(w);
+	if (ret == 0 && w->fill > 0) {
+		pack_name(w->pack, name, sizeof(name));
+		ret = rados_write(w->ioctx, name, w->buf, w->fill, w->size - w->fill);
+	}
+	w->fill = 0;
+	if (ret == 0 && w->n > 0) {
+		op = rados_create_write_op();
+		rados_write_op_omap_set(op, (const char * const *)w->keys, (const char * const *)w->vals, w->lens, w->n);
+		ret = rados_write_op_operate(op, w->ioctx, PACK_INDEX, NULL, 0);
+		rados_release_write_op(op);
+	}
+	for (i = 0; i < w->n; i++) {
+		free(w->keys[i]);
+		free(w->vals[i]);
+	}
+	w->n = 0;
+	return ret;
+}
+
+static int writer_add(struct pack_writer *w, const char *key, const char *data, uint32_t len, time_t mtime) {
+	struct pack_entry e;
+	char val[128], cur[32];
+	int ret;
+
+	/* slow sources or long compactions flush seldom */
+	if ((ret = writer_keep(w)) < 0)
+		return ret;
+	if (w->size + len > PACK_SIZE && w->size > 0) {
+		ret = writer_flush(w);
+		if (ret < 0)
+			return ret;
+		w->pack++;
+		w->size = 0;
+		snprintf(cur, sizeof(cur), "%u", w->pack);
+		ret = rados_setxattr(w->ioctx, PACK_INDEX, PACK_CURRENT_XATTR, cur, strlen(cur));
+		if (ret < 0)
+			return ret;
+	}
+	if (w->fill + len > PACK_BATCH && (ret = writer_flush(w)) < 0)
+		return ret;
+	if (w->n == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 64;
+		w->keys = realloc(w->keys, w->cap * sizeof(char *));
+		w->vals = realloc(w->vals, w->cap * sizeof(char *));
+		w->lens = realloc(w->lens, w->cap * sizeof(size_t));
+		if (w->keys == NULL || w->vals == NULL || w->lens == NULL)
+			return -ENOMEM;
+	}
+
+	e.pack = w->pack;
+	e.offset = w->size;
+	e.len = len;
+	e.crc = crc32c(0, data, len);
+	e.mtime = mtime;
+	w->lens[w->n] = entry_format(&e, val, sizeof(val));
+	w->keys[w->n] = strdup(key);
+	w->vals[w->n] = strdup(val);
+	if (w->keys[w->n] == NULL || w->vals[w->n] == NULL)
+		return -ENOMEM;
+	w->n++;
+	memcpy(w->buf + w->fill, data, len);
+	w->fill += len;
+	w->size += len;
+	return 0;
+}
+
+static int writer_close(struct pack_writer *w) {
+	char cur[32];
+	int ret = writer_flush(w);
+	if (ret == 0) {
+		snprintf(cur, sizeof(cur), "%u", w->pack);
+		ret = rados_setxattr(w->ioctx, PACK_INDEX, PACK_CURRENT_XATTR, cur, strlen(cur));
+	}
+	free(w->buf);
+	free(w->keys);
+	free(w->vals);
+	free(w->lens);
+	return ret;
+}
+
+/* pack n files under one lock, keys[i] gets files[i] */
+int pack_put(rados_ioctx_t ioctx, rados_striper_t striper, char **keys, char **files, int n) {
+	struct pack_writer w;
+	char cookie[128] = "";
+	char *data = NULL;
+	struct stat sb;
+	uint64_t size;
+	time_t mtime;
+	int i, fd, ret, failed = 0;
+
+	if (crypt_key || compression) {
+		debug("packed files are neither compressed nor encrypted\n");
+		return -1;
+	}
+	data = malloc(PACK_MAX_FILE);
+	if (data == NULL)
+		return -1;
+	ret = pack_lock(ioctx, cookie, sizeof(cookie));
+	if (ret < 0) {
+		free(data);
+		return -1;
+	}
+	if (writer_open(&w, ioctx, cookie) < 0) {
+		free(w.buf);
+		pack_unlock(ioctx, cookie);
+		free(data);
+		return -1;
+	}
+
+	for (i = 0; i < n && !quit; i++) {
+		/* a striped object of the same name would hide the packed one */
+		if (rados_striper_stat(striper, keys[i], &size, &mtime) == 0) {
+			debug("%s exists as a striped object, not packed\n", keys[i]);
+			failed++;
+			continue;
+		}
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0 || fstat(fd, &sb) < 0 || sb.st_size <= 0 || sb.st_size > PACK_MAX_FILE ||
+				read_full(fd, data, sb.st_size) != sb.st_size) {
+			debug("can not pack %s: missing, empty or larger than %d bytes\n", files[i], PACK_MAX_FILE);
+			if (fd >= 0)
+				close(fd);
+			failed++;
+			continue;
+		}
+		close(fd);
+		ret = writer_add(&w, keys[i], data, sb.st_size, time(NULL));
+		if (ret < 0) {
+			debug("failed to pack %s errno: %d\n", keys[i], ret);
+			failed++;
+			break;
+		}
+		debug("%s packed\n", keys[i]);
+	}
+	if (writer_close(&w) < 0) {
+		debug("failed to write pack %u\n", w.pack);
+		failed++;
+	}
+	pack_unlock(ioctx, cookie);
+	free(data);
+	return failed || quit ? -1 : 0;
+}
+
+/* "striprados pack -p <pool> <list>": every line is "<key> <filename>" */
+int do_pack(rados_ioctx_t ioctx, rados_striper_t striper, const char *list) {
+	char **keys = NULL, **files = NULL;
+	char *line = NULL, *sep;
+	size_t len = 0;
+	ssize_t r;
+	int n = 0, cap = 0, i, ret;
+	FILE *fp = fopen(list, "r");
+
+	if (fp == NULL) {
+		debug("can not open %s\n", list);
+		return -1;
+	}
+	while ((r = getline(&line, &len, fp)) != -1) {
+		while (r > 0 && (line[r - 1] == '\n' || line[r - 1] == '\r'))
+			line[--r] = '\0';
+		sep = strchr(line, ' ');
+		if (sep == NULL || sep == line || sep[1] == '\0')
+			continue;
+		*sep = '\0';
+		if (n == cap) {
+			cap = cap ? cap * 2 : 256;
+			keys = realloc(keys, cap * sizeof(char *));
+			files = realloc(files, cap * sizeof(char *));
+		}
+		keys[n] = strdup(line);
+		files[n] = strdup(sep + 1);
+		n++;
+	}
+	free(line);
+	fclose(fp);
+	ret = n ? pack_put(ioctx, striper, keys, files, n) : -1;
+	for (i = 0; i < n; i++) {
+		free(keys[i]);
+		free(files[i]);
+	}
+	free(keys);
+	free(files);
+	return ret;
+}
+
+/* drop the index entry, its bytes stay dead in the pack until compaction */
+int pack_remove(rados_ioctx_t ioctx, const char *key) {
+	struct pack_entry e;
+	const char *keys[1] = {key};
+	char cookie[128] = "";
+	rados_write_op_t op;
+	int ret;
+
+	if (pack_lookup(ioctx, key, &e) < 0)
+		return -ENOENT;
+	/* compaction must not put it back */
+	ret = pack_lock(ioctx, cookie, sizeof(cookie));
+	if (ret < 0)
+		return ret;
+	op = rados_create_write_op();
+	rados_write_op_omap_rm_keys(op, keys, 1);
+	ret = rados_write_op_operate(op, ioctx, PACK_INDEX, NULL, 0);
+	rados_release_write_op(op);
+	pack_unlock(ioctx, cookie);
+	return ret;
+}
+
+/* call fn for every index entry, in key order */
+static int pack_scan(rados_ioctx_t ioctx, int (*fn)(const char *key, const struct pack_entry *e, void *arg), void *arg) {
+	char after[4096] = "";
+	rados_read_op_t op;
+	rados_omap_iter_t iter;
+	unsigned char more = 1;
+	struct pack_entry e;
+	char *k, *v;
+	size_t len;
+	int prval = 0, ret = 0;
+
+	while (more && ret == 0 && !quit) {
+		op = rados_create_read_op();
+		rados_read_op_omap_get_vals2(op, after, "", PACK_PAGE, &iter, &more, &prval);
+		ret = rados_read_op_operate(op, ioctx, PACK_INDEX, 0);
+		if (ret == -ENOENT) {
+			/* nothing was ever packed */
+			rados_release_read_op(op);
+			return 0;
+		}
+		if (ret == 0 && prval < 0)
+			ret = prval;
+		if (ret < 0) {
+			rados_release_read_op(op);
+			break;
+		}
+		while (ret == 0 && rados_omap_get_next(iter, &k, &v, &len) == 0 && k != NULL) {
+			snprintf(after, sizeof(after), "%s", k);
+			if (entry_parse(v, len, &e) == 0)
+				ret = fn(k, &e, arg);
+		}
+		rados_omap_get_end(iter);
+		rados_release_read_op(op);
+	}
+	return ret;
+}
+
+static int list_one(const char *key, const struct pack_entry *e, void *arg) {
+	if (!key_selected(key, strlen(key)))
+		return 0;
+	fprintf((FILE *)arg, "%-10s|%-10u\n", key, e->len);
+	return 0;
+}
+
+int pack_list(rados_ioctx_t ioctx, FILE *out) {
+	return pack_scan(ioctx, list_one, out);
+}
+
+struct each_state {
+	int (*fn)(const char *key, uint64_t len, void *arg);
+	void *arg;
+};
+
+static int each_one(const char *key, const struct pack_entry *e, void *arg) {
+	struct each_state *es = (struct each_state *)arg;
+	return es->fn(key, e->len, es->arg);
+}
+
+/* every packed key with its length */
+int pack_each(rados_ioctx_t ioctx, int (*fn)(const char *key, uint64_t len, void *arg), void *arg) {
+	struct each_state es;
+	es.fn = fn;
+	es.arg = arg;
+	return pack_scan(ioctx, each_one, &es);
+}
+
+struct compact_state {
+	uint32_t npacks;
+	uint64_t *live;
+	/* entries of the packs being compacted */
+	char **keys;
+	struct pack_entry *entries;
+	int n;
+	int cap;
+	/* whose lock is kept while the index is scanned */
+	struct pack_writer *w;
+};
+
+static int count_live(const char *key, const struct pack_entry *e, void *arg) {
+	struct compact_state *cs = (struct compact_state *)arg;
+	uint64_t *tmp;
+	uint32_t i;
+	if (writer_keep(cs->w) < 0)
+		return -ETIMEDOUT;
+	if (e->pack >= cs->npacks) {
+		tmp = realloc(cs->live, (e->pack + 1) * sizeof(uint64_t));
+		if (tmp == NULL)
+			return -ENOMEM;
+		for (i = cs->npacks; i <= e->pack; i++)
+			tmp[i] = 0;
+		cs->live = tmp;
+		cs->npacks = e->pack + 1;
+	}
+	cs->live[e->pack] += e->len;
+	return 0;
+}
+
+static int collect_entry(const char *key, const struct pack_entry *e, void *arg) {
+	struct compact_state *cs = (struct compact_state *)arg;
+	if (writer_keep(cs->w) < 0)
+		return -ETIMEDOUT;
+	if (e->pack >= cs->npacks || cs->live[e->pack] != UINT64_MAX)
+		return 0;
+	if (cs->n == cs->cap) {
+		cs->cap = cs->cap ? cs->cap * 2 : 256;
+		cs->keys = realloc(cs->keys, cs->cap * sizeof(char *));
+		cs->entries = realloc(cs->entries, cs->cap * sizeof(struct pack_entry));
+		if (cs->keys == NULL || cs->entries == NULL)
+			return -ENOMEM;
+	}
+	cs->keys[cs->n] = strdup(key);
+	cs->entries[cs->n] = *e;
+	cs->n++;
+	return 0;
+}
+
+/*
+ * "striprados compact -p <pool>": rewrite the packs with at least
+ * PACK_DEAD_PERCENT dead bytes. Writers wait for it, readers of a moved
+ * entry look it up again.
+ */
+int do_compact(rados_ioctx_t ioctx) {
+	struct compact_state cs;
+	struct pack_writer w;
+	char cookie[128] = "", name[64];
+	char *data = NULL;
+	uint64_t size, moved = 0, freed = 0;
+	time_t mtime;
+	uint32_t p, npicked = 0;
+	int i, ret;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.w = &w;
+	ret = pack_lock(ioctx, cookie, sizeof(cookie));
+	if (ret < 0)
+		return -1;
+	ret = writer_open(&w, ioctx, cookie);
+	if (ret == 0)
+		ret = pack_scan(ioctx, count_live, &cs);
+
+	/* pick the packs, marked with a live count of UINT64_MAX */
+	for (p = 0; ret == 0 && p < w.pack; p++) {
+		if ((ret = writer_keep(&w)) < 0)
+			break;
+		pack_name(p, name, sizeof(name));
+		if (rados_stat(ioctx, name, &size, &mtime) < 0)
+			continue;
+		if (p < cs.npacks && (size - cs.live[p]) * 100 < size * PACK_DEAD_PERCENT)
+			continue;
+		output("%s|%" PRIu64 "|%" PRIu64 "\n", name, p < cs.npacks ? cs.live[p] : 0, size - (p < cs.npacks ? cs.live[p] : 0));
+		freed += size;
+		if (p >= cs.npacks) {
+			/* nothing alive in it */
+			rados_remove(ioctx, name);
+			continue;
+		}
+		cs.live[p] = UINT64_MAX;
+		npicked++;
+	}
+	if (ret == 0 && npicked > 0)
+		ret = pack_scan(ioctx, collect_entry, &cs);
+
+	/* copy the live entries over, the index moves with the data */
+	data = malloc(PACK_MAX_FILE);
+	for (i = 0; ret == 0 && i < cs.n && !quit; i++) {
+		if (data == NULL || cs.entries[i].len > PACK_MAX_FILE) {
+			ret = -ENOMEM;
+			break;
+		}
+		pack_name(cs.entries[i].pack, name, sizeof(name));
+		if (rados_read(ioctx, name, data, cs.entries[i].len, cs.entries[i].offset) != (int)cs.entries[i].len ||
+				crc32c(0, data, cs.entries[i].len) != cs.entries[i].crc) {
+			debug("can not move packed %s, left in place\n", cs.keys[i]);
+			cs.live[cs.entries[i].pack] = 0;
+			continue;
+		}
+		ret = writer_add(&w, cs.keys[i], data, cs.entries[i].len, cs.entries[i].mtime);
+		moved += cs.entries[i].len;
+	}
+	if (writer_close(&w) < 0)
+		ret = -1;
+	/* the old packs may only go while nobody else can have picked them */
+	if (ret == 0 && !quit)
+		ret = writer_renew(&w);
+
+	/* only now nothing points into the old packs any more */
+	for (p = 0; ret == 0 && !quit && p < cs.npacks; p++) {
+		if (cs.live[p] != UINT64_MAX || (ret = writer_keep(&w)) < 0)
+			continue;
+		pack_name(p, name, sizeof(name));
+		rados_remove(ioctx, name);
+	}
+	pack_unlock(ioctx, cookie);
+	if (ret == 0)
+		debug("compacted: %" PRIu64 " bytes moved, %" PRIu64 " bytes of packs released\n", moved, freed);
+
+	for (i = 0; i < cs.n; i++)
+		free(cs.keys[i]);
+	free(cs.keys);
+	free(cs.entries);
+	free(cs.live);
+	free(data);
+	return ret < 0 || quit ? -1 : 0;
+}
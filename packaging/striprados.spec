@@ -10,8 +10,14 @@ Source0:	%{name}-%{version}-%{rel}.tar.gz
 BuildRoot:	%(mktemp -ud %{_tmppath}/%{name}-%{version}-%{release}-XXXXXX)
 
 BuildRequires:	ceph-devel
+BuildRequires:	fuse-devel
+BuildRequires:	lz4-devel
+BuildRequires:	openssl-devel
 Requires:	libradosstriper1
 Requires:	librados2
+Requires:	fuse-libs
+Requires:	lz4
+Requires:	openssl-libs
 
 %description
 wrap radosstriper API to upload/download/delete/list rados cluster storage.
@@ -0,0 +1,173 @@
+/*
+ * qos.c
+ *
+ * throttling of uploads, downloads, deletes and the expiry sweep so that
+ * a bulk job does not raise the latency of other clients of the cluster:
+ *
+ *	--limit-bytes <n>[K|M|G]	bytes per second
+ *	--limit-ops <n>			rados ops per second
+ *	--yield-latency <ms>		back off while ops take longer than this
+ *
+ * The limits are token buckets holding at most one second worth of
+ * tokens. qos_wait takes the tokens of an op before it is issued, and
+ * sleeps while the bucket is in debt, so an op larger than the bucket
+ * still goes through and the ones after it pay for it.
+ *
+ * qos_done feeds the latency of finished ops into a moving average. While
+ * the average is above the target every op is delayed by an extra pause
+ * that doubles up to QOS_MAX_YIELD, and halves away once the cluster is
+ * fast again.
+ *
+ * SIGUSR1 halves the limits, SIGUSR2 doubles them; "striprados serve"
+ * also takes "QOS <bytes> <ops> [<ms>]" to set them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "striprados.h"
+
+/* how often the yield pause may change, in seconds */
+#define QOS_ADJUST 0.1
+#define QOS_MIN_YIELD 0.001
+#define QOS_MAX_YIELD 1.0
+
+uint64_t qos_bytes = 0;
+uint64_t qos_ops = 0;
+int qos_latency = 0;
+
+static pthread_mutex_t qos_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double byte_tokens, op_tokens, last_fill;
+static double latency_avg, yield, last_adjust;
+/* set by the signal handler, applied by the next qos_wait */
+static volatile sig_atomic_t slower, faster;
+
+double qos_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int qos_active(void) {
+	return qos_bytes || qos_ops || qos_latency || slower || faster;
+}
+
+void qos_sleep(double seconds) {
+	struct timespec ts;
+	double end = qos_now() + seconds, step;
+	/* in slices, so that an interrupt is not held up; signals may cut one short */
+	while (!quit && (step = end - qos_now()) > 0) {
+		if (step > 0.1)
+			step = 0.1;
+		ts.tv_sec = (time_t)step;
+		ts.tv_nsec = (long)((step - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* a limit of 0 is no limit and stays so */
+static uint64_t scale(uint64_t limit, int halve) {
+	if (limit == 0)
+		return 0;
+	if (halve)
+		return limit > 1 ? limit / 2 : 1;
+	return limit < UINT64_MAX / 2 ? limit * 2 : limit;
+}
+
+/* with qos_mutex held */
+static void apply_signals(void) {
+	while (slower > 0 || faster > 0) {
+		if (slower > 0) {
+			slower--;
+			qos_bytes = scale(qos_bytes, 1);
+			qos_ops = scale(qos_ops, 1);
+		}
+		if (faster > 0) {
+			faster--;
+			qos_bytes = scale(qos_bytes, 0);
+			qos_ops = scale(qos_ops, 0);
+		}
+		debug("qos: %" PRIu64 " bytes/s, %" PRIu64 " ops/s\n", qos_bytes, qos_ops);
+	}
+}
+
+/* take need tokens, the seconds until the debt is paid back */
+static double take(double *tokens, uint64_t rate, double elapsed, double need) {
+	if (rate == 0)
+		return 0;
+	*tokens += rate * elapsed;
+	if (*tokens > rate)
+		*tokens = rate;
+	*tokens -= need;
+	return *tokens < 0 ? -*tokens / rate : 0;
+}
+
+double qos_wait(uint64_t bytes) {
+	double now = qos_now(), elapsed, wait, w;
+
+	if (!qos_active())
+		return now;
+	pthread_mutex_lock(&qos_mutex);
+	apply_signals();
+	elapsed = last_fill ? now - last_fill : 0;
+	last_fill = now;
+	wait = take(&byte_tokens, qos_bytes, elapsed, bytes);
+	w = take(&op_tokens, qos_ops, elapsed, 1);
+	if (w > wait)
+		wait = w;
+	wait += yield;
+	pthread_mutex_unlock(&qos_mutex);
+
+	qos_sleep(wait);
+	return qos_now();
+}
+
+void qos_done(double start) {
+	double now, latency;
+
+	if (qos_latency == 0)
+		return;
+	now = qos_now();
+	latency = now - start;
+	pthread_mutex_lock(&qos_mutex);
+	latency_avg = latency_avg ? latency_avg * 0.8 + latency * 0.2 : latency;
+	if (now - last_adjust >= QOS_ADJUST) {
+		last_adjust = now;
+		if (latency_avg * 1000 > qos_latency) {
+			if (yield == 0)
+				debug("qos: ops take %.0f ms, yielding\n", latency_avg * 1000);
+			yield = yield ? yield * 2 : QOS_MIN_YIELD;
+			if (yield > QOS_MAX_YIELD)
+				yield = QOS_MAX_YIELD;
+		} else if (yield > 0) {
+			yield /= 2;
+			if (yield < QOS_MIN_YIELD)
+				yield = 0;
+		}
+	}
+	pthread_mutex_unlock(&qos_mutex);
+}
+
+void qos_set(uint64_t bytes, uint64_t ops, int latency) {
+	pthread_mutex_lock(&qos_mutex);
+	qos_bytes = bytes;
+	qos_ops = ops;
+	qos_latency = latency;
+	/* the buckets start over under the new limits */
+	byte_tokens = op_tokens = 0;
+	if (latency == 0)
+		yield = 0;
+	pthread_mutex_unlock(&qos_mutex);
+	debug("qos: %" PRIu64 " bytes/s, %" PRIu64 " ops/s, latency target %d ms\n", bytes, ops, latency);
+}
+
+void qos_signal(int sig) {
+	if (sig == SIGUSR1)
+		slower++;
+	else
+		faster++;
+}
@@ -0,0 +1,282 @@
+/*
+ * reactor.c
+ *
+ * one engine for requests made of rados aio ops, instead of a thread
+ * per request sleeping in rados_aio_wait_for_complete.
+ *
+ * A request is a state machine: each step issues the ops of its state
+ * and returns. The librados callback of the last of those ops puts the
+ * request on the ready queue, and one of a fixed set of worker threads
+ * runs its next step. reactor_submit admits at most max_requests
+ * requests and max_bytes of their buffers at once, and blocks the
+ * submitter beyond that, so a long list is fed in at the pace the
+ * cluster takes it. A group puts a lower limit on the requests of one
+ * caller.
+ *
+ * reactor_shared is the reactor of the whole process: the removes of a
+ * list, the stats of meta batches and the reads of downloads all go
+ * through it, so together they stay within one set of limits. A read of
+ * get_fd is started with reactor_start, which issues it right away on
+ * the calling thread once admitted; the caller waits for its completion
+ * and the request only ends when the read is done.
+ *
+ * reactor_run drives the same steps on the calling thread for a single
+ * request.
+ *
+ * serve.c keeps its threadpool: a connection blocks on its socket, not
+ * on rados ops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "reactor.h"
+#include "striprados.h"
+
+#define SHARED_THREADS 8
+#define SHARED_REQUESTS 256
+/* four downloads with a full window */
+#define SHARED_BYTES (4ULL * 4 * BUFFSIZE)
+
+struct reactor {
+	pthread_mutex_t mutex;
+	/* a request is ready, or the reactor stops */
+	pthread_cond_t ready;
+	/* a request is done */
+	pthread_cond_t idle;
+	struct reactor_req *head, *tail;
+	int active, max_requests, stopping;
+	uint64_t bytes, max_bytes;
+	pthread_t *threads;
+	int nthreads;
+};
+
+/* the caller of reactor_run waits on it */
+struct reactor_wait {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int ready;
+};
+
+static void req_ready(struct reactor_req *q) {
+	struct reactor *r = q->r;
+	struct reactor_wait *w = q->wait;
+
+	if (r == NULL) {
+		pthread_mutex_lock(&w->mutex);
+		w->ready = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+		return;
+	}
+	pthread_mutex_lock(&r->mutex);
+	q->next = NULL;
+	if (r->tail != NULL)
+		r->tail->next = q;
+	else
+		r->head = q;
+	r->tail = q;
+	pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void req_complete(rados_completion_t c, void *arg) {
+	struct reactor_req *q = (struct reactor_req *)arg;
+	if (q->notify != NULL)
+		q->notify(c, q->notify_arg);
+	if (__sync_sub_and_fetch(&q->pending, 1) == 0)
+		req_ready(q);
+}
+
+rados_completion_t reactor_completion(struct reactor_req *q) {
+	rados_completion_t c;
+	if (rados_aio_create_completion(q, req_complete, NULL, &c) < 0)
+		return NULL;
+	__sync_add_and_fetch(&q->pending, 1);
+	return c;
+}
+
+void reactor_unused(struct reactor_req *q, rados_completion_t c) {
+	rados_aio_release(c);
+	__sync_sub_and_fetch(&q->pending, 1);
+}
+
+/* one step, 1 when the request is done */
+static int req_step_once(struct reactor_req *q) {
+	q->pending = 1;
+	if (q->step(q) == REQ_DONE)
+		return 1;
+	if (__sync_sub_and_fetch(&q->pending, 1) == 0)
+		req_ready(q);
+	return 0;
+}
+
+/* the limits q held go back, q may be gone already; r->mutex held */
+static void req_retire(struct reactor *r, struct reactor_group *g, uint64_t bytes) {
+	r->active--;
+	r->bytes -= bytes;
+	if (g != NULL)
+		g->active--;
+	pthread_cond_broadcast(&r->idle);
+}
+
+static void req_finish(struct reactor *r, struct reactor_req *q) {
+	struct reactor_group *g = q->group;
+	uint64_t bytes = q->bytes;
+
+	q->done(q);
+	pthread_mutex_lock(&r->mutex);
+	req_retire(r, g, bytes);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void *reactor_worker(void *arg) {
+	struct reactor *r = (struct reactor *)arg;
+	struct reactor_req *q;
+
+	pthread_mutex_lock(&r->mutex);
+	for (;;) {
+		while (r->head == NULL && !r->stopping)
+			pthread_cond_wait(&r->ready, &r->mutex);
+		if (r->head == NULL)
+			break;
+		q = r->head;
+		r->head = q->next;
+		if (r->head == NULL)
+			r->tail = NULL;
+		pthread_mutex_unlock(&r->mutex);
+
+		if (req_step_once(q))
+			req_finish(r, q);
+		pthread_mutex_lock(&r->mutex);
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return NULL;
+}
+
+struct reactor *reactor_new(int threads, int max_requests, uint64_t max_bytes) {
+	struct reactor *r = calloc(1, sizeof(struct reactor));
+	int i;
+
+	if (r == NULL)
+		return NULL;
+	r->threads = calloc(threads, sizeof(pthread_t));
+	if (r->threads == NULL) {
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->ready, NULL);
+	pthread_cond_init(&r->idle, NULL);
+	r->max_requests = max_requests;
+	r->max_bytes = max_bytes;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&r->threads[i], NULL, reactor_worker, r) != 0)
+			break;
+		r->nthreads++;
+	}
+	if (r->nthreads == 0) {
+		reactor_free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void reactor_group_init(struct reactor_group *g, int max_requests) {
+	g->active = 0;
+	g->max_requests = max_requests;
+}
+
+/* a request larger than the whole budget still gets in alone */
+static void req_admit(struct reactor *r, struct reactor_group *g, struct reactor_req *q) {
+	pthread_mutex_lock(&r->mutex);
+	while (r->active >= r->max_requests || (g != NULL && g->active >= g->max_requests) ||
+			(r->bytes > 0 && r->bytes + q->bytes > r->max_bytes))
+		pthread_cond_wait(&r->idle, &r->mutex);
+	r->active++;
+	r->bytes += q->bytes;
+	if (g != NULL)
+		g->active++;
+	pthread_mutex_unlock(&r->mutex);
+	q->r = r;
+	q->group = g;
+	q->wait = NULL;
+}
+
+void reactor_submit(struct reactor *r, struct reactor_group *g, struct reactor_req *q) {
+	req_admit(r, g, q);
+	req_ready(q);
+}
+
+void reactor_start(struct reactor *r, struct reactor_group *g, struct reactor_req *q) {
+	req_admit(r, g, q);
+	if (req_step_once(q))
+		req_finish(r, q);
+}
+
+void reactor_drain(struct reactor *r, struct reactor_group *g) {
+	pthread_mutex_lock(&r->mutex);
+	while (g != NULL ? g->active > 0 : r->active > 0)
+		pthread_cond_wait(&r->idle, &r->mutex);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void reactor_free(struct reactor *r) {
+	int i;
+
+	reactor_drain(r, NULL);
+	pthread_mutex_lock(&r->mutex);
+	r->stopping = 1;
+	pthread_cond_broadcast(&r->ready);
+	pthread_mutex_unlock(&r->mutex);
+	for (i = 0; i < r->nthreads; i++)
+		pthread_join(r->threads[i], NULL);
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->ready);
+	pthread_cond_destroy(&r->idle);
+	free(r->threads);
+	free(r);
+}
+
+void reactor_run(struct reactor_req *q) {
+	struct reactor_wait w;
+
+	pthread_mutex_init(&w.mutex, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	q->r = NULL;
+	q->group = NULL;
+	q->wait = &w;
+	for (;;) {
+		w.ready = 0;
+		if (req_step_once(q))
+			break;
+		pthread_mutex_lock(&w.mutex);
+		while (!w.ready)
+			pthread_cond_wait(&w.cond, &w.mutex);
+		pthread_mutex_unlock(&w.mutex);
+	}
+	pthread_mutex_destroy(&w.mutex);
+	pthread_cond_destroy(&w.cond);
+	q->done(q);
+}
+
+static struct reactor *shared;
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+
+static void shared_init(void) {
+	shared = reactor_new(SHARED_THREADS, SHARED_REQUESTS, SHARED_BYTES);
+	if (shared == NULL)
+		debug("can not start the reactor\n");
+}
+
+struct reactor *reactor_shared(void) {
+	pthread_once(&shared_once, shared_init);
+	return shared;
+}
+
+void reactor_shutdown(void) {
+	if (shared != NULL)
+		reactor_free(shared);
+	shared = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * reactor.h
+ *
+ * requests that move through their states as their rados aio ops
+ * complete, see reactor.c
+ */
+
+#ifndef __reactor_h__
+#define __reactor_h__
+
+#include <stdint.h>
+#include <rados/librados.h>
+
+/* what a step returns */
+#define REQ_MORE 0
+#define REQ_DONE 1
+
+struct reactor;
+struct reactor_wait;
+struct reactor_req;
+
+/* the requests of one caller, with a limit of their own within the reactor */
+struct reactor_group {
+	int active;
+	int max_requests;
+};
+
+/*
+ * one state of the request: read the results of the ops of the last
+ * step, do the local work and issue the next ops with completions from
+ * reactor_completion. REQ_MORE calls it again once they are all done,
+ * right away when it issued none; REQ_DONE only with none in flight.
+ */
+typedef int (*req_step)(struct reactor_req *q);
+/* after the last step, may free the request */
+typedef void (*req_done)(struct reactor_req *q);
+
+struct reactor_req {
+	req_step step;
+	req_done done;
+	int state;
+	int ret;
+	/* ops in flight, plus one held while a step runs */
+	int pending;
+	/* of the memory budget, held until the request is done */
+	uint64_t bytes;
+	/* called first by every completion of the request when set */
+	rados_callback_t notify;
+	void *notify_arg;
+	struct reactor *r;
+	struct reactor_group *group;
+	struct reactor_wait *wait;
+	struct reactor_req *next;
+};
+
+struct reactor *reactor_new(int threads, int max_requests, uint64_t max_bytes);
+/* blocks while max_requests are in flight, or the bytes of q do not fit, or g is full */
+void reactor_submit(struct reactor *r, struct reactor_group *g, struct reactor_req *q);
+/* admitted the same way, but the first step runs on the calling thread */
+void reactor_start(struct reactor *r, struct reactor_group *g, struct reactor_req *q);
+/* until every request of g submitted so far is done, every request with NULL */
+void reactor_drain(struct reactor *r, struct reactor_group *g);
+void reactor_free(struct reactor *r);
+void reactor_group_init(struct reactor_group *g, int max_requests);
+
+/* the one reactor of the process, NULL when it can not be started */
+struct reactor *reactor_shared(void);
+/* waits for its requests and stops it, before rados goes away */
+void reactor_shutdown(void);
+
+/* the steps of q on the calling thread, without a reactor */
+void reactor_run(struct reactor_req *q);
+
+/* a completion that counts for q, NULL when it can not be created */
+rados_completion_t reactor_completion(struct reactor_req *q);
+/* for a completion whose op could not be issued */
+void reactor_unused(struct reactor_req *q, rados_completion_t c);
+
+#endif
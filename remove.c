@@ -0,0 +1,249 @@
+/*
+ * remove.c
+ *
+ * removal of a striped object in parallel. rados_striper_remove deletes
+ * the rados objects behind a key one after another, which takes long for
+ * the thousands of objects of a huge key.
+ *
+ * The size and layout come from the head object (meta.c). Under the
+ * exclusive "striper.lock" that libradosstriper takes for a remove, the
+ * tail objects are removed REMOVE_WINDOW aio removes at a time and the
+ * head object last. Until then the head still describes the whole
+ * object, so a remove cut short leaves a key that can be removed again:
+ * the tail objects already gone are skipped. A lock left behind by a
+ * crash is broken with -f, see try_break_lock.
+ *
+ * A remove is a request of reactor.c: fast_remove runs one on the calling
+ * thread, remove_submit hands one to a reactor that runs many at once.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "striprados.h"
+#include "reactor.h"
+
+#define REMOVE_WINDOW 64
+#define REMOVE_LOCK "striper.lock"
+
+enum remove_state {
+	RM_STAT,
+	RM_LOCK,
+	RM_TAILS,
+	RM_HEAD,
+};
+
+struct remove_slot {
+	rados_completion_t completion;
+	uint64_t objno;
+	double issued;
+};
+
+struct remove_req {
+	struct reactor_req req;
+	rados_ioctx_t ioctx;
+	char *key;
+	/* the name of the object at hand */
+	char *name;
+	char cookie[64];
+	struct meta_slot *meta;
+	struct object_meta m;
+	struct remove_slot slots[REMOVE_WINDOW];
+	int nslots;
+	rados_completion_t head;
+	uint64_t objno, nobjs;
+	remove_done finish;
+	void *arg;
+};
+
+static void head_name(struct remove_req *q) {
+	sprintf(q->name, "%s.%016d", q->key, 0);
+}
+
+/* the first error other than a missing object among the last window */
+static int remove_reap(struct remove_req *q) {
+	struct remove_slot *s;
+	int i, ret, failed = 0;
+	for (i = 0; i < q->nslots; i++) {
+		s = &q->slots[i];
+		ret = rados_aio_get_return_value(s->completion);
+		rados_aio_release(s->completion);
+		qos_done(s->issued);
+		if (ret < 0 && ret != -ENOENT) {
+			debug("failed to remove object %" PRIu64 " of %s errno: %d\n", s->objno, q->key, ret);
+			if (failed == 0)
+				failed = ret;
+		}
+	}
+	q->nslots = 0;
+	return failed;
+}
+
+static int remove_tails(struct remove_req *q) {
+	struct remove_slot *s;
+	for (; q->objno < q->nobjs && q->nslots < REMOVE_WINDOW; q->objno++) {
+		s = &q->slots[q->nslots];
+		s->completion = reactor_completion(&q->req);
+		if (s->completion == NULL)
+			return -ENOMEM;
+		s->objno = q->objno;
+		s->issued = qos_wait(0);
+		sprintf(q->name, "%s.%016" PRIx64, q->key, q->objno);
+		if (rados_aio_remove(q->ioctx, q->name, s->completion) < 0) {
+			reactor_unused(&q->req, s->completion);
+			return -EIO;
+		}
+		q->nslots++;
+	}
+	return 0;
+}
+
+static int remove_step(struct reactor_req *r) {
+	struct remove_req *q = (struct remove_req *)r;
+	rados_completion_t c;
+	uint64_t set;
+	int ret;
+
+	switch (q->req.state) {
+	case RM_STAT:
+		c = reactor_completion(r);
+		if (c == NULL) {
+			r->ret = -ENOMEM;
+			return REQ_DONE;
+		}
+		q->meta = meta_op_start(q->ioctx, q->key, c);
+		if (q->meta == NULL) {
+			reactor_unused(r, c);
+			r->ret = -EIO;
+			return REQ_DONE;
+		}
+		r->state = RM_LOCK;
+		return REQ_MORE;
+	case RM_LOCK:
+		/* -ENOENT when key is not striped */
+		r->ret = meta_op_end(q->meta, &q->m);
+		q->meta = NULL;
+		if (r->ret < 0)
+			return REQ_DONE;
+		if (!layout_valid(&q->m.layout)) {
+			r->ret = -EINVAL;
+			return REQ_DONE;
+		}
+		/* librados has no aio lock, it is one round trip */
+		head_name(q);
+		r->ret = rados_lock_exclusive(q->ioctx, q->name, REMOVE_LOCK, q->cookie, "", NULL, 0);
+		if (r->ret < 0)
+			return REQ_DONE;
+		/* every object of the object sets the size reaches into, missing ones are skipped */
+		set = (uint64_t)q->m.layout.object_size * q->m.layout.stripe_count;
+		q->nobjs = (q->m.size + set - 1) / set * q->m.layout.stripe_count;
+		q->objno = 1;
+		r->state = RM_TAILS;
+		/* fall through */
+	case RM_TAILS:
+		ret = remove_reap(q);
+		if (ret == 0 && !quit && q->objno < q->nobjs) {
+			ret = remove_tails(q);
+			if (ret == 0)
+				return REQ_MORE;
+			/* the ones issued go first */
+			r->ret = ret;
+			r->state = RM_HEAD;
+			return REQ_MORE;
+		}
+		if (ret < 0 || quit) {
+			r->ret = ret < 0 ? ret : -EINTR;
+			break;
+		}
+		/* the lock goes with the head object */
+		c = reactor_completion(r);
+		if (c == NULL) {
+			r->ret = -ENOMEM;
+			break;
+		}
+		head_name(q);
+		if (rados_aio_remove(q->ioctx, q->name, c) < 0) {
+			reactor_unused(r, c);
+			r->ret = -EIO;
+			break;
+		}
+		q->head = c;
+		r->state = RM_HEAD;
+		return REQ_MORE;
+	case RM_HEAD:
+		if (q->head != NULL) {
+			r->ret = rados_aio_get_return_value(q->head);
+			rados_aio_release(q->head);
+			return REQ_DONE;
+		}
+		/* failed halfway through the tails, still locked */
+		remove_reap(q);
+		break;
+	}
+	/* the head keeps the object removable */
+	head_name(q);
+	rados_unlock(q->ioctx, q->name, REMOVE_LOCK, q->cookie);
+	return REQ_DONE;
+}
+
+static int remove_init(struct remove_req *q, rados_ioctx_t ioctx, const char *key) {
+	memset(q, 0, sizeof(*q));
+	q->req.step = remove_step;
+	q->req.state = RM_STAT;
+	q->ioctx = ioctx;
+	q->key = strdup(key);
+	q->name = malloc(strlen(key) + 17 + 1);
+	if (q->key == NULL || q->name == NULL) {
+		free(q->key);
+		free(q->name);
+		return -ENOMEM;
+	}
+	snprintf(q->cookie, sizeof(q->cookie), "striprados.%d.%lx", (int)getpid(), (unsigned long)q);
+	return 0;
+}
+
+static void remove_fini(struct remove_req *q) {
+	free(q->key);
+	free(q->name);
+}
+
+static void remove_nothing(struct reactor_req *r) {
+}
+
+/* 0, -ENOENT when key is not striped, -EBUSY when it is locked */
+int fast_remove(rados_ioctx_t ioctx, const char *key) {
+	struct remove_req q;
+	int ret;
+
+	ret = remove_init(&q, ioctx, key);
+	if (ret < 0)
+		return ret;
+	q.req.done = remove_nothing;
+	reactor_run(&q.req);
+	ret = q.req.ret;
+	remove_fini(&q);
+	return ret;
+}
+
+static void remove_finish(struct reactor_req *r) {
+	struct remove_req *q = (struct remove_req *)r;
+	q->finish(q->arg, q->key, r->ret);
+	remove_fini(q);
+	free(q);
+}
+
+int remove_submit(struct reactor *r, struct reactor_group *g, rados_ioctx_t ioctx, const char *key, remove_done done, void *arg) {
+	struct remove_req *q = malloc(sizeof(struct remove_req));
+	if (q == NULL || remove_init(q, ioctx, key) < 0) {
+		free(q);
+		return -ENOMEM;
+	}
+	q->req.done = remove_finish;
+	q->finish = done;
+	q->arg = arg;
+	reactor_submit(r, g, &q->req);
+	return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * serve.c
+ *
+ * "striprados serve": keep the cluster connection and the striper open
+ * and answer requests on a local unix socket, so that callers do not pay
+ * for rados_connect on every upload or download.
+ *
+ * Every request is one text line, optionally followed by a payload:
+ *
+ *	PUT <key> <size>\n<size bytes>
+ *	GET <key>\n
+ *	INFO <key>\n
+ *	DELETE <key>\n
+ *	LIST\n
+ *	QOS <bytes/s> <ops/s> [<latency ms>]\n
+ *	QUIT\n
+ *
+ * and every answer is either "OK <size>\n<size bytes>" or
+ * "ERR <errno> <message>\n". A connection may carry any number of
+ * requests, connections are served concurrently by a threadpool.
+ * If a GET fails after its header went out the connection is closed.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "threadpool.h"
+#include "striprados.h"
+
+#define SERVE_SOCKET "/var/run/striprados.sock"
+#define SERVE_THREADS 64
+#define SERVE_LINE_MAX 4096
+/* idle connections are dropped so that shutdown does not wait forever */
+#define SERVE_IDLE_TIMEOUT 60
+
+typedef struct {
+	int fd;
+	rados_ioctx_t ioctx;
+	rados_striper_t striper;
+}serve_args,*serve_args_t;
+
+/*
+ * read one request line. The payload of a PUT follows the line directly,
+ * so read byte by byte and never consume past the newline.
+ */
+static int read_line(int fd, char *line, size_t len) {
+	size_t n = 0;
+	ssize_t r;
+	while (n < len - 1) {
+		r = read(fd, line + n, 1);
+		if (r < 0 && errno == EINTR && !quit)
+			continue;
+		if (r <= 0)
+			return -1;
+		if (line[n] == '\n') {
+			if (n > 0 && line[n - 1] == '\r')
+				n--;
+			line[n] = '\0';
+			return n;
+		}
+		n++;
+	}
+	/* line too long */
+	return -1;
+}
+
+/* a NULL payload sends the header only, the caller streams the data */
+static int send_ok(int fd, const char *payload, size_t len) {
+	char header[64];
+	int n = snprintf(header, sizeof(header), "OK %zu\n", len);
+	if (write_full(fd, header, n) < 0)
+		return -1;
+	if (payload != NULL && len > 0 && write_full(fd, payload, len) < 0)
+		return -1;
+	return 0;
+}
+
+static int send_err(int fd, int err, const char *msg) {
+	char header[SERVE_LINE_MAX];
+	int n = snprintf(header, sizeof(header), "ERR %d %s\n", err, msg);
+	return write_full(fd, header, n) < 0 ? -1 : 0;
+}
+
+/* run a listing/info function into memory and send it as one payload */
+static int send_report(int fd, rados_ioctx_t ioctx, rados_striper_t striper, const char *key) {
+	char *report = NULL;
+	size_t len = 0;
+	int ret;
+	FILE *out = open_memstream(&report, &len);
+	if (out == NULL)
+		return send_err(fd, ENOMEM, "out of memory");
+	if (key == NULL)
+		ret = do_ls(ioctx, out);
+	else
+		ret = do_info(ioctx, striper, key, out);
+	fclose(out);
+	if (ret < 0)
+		ret = send_err(fd, ENOENT, key ? "no such object" : "list failed");
+	else
+		ret = send_ok(fd, report, len);
+	free(report);
+	return ret;
+}
+
+/* a key that is not striped may be packed, small enough for one payload */
+static int send_packed(int fd, rados_ioctx_t ioctx, const char *key) {
+	char *data;
+	uint32_t len;
+	int ret;
+	if (pack_read(ioctx, key, &data, &len, NULL) < 0)
+		return send_err(fd, ENOENT, "no remote file or the file is not striped");
+	ret = send_ok(fd, data, len);
+	free(data);
+	return ret;
+}
+
+/* returns < 0 when the connection has to be closed */
+static int serve_request(serve_args_t args, char *line) {
+	char *verb, *key, *arg, *ms, *save = NULL;
+	rados_striper_t striper;
+	uint64_t size, ops;
+	int fd = args->fd, ret, own_striper;
+
+	verb = strtok_r(line, " \t", &save);
+	key = strtok_r(NULL, " \t", &save);
+	arg = strtok_r(NULL, " \t", &save);
+	if (verb == NULL)
+		return 0;
+
+	if (strcmp(verb, "QUIT") == 0)
+		return -1;
+
+	if (strcmp(verb, "LIST") == 0)
+		return send_report(fd, args->ioctx, args->striper, NULL);
+
+	/* the limits of qos.c for every connection, 0 is no limit */
+	if (strcmp(verb, "QOS") == 0) {
+		ms = strtok_r(NULL, " \t", &save);
+		if (key == NULL || arg == NULL || parse_size(key, &size) < 0 || size == UINT64_MAX ||
+				sscanf(arg, "%" SCNu64, &ops) != 1)
+			return send_err(fd, EINVAL, "expected QOS <bytes/s> <ops/s> [<latency ms>]");
+		qos_set(size, ops, ms != NULL ? atoi(ms) : qos_latency);
+		return send_ok(fd, NULL, 0);
+	}
+
+	if (key == NULL)
+		return send_err(fd, EINVAL, "missing key");
+
+	if (strcmp(verb, "PUT") == 0) {
+		if (arg == NULL || sscanf(arg, "%" SCNu64, &size) != 1 || size == 0)
+			return send_err(fd, EINVAL, "missing size");
+		striper = args->striper;
+		own_striper = layout_striper(args->ioctx, size, &striper);
+		ret = own_striper < 0 ? -1 : put_fd(striper, key, fd, size, upload_concurrency, 0);
+		if (own_striper > 0)
+			rados_striper_destroy(striper);
+		if (ret < 0) {
+			/* we can not tell how much of the payload is left in the socket */
+			send_err(fd, EIO, "upload failed");
+			return -1;
+		}
+		debug("%s uploaded %" PRIu64 " bytes\n", key, size);
+		return send_ok(fd, NULL, 0);
+	}
+
+	if (strcmp(verb, "GET") == 0) {
+		if (striper_size(args->ioctx, key, &size) < 0)
+			return send_packed(fd, args->ioctx, key);
+		if (send_ok(fd, NULL, size) < 0)
+			return -1;
+		if (get_fd(args->ioctx, args->striper, key, fd, size) < 0)
+			return -1;
+		return 0;
+	}
+
+	if (strcmp(verb, "INFO") == 0)
+		return send_report(fd, args->ioctx, args->striper, key);
+
+	if (strcmp(verb, "DELETE") == 0) {
+		if (striprados_remove(args->ioctx, args->striper, key) < 0)
+			return send_err(fd, EIO, "delete failed");
+		return send_ok(fd, NULL, 0);
+	}
+
+	return send_err(fd, EINVAL, "unknown request");
+}
+
+static void serve_conn(void *arg) {
+	serve_args_t args = (serve_args_t)arg;
+	char line[SERVE_LINE_MAX];
+
+	while (!quit && read_line(args->fd, line, sizeof(line)) >= 0) {
+		if (serve_request(args, line) < 0)
+			break;
+	}
+	close(args->fd);
+	free(args);
+}
+
+int do_serve(rados_ioctx_t ioctx, rados_striper_t striper, const char *sock_path) {
+	struct sockaddr_un addr;
+	struct timeval idle = {SERVE_IDLE_TIMEOUT, 0};
+	serve_args_t args;
+	threadpool tp;
+	int lfd, fd;
+
+	if (sock_path == NULL)
+		sock_path = SERVE_SOCKET;
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+		debug("socket path %s is too long\n", sock_path);
+		return -1;
+	}
+
+	/* a client going away must not kill the daemon */
+	signal(SIGPIPE, SIG_IGN);
+	progress = 0;
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		debug("can not create socket errno: %d\n", errno);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+	unlink(sock_path);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0) {
+		debug("can not listen on %s errno: %d\n", sock_path, errno);
+		close(lfd);
+		return -1;
+	}
+
+	tp = create_threadpool(SERVE_THREADS);
+	if (tp == NULL) {
+		close(lfd);
+		unlink(sock_path);
+		return -1;
+	}
+	debug("serving on %s\n", sock_path);
+
+	while (!quit) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			debug("accept failed errno: %d\n", errno);
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+		args = (serve_args_t)malloc(sizeof(serve_args));
+		if (args == NULL) {
+			close(fd);
+			continue;
+		}
+		args->fd = fd;
+		args->ioctx = ioctx;
+		args->striper = striper;
+		/* it blocks when all SERVE_THREADS connections are busy */
+		dispatch_threadpool(tp, serve_conn, (void *)args);
+	}
+
+	close(lfd);
+	unlink(sock_path);
+	destroy_threadpool(tp);
+	debug("server stopped\n");
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * sparse.c
+ *
+ * zero block detection for sparse transfers. Uploads skip STRIPEUNIT
+ * blocks that are all zero when the object is new (missing objects read
+ * back as zeros), downloads seek over them so the local file gets holes.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#include "striprados.h"
+
+/* SSE2 is part of x86_64, 64 bytes per step and out at the first non zero */
+int buffer_is_zero(const char *buf, size_t len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	uint64_t v;
+
+	while (len > 0 && ((uintptr_t)p & 15)) {
+		if (*p++)
+			return 0;
+		len--;
+	}
+#if defined(__x86_64__)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i acc;
+		while (len >= 64) {
+			acc = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i *)p), _mm_load_si128((const __m128i *)(p + 16))),
+					_mm_or_si128(_mm_load_si128((const __m128i *)(p + 32)), _mm_load_si128((const __m128i *)(p + 48))));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+				return 0;
+			p += 64;
+			len -= 64;
+		}
+	}
+#endif
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		if (v)
+			return 0;
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		if (*p++)
+			return 0;
+		len--;
+	}
+	return 1;
+}
+
+/* can holes be made in fd: a regular file we can seek in */
+int fd_can_hole(int fd) {
+	struct stat st;
+	return sparse && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+/*
+ * is [offset, offset + len) of fd a hole, without reading it. Old kernels
+ * and file systems without SEEK_DATA report everything as data.
+ */
+int range_is_hole(int fd, uint64_t offset, uint64_t len) {
+	off_t data = lseek(fd, offset, SEEK_DATA);
+	int hole = (data < 0 && errno == ENXIO) || (data >= 0 && (uint64_t)data >= offset + len);
+	lseek(fd, offset, SEEK_SET);
+	return hole;
+}
+
+/* write len bytes to fd, seeking over the zero STRIPEUNIT blocks */
+ssize_t write_sparse(int fd, const char *buf, size_t len) {
+	size_t done, n;
+	for (done = 0; done < len; done += n) {
+		n = len - done < STRIPEUNIT ? len - done : STRIPEUNIT;
+		if (buffer_is_zero(buf + done, n)) {
+			if (lseek(fd, n, SEEK_CUR) < 0)
+				return -1;
+		} else if (write_full(fd, buf + done, n) < 0) {
+			return -1;
+		}
+	}
+	return len;
+}
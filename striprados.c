@@ -31,45 +31,53 @@
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
-#include "threadpool.h"
-#include "list.h"
-
-#define debug(f, arg...) fprintf(stderr, f, ## arg)
-#define output(f, arg...) fprintf(stdout, f, ## arg)
+#include "reactor.h"
+#include "crc32c.h"
+#include "striprados.h"
 
 void usage() {
 	debug("Usage:\n"
 			"UPLOAD FILE\n"
-			"striprados -p <poolname> -u <key> <filename>\n"
+			"striprados -p <poolname> -u <key> <filename> [-D] [-U] [-z] [--no-sparse] [--key-file <file>] [--pack] [--layout <file>]\n"
+			"UPLOAD A GROWING FILE UNTIL ITS WRITER CLOSES IT\n"
+			"striprados -p <poolname> -u <key> <filename> --follow [--follow-timeout <seconds>]\n"
 			"DOWNLOAD FILE\n"
-			"striprados -p <poolname> -g <key> <filename>\n"
+			"striprados -p <poolname> -g <key> <filename> [-C <cachedir>] [-Z <cachesize>] [--no-sparse] [--key-file <file>] [--read-deadline <ms>]\n"
 			"DELETE SINGLE FILE\n"
 			"striprados -p <poolname> -r <key> [-f]\n"
 			"DELETE MULTIPLE FILES\n"
 			"striprados -p <poolname> -d <file-contains-keys> [-f]\n"
+			"INFO OF A FILE, OR OF EVERY KEY READ FROM A FILE (@<file>) OR STDIN (-)\n"
+			"striprados -p <poolname> -i <key>|@<file>|-\n"
 			"LIST ALL FILES\n"
-			"striprados -p <poolname> -l\n"
+			"striprados -p <poolname> -l [--prefix <prefix>] [--match <regex>]\n"
 			"ERASE OLD VER FILES SINCE DAYS GOES\n"
-			"striprados -p <poolname> -e <days> [-f] [-m]\n");
+			"striprados -p <poolname> -e <days> [-f] [-m] [--prefix <prefix>] [--match <regex>]\n"
+			"SERVE REQUESTS ON A UNIX SOCKET\n"
+			"striprados serve -p <poolname> [-s <socket>]\n"
+			"SERVE BYTE RANGES OVER HTTP (GET /<poolname>/<key>)\n"
+			"striprados http [-s <address:port>]\n"
+			"MOUNT A POOL READ ONLY (BLOCK CACHE IN MB, DEFAULT 256)\n"
+			"striprados mount -p <poolname> [-c <cachesize>] <mountpoint>\n"
+			"PACK SMALL FILES, EVERY LINE OF THE LIST IS \"<key> <filename>\"\n"
+			"striprados pack -p <poolname> <list>\n"
+			"REWRITE PACKS THAT ARE MOSTLY DELETED FILES\n"
+			"striprados compact -p <poolname>\n"
+			"MEASURE LAYOUTS FOR A SIZE DISTRIBUTION, WRITE THE BEST AS A --layout FILE\n"
+			"striprados tune -p <poolname> <config> [<size>:<count>,...]\n"
+			"COPY BETWEEN POOLS OR KEYS WITHOUT LOCAL STAGING, OR EVERY \"<src> <dst>\" LINE OF A LIST\n"
+			"striprados cp <srcpool>/<key> <dstpool>/<key>\n"
+			"striprados cp <list>\n"
+			"COMPARE OBJECTS WITH LOCAL FILES, EVERY LINE OF THE LIST IS \"<key> <filename>\"\n"
+			"striprados verify -p <poolname> <key> <filename>\n"
+			"striprados verify -p <poolname> <list>\n"
+			"OBJECTS AND BYTES PER KEY PREFIX\n"
+			"striprados du -p <poolname> [--depth <n>] [--delimiter <string>] [--prefix <prefix>] [--match <regex>]\n"
+			"THROTTLE UPLOADS, DOWNLOADS AND DELETES (SIGUSR1 HALVES THE LIMITS, SIGUSR2 DOUBLES THEM)\n"
+			"striprados ... [--limit-bytes <bytes/s>] [--limit-ops <ops/s>] [--yield-latency <ms>]\n");
 	output("fail\n");
 	
 }
-typedef struct {
-	struct list_head job_list;
-	pthread_mutex_t job_mutex;
-	int count;
-}remove_list,*remove_list_t;
-
-typedef struct{
-	struct list_head list;
-	char *oid;
-}remove_node,*remove_node_t;
-
-typedef struct{
-	rados_ioctx_t io_ctx;
-	rados_striper_t striper;
-}rm_args,*rm_args_t;
-
 enum act {
  NOOPS = -1,
  DONWLOAD,
@@ -77,20 +85,91 @@ enum act {
  LIST ,
  DELETE,
  INFO,
- CLEAR
+ CLEAR,
+ SERVE,
+ HTTP,
+ MOUNT,
+ PACK,
+ COMPACT,
+ TUNE,
+ COPY,
+ VERIFY,
+ DU
 };
 
+/* options without a letter of their own */
+enum {
+	OPT_FOLLOW = 256,
+	OPT_FOLLOW_TIMEOUT,
+	OPT_NO_SPARSE,
+	OPT_KEY_FILE,
+	OPT_PACK,
+	OPT_LAYOUT,
+	OPT_DEPTH,
+	OPT_DELIMITER,
+	OPT_PREFIX,
+	OPT_MATCH,
+	OPT_LIMIT_BYTES,
+	OPT_LIMIT_OPS,
+	OPT_YIELD_LATENCY,
+	OPT_READ_DEADLINE
+};
 
-#define BUFFSIZE (32 << 20) /* 32M */
-#define STRIPEUNIT (512 << 10) /* 512K */
-#define OBJECTSIZE (64 << 20) /* 64M */
-#define STRIPECOUNT 4 
+static const struct option long_options[] = {
+	{"follow", no_argument, NULL, OPT_FOLLOW},
+	{"follow-timeout", required_argument, NULL, OPT_FOLLOW_TIMEOUT},
+	{"no-sparse", no_argument, NULL, OPT_NO_SPARSE},
+	{"key-file", required_argument, NULL, OPT_KEY_FILE},
+	{"pack", no_argument, NULL, OPT_PACK},
+	{"layout", required_argument, NULL, OPT_LAYOUT},
+	{"depth", required_argument, NULL, OPT_DEPTH},
+	{"delimiter", required_argument, NULL, OPT_DELIMITER},
+	{"prefix", required_argument, NULL, OPT_PREFIX},
+	{"match", required_argument, NULL, OPT_MATCH},
+	{"limit-bytes", required_argument, NULL, OPT_LIMIT_BYTES},
+	{"limit-ops", required_argument, NULL, OPT_LIMIT_OPS},
+	{"yield-latency", required_argument, NULL, OPT_YIELD_LATENCY},
+	{"read-deadline", required_argument, NULL, OPT_READ_DEADLINE},
+	{NULL, 0, NULL, 0}
+};
 
+/* subcommands given as the first argument, e.g. "striprados serve" */
+static const struct {
+	const char *name;
+	enum act action;
+} commands[] = {
+	{"serve", SERVE},
+	{"http", HTTP},
+	{"mount", MOUNT},
+	{"pack", PACK},
+	{"compact", COMPACT},
+	{"tune", TUNE},
+	{"cp", COPY},
+	{"verify", VERIFY},
+	{"du", DU},
+	{NULL, NOOPS}
+};
 
 int quit = 0;
-remove_list rlist;
 int force = 0;
 int multi = 0;
+int progress = 1;
+/* local download cache, off unless -C is given */
+const char *cache_dir = NULL;
+uint64_t cache_limit = 10240ULL << 20;
+/* skip uploads of data the pool already holds */
+int dedup = 0;
+/* rewrite only the chunks that changed */
+int delta = 0;
+/* skip zero blocks on upload, make holes on download */
+int sparse = 1;
+/* lz4 compress uploads */
+int compression = 0;
+struct crypt_key *crypt_key = NULL;
+const char *key_prefix = NULL;
+regex_t *key_match = NULL;
+/* --pack: small uploads go into pack objects */
+int pack = 0;
 
 
 int is_head_object(const char * entry) {
@@ -110,6 +189,30 @@ int is_ver_object(const char * obj_name){
 		return 0;
 }
 
+/*
+ * --prefix and --match: the keys list, du and expiry look at. The OSD
+ * side filters of the object listing match xattrs, not names, so the
+ * names are matched here, before any metadata of the object is read.
+ */
+int key_selected(const char *key, size_t len) {
+	char buf[1024], *copy = buf;
+	int ret;
+
+	if (key_prefix != NULL && (len < strlen(key_prefix) || strncmp(key, key_prefix, strlen(key_prefix)) != 0))
+		return 0;
+	if (key_match == NULL)
+		return 1;
+	/* listed names are not terminated at the key */
+	if (len >= sizeof(buf) && (copy = malloc(len + 1)) == NULL)
+		return 0;
+	memcpy(copy, key, len);
+	copy[len] = '\0';
+	ret = regexec(key_match, copy, 0, NULL, 0) == 0;
+	if (copy != buf)
+		free(copy);
+	return ret;
+}
+
 int try_break_lock(rados_ioctx_t io_ctx, rados_striper_t striper, char *oid){
 	int exclusive;
 	char tag[1024];
@@ -145,13 +248,17 @@ int striprados_remove(rados_ioctx_t io_ctx, rados_striper_t striper, char *oid){
 	int ret;
 	int retry = 0;
 retry:
-	ret = rados_striper_remove(striper, oid);
+	/* the rados objects in parallel, each one counted by qos */
+	ret = fast_remove(io_ctx, oid);
 	if (ret == -EBUSY && force == 1 && retry == 0){
 		ret = try_break_lock(io_ctx,striper,oid);
 		retry++;
 		if (ret == 0)
 			goto retry;
 	}
+	/* not striped, it may be packed */
+	if (ret == -ENOENT && pack_remove(io_ctx, oid) == 0)
+		ret = 0;
 	if (ret < 0) {
 		debug("%s delete failed errno: %d \n", oid, ret);
 	}else{
@@ -168,32 +275,42 @@ int is_cached(const char * entry) {
 	return 1;
 }
 
-int do_ls(rados_ioctx_t ioctx) {
+/* the metadata of LIST_WINDOW head objects is read at once while listing */
+#define LIST_WINDOW 64
+
+static void ls_one(void *arg, const char *key, int ret, const struct object_meta *m) {
+	if (ret < 0)
+		debug("can not get striper.size of %s\n", key);
+	else
+		fprintf((FILE *)arg, "%-10s|%-10" PRIu64 "\n", key, m->size);
+}
+
+int do_ls(rados_ioctx_t ioctx, FILE *out) {
 	int ret;
 	const char *entry;
 	rados_list_ctx_t list_ctx;
-	char buf[128];
+	struct meta_batch *batch;
 	int length;
+	batch = meta_batch_new(ioctx, LIST_WINDOW, ls_one, out);
+	if (batch == NULL)
+		return -1;
 	ret = rados_objects_list_open(ioctx, &list_ctx);
 	if (ret < 0) {
 		debug("error reading list");
+		meta_batch_finish(batch);
 		return -1;
 	}
 	debug("===striper objects list===\n");
 	while(!quit && rados_objects_list_next(list_ctx, &entry, NULL) != -ENOENT) {
 		if (is_cached(entry) == 0)
 			continue;
-		if ((length = is_head_object(entry)) == 0)
+		if ((length = is_head_object(entry)) == 0 || !key_selected(entry, length))
 			continue;
-		memset(buf, 0, 128);
-		if (rados_getxattr(ioctx, entry, "striper.size", buf, 128) > 0) {
-			output("%-10.*s|%-10s\n", length, entry, buf);
-		} else {
-			debug("can not get striper.size of %s", entry);
-		}
+		meta_batch_add(batch, entry, length);
 	}
 	rados_objects_list_close(list_ctx);
-	return 0;
+	meta_batch_finish(batch);
+	return pack_list(ioctx, out) < 0 ? -1 : 0;
 }
 
 struct buffer_manager {
@@ -292,12 +409,66 @@ void put_buffer_back(struct buffer_manager *bm, char *buf) {
 	sem_post(&bm->available_bufs);
 }
 
-struct buffer_manager bm;
+/* every aio write owns one buffer until its completion fires */
+struct put_chunk {
+	struct buffer_manager *bm;
+	char *buf;
+	/* compressed copy of buf, NULL when not compressing */
+	char *zbuf;
+	/* writes still using buf, plus one held while they are issued */
+	int pending;
+	/* when the writes were issued, for the latency of qos */
+	double issued;
+};
+
+static void put_chunk_release(struct put_chunk *chunk) {
+	if (__sync_sub_and_fetch(&chunk->pending, 1) == 0) {
+		put_buffer_back(chunk->bm, chunk->buf);
+		free(chunk->zbuf);
+		free(chunk);
+	}
+}
 
 void set_completion_complete(rados_completion_t cb, void *arg)
 {
-	char *buf = (char*)arg;
-	put_buffer_back(&bm, buf);
+	qos_done(((struct put_chunk*)arg)->issued);
+	put_chunk_release((struct put_chunk*)arg);
+}
+
+struct completion_list {
+	rados_completion_t *list;
+	int32_t count;
+	uint32_t capacity;
+};
+
+/* one aio write of data that lives in chunk, remembered in cl */
+static int put_issue(rados_striper_t striper, const char *key, struct put_chunk *chunk, struct completion_list *cl,
+		const char *data, size_t len, uint64_t offset) {
+	rados_completion_t my_completion;
+	int ret;
+
+	/* use completion_list to store every completion_list  */
+	ret = rados_aio_create_completion((void *)chunk, set_completion_complete, NULL, &my_completion);
+	if (ret < 0) {
+		debug("failed to create completion\n");
+		return ret;
+	}
+	if (cl->count == cl->capacity - 1) {
+		cl->list =  realloc(cl->list, (cl->capacity << 1) * sizeof(rados_completion_t));
+		cl->capacity = cl->capacity << 1;
+	}
+	__sync_add_and_fetch(&chunk->pending, 1);
+	ret = rados_striper_aio_write(striper, key, my_completion, data, len, offset);
+	if (ret < 0) {
+		/* the callback never fires */
+		debug("failed to write %s errno: %d\n", key, ret);
+		rados_aio_release(my_completion);
+		__sync_sub_and_fetch(&chunk->pending, 1);
+		return ret;
+	}
+	cl->list[cl->count] = my_completion;
+	cl->count ++;
+	return 0;
 }
 
 
@@ -307,48 +478,119 @@ void quit_handler(int i)
 	quit = 1;
 }
 
+ssize_t read_full(int fd, char *buf, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+	while (done < len) {
+		n = read(fd, buf + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR && !quit)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+ssize_t write_full(int fd, const char *buf, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+	while (done < len) {
+		n = write(fd, buf + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR && !quit)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
 /* aio */
-int do_put2(rados_striper_t striper, const char *key, const char *filename, uint16_t concurrent, int overwrite) {
+int put_fd(rados_striper_t striper, const char *key, int fd, uint64_t size, uint16_t concurrent, int overwrite) {
 	
 	int ret = 0;
 	int i;
-	uint64_t count = 0;
-	uint64_t offset = 0;
+	ssize_t count = 0;
+	uint64_t offset = 0, osize;
+	size_t len, start, end, next, step, block;
+	time_t omtime;
+	int skip_zero, seekable;
 	char *buf = NULL;
-	rados_completion_t my_completion;
+	struct buffer_manager bm;
+	struct put_chunk *chunk;
+	struct chunk_sums sums;
+	struct chunk_map cmap;
+	struct crypt_info ci;
+	const char *zout[BUFFSIZE / CZ_CHUNK];
+	uint32_t zlen[BUFFSIZE / CZ_CHUNK];
+	int nz;
 	#define COMPLETION_LIST_SIZE 256
-	rados_completion_t *completion_list = calloc(COMPLETION_LIST_SIZE, sizeof(rados_completion_t));
-	int32_t next_num_writes = 0;
-	uint32_t capacity = COMPLETION_LIST_SIZE;
+	struct completion_list cl;
 
+	cl.list = calloc(COMPLETION_LIST_SIZE, sizeof(rados_completion_t));
+	cl.count = 0;
+	cl.capacity = COMPLETION_LIST_SIZE;
 
 	ret = init_buffer_manager(&bm, concurrent);
 
 	if (ret < 0) {
 		debug("failed to create buffer_manager\n");
+		free(cl.list);
 		return -1;
 	}
-	
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		debug("error reading file %s", filename);
-		ret = -1;
-		goto out;
+
+	/* the SHA-256 of every chunk costs the read thread, only -U reads them back */
+	if (sums_init(&sums, size) < 0 || (delta && !crypt_key && sums_strong(&sums) < 0)) {
+		sums_free(&sums);
+		destory_buffer_manager(&bm);
+		free(cl.list);
+		return -1;
 	}
-	/* check the file size */
-	struct stat sb;
-	fstat(fd, &sb);
-	if (sb.st_size <= 0) {
-		ret = -1;
-		debug("the size of file %s is 0\n", filename);
-		goto checkfilefail;
+	cmap.lens = NULL;
+	if ((compression && cmap_init(&cmap, size) < 0) || (crypt_key && crypt_new(crypt_key, &ci) < 0)) {
+		cmap_free(&cmap);
+		sums_free(&sums);
+		destory_buffer_manager(&bm);
+		free(cl.list);
+		return -1;
 	}
 
+	/* zeros need not be sent when nothing is there yet, missing objects read as zeros */
+	skip_zero = !crypt_key && sparse && (overwrite == 1 || rados_striper_stat(striper, key, &osize, &omtime) == -ENOENT);
+	/* chunks of a compressed object that are never written read as zeros */
+	seekable = (skip_zero || compression) && fd_can_hole(fd);
+
 	if (overwrite == 1)
 		rados_striper_trunc(striper, key, 0);
-
-	count = BUFFSIZE;
-	while (count != 0 && !quit) {
+	/* stale sums or chunk maps must not survive a partial upload */
+	rados_striper_rmxattr(striper, key, SUMS_XATTR);
+	rados_striper_rmxattr(striper, key, STRONG_XATTR);
+	rados_striper_rmxattr(striper, key, DIGEST_XATTR);
+	rados_striper_rmxattr(striper, key, CODEC_XATTR);
+	rados_striper_rmxattr(striper, key, CMAP_XATTR);
+	rados_striper_rmxattr(striper, key, CIPHER_XATTR);
+
+	/* whole stripes of an erasure coded pool per write, compressed chunks keep their own offsets */
+	step = compression ? BUFFSIZE : write_step();
+	block = STRIPEUNIT;
+	if (!compression && write_align > 1)
+		block = write_align > STRIPEUNIT ? write_align : STRIPEUNIT / write_align * write_align;
+
+	while (offset < size && !quit) {
+
+		len = size - offset < step ? size - offset : step;
+		/* a hole of the source is not even read, the last buffer always goes out to set the size */
+		if (seekable && offset + len < size && range_is_hole(fd, offset, len)) {
+			sums_zero(&sums, len);
+			offset += len;
+			lseek(fd, offset, SEEK_SET);
+			continue;
+		}
 
 		/* it may block */
 		buf = get_free_buffer(&bm);
@@ -359,7 +601,8 @@ int do_put2(rados_striper_t striper, const char *key, const char *filename, uint
 			continue;
 		}
 
-		count = read(fd, buf, BUFFSIZE);
+		/* fill the whole buffer, a socket may hand us short reads */
+		count = read_full(fd, buf, len);
 
 		if (count < 0) {
 			put_buffer_back(&bm, buf);
@@ -370,46 +613,184 @@ int do_put2(rados_striper_t striper, const char *key, const char *filename, uint
 
 		if (count == 0) {
 			put_buffer_back(&bm, buf);
-			ret = 0;
+			debug("unexpected end of input at %lu of %lu\n", offset, size);
+			ret = -1;
 			break;
 		}
 
-		/* use completion_list to store every completion_list  */
-		ret = rados_aio_create_completion((void *)buf, set_completion_complete, NULL, &my_completion);
+		/* hash while the buffer is hot in cache */
+		sums_update(&sums, buf, count);
+
+		chunk = malloc(sizeof(struct put_chunk));
+		if (chunk == NULL) {
+			put_buffer_back(&bm, buf);
+			ret = -1;
+			break;
+		}
+		chunk->bm = &bm;
+		chunk->buf = buf;
+		chunk->zbuf = NULL;
+		chunk->pending = 1;
+		chunk->issued = qos_wait(count);
+
+		if (crypt_key && !compression)
+			ret = crypt_buffer(&ci, buf, count, offset);
 		if (ret < 0) {
-			debug("failed to create completion\n");
+			put_chunk_release(chunk);
 			goto out1;
 		}
-		if (next_num_writes == capacity - 1) {
-			completion_list =  realloc(completion_list, (capacity << 1) * sizeof(rados_completion_t));
-			capacity = capacity << 1;
+
+		if (compression) {
+			/* compressed chunks stay at their logical offsets, chunks of zeros are not written */
+			chunk->zbuf = malloc(compress_bound(count));
+			nz = chunk->zbuf ? compress_buffer(&cmap, buf, count, offset, chunk->zbuf, zout, zlen) : -1;
+			ret = nz < 0 ? -1 : 0;
+			for (i = 0; i < nz && ret == 0; i++) {
+				/* what is stored gets encrypted, at the offset it is stored at */
+				if (zlen[i] > 0 && crypt_key)
+					ret = crypt_buffer(&ci, (char *)zout[i], zlen[i], offset + (uint64_t)i * CZ_CHUNK);
+				if (zlen[i] > 0 && ret == 0)
+					ret = put_issue(striper, key, chunk, &cl, zout[i], zlen[i], offset + (uint64_t)i * CZ_CHUNK);
+			}
 		}
-		completion_list[next_num_writes] = my_completion;
-		next_num_writes ++;
 
-		rados_striper_aio_write(striper, key, my_completion, buf, count, offset);
+		/* one write per run of blocks that are not skipped as zero */
+		for (start = compression ? (size_t)count : 0; start < (size_t)count; start = end) {
+			end = start + block < (size_t)count ? start + block : (size_t)count;
+			if (skip_zero && offset + end < size && buffer_is_zero(buf + start, end - start))
+				continue;
+			while (end < (size_t)count) {
+				next = end + block < (size_t)count ? end + block : (size_t)count;
+				if (skip_zero && offset + next < size && buffer_is_zero(buf + end, next - end))
+					break;
+				end = next;
+			}
+
+			ret = put_issue(striper, key, chunk, &cl, buf + start, end - start, offset + start);
+			if (ret < 0)
+				break;
+		}
+		put_chunk_release(chunk);
+		if (ret < 0)
+			goto out1;
 
 		offset += count;
-		debug("%lu%%\r", offset * 100 / sb.st_size);
-		fflush(stderr);
+		if (progress) {
+			debug("%lu%%\r", offset * 100 / size);
+			fflush(stderr);
+		}
 	}
 	
 out1:
 
 
-	for(i = 0 ; i < next_num_writes ; i ++) {
-		rados_aio_wait_for_safe(completion_list[i]);
-		rados_aio_release(completion_list[i]);
+	/* only our own writes, the striper may be shared by serve connections */
+	for(i = 0 ; i < cl.count ; i ++) {
+		rados_aio_wait_for_safe_and_cb(cl.list[i]);
+		if (rados_aio_get_return_value(cl.list[i]) < 0) {
+			debug("failed to write %s errno: %d\n", key, rados_aio_get_return_value(cl.list[i]));
+			ret = -1;
+		}
+		rados_aio_release(cl.list[i]);
 	}
-	rados_striper_aio_flush(striper);
-	if(completion_list)
-		free(completion_list);
+	if(cl.list)
+		free(cl.list);
+
+	/* the size is the logical one, whatever the last chunk stored */
+	if (compression && ret == 0 && !quit) {
+		if (rados_striper_trunc(striper, key, size) < 0 || cmap_store(striper, key, &cmap) < 0) {
+			debug("failed to store the chunk map of %s\n", key);
+			ret = -1;
+		}
+	}
+	if (crypt_key && ret == 0 && !quit && crypt_store(striper, key, &ci) < 0) {
+		debug("failed to store the encryption header of %s\n", key);
+		ret = -1;
+	}
+	/* no sums of the plaintext on an encrypted object, they would confirm a guessed file */
+	if (ret == 0 && !quit && !crypt_key && sums_store(striper, key, &sums) < 0)
+		debug("failed to store checksums of %s\n", key);
+	sums_free(&sums);
+	cmap_free(&cmap);
 
-checkfilefail:	
-	close(fd);
-out:
 	destory_buffer_manager(&bm);
 
+	/* if interrupted, return -1 */
+	if (quit == 1)
+		return -1;
+	return ret;
+}
+
+int do_put2(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename, uint16_t concurrent, int overwrite) {
+	int ret, own_striper;
+	struct chunk_sums local;
+	unsigned char digest[DIGEST_LEN];
+	char *dup = NULL;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		debug("error reading file %s", filename);
+		return -1;
+	}
+	/* check the file size */
+	struct stat sb;
+	fstat(fd, &sb);
+	if (sb.st_size <= 0) {
+		debug("the size of file %s is 0\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	if (pack && sb.st_size <= PACK_MAX_FILE) {
+		close(fd);
+		return pack_put(ioctx, striper, (char **)&key, (char **)&filename, 1);
+	}
+
+	/* new objects get the layout of their size class */
+	own_striper = layout_striper(ioctx, sb.st_size, &striper);
+	if (own_striper < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 * hash the file first, an identical object makes the upload unnecessary;
+	 * not when encrypting: a plaintext or foreign-key match is no match
+	 */
+	if (dedup && !crypt_key && hash_file(fd, sb.st_size, &local, digest) == 0) {
+		ret = dedup_lookup(ioctx, striper, key, &local, digest, &dup);
+		if (ret == 1) {
+			debug("%s already holds the same data, upload skipped\n", key);
+		} else if (ret == 2) {
+			debug("%s is a duplicate of %s, upload skipped\n", key, dup);
+			output("%s|duplicate|%s\n", key, dup);
+			free(dup);
+		} else {
+			if (delta)
+				ret = put_delta(striper, key, fd, sb.st_size, concurrent);
+			else
+				ret = put_fd(striper, key, fd, sb.st_size, concurrent, overwrite);
+			if (ret == 0 && dedup_record(ioctx, striper, key, &local, digest) < 0)
+				debug("failed to record %s in the dedup index\n", key);
+		}
+		/* a packed copy would show up in the listing */
+		if (ret == 0)
+			pack_remove(ioctx, key);
+		sums_free(&local);
+		close(fd);
+		if (own_striper)
+			rados_striper_destroy(striper);
+		return ret < 0 ? -1 : 0;
+	}
+
+	if (delta)
+		ret = put_delta(striper, key, fd, sb.st_size, concurrent);
+	else
+		ret = put_fd(striper, key, fd, sb.st_size, concurrent, overwrite);
+	if (ret == 0)
+		pack_remove(ioctx, key);
+	close(fd);
+	if (own_striper)
+		rados_striper_destroy(striper);
 	return ret;
 }
 
@@ -477,70 +858,320 @@ out1:
 }
 
 
-int do_get(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename) {
-
+int striper_size(rados_ioctx_t ioctx, const char *key, uint64_t *size) {
 	char numbuf[128];
-	uint64_t offset = 0;
-	int count = 0;
-	uint64_t file_size;
 	int ret = 0;
 	memset(numbuf, 0, 128);
 
-	char *buf = malloc(BUFFSIZE);
-	if (buf == NULL) {
-		ret = -1;
-	}
-	memset(buf, 0, BUFFSIZE);
-
-
 	char * sobj = malloc(strlen(key) + 17 + 1);
-	if (sobj == NULL) {
-		ret = -1;
-		goto out;
-	}
+	if (sobj == NULL)
+		return -1;
 
 	sprintf(sobj,"%s.%016d", key, 0);
 
 	if (rados_getxattr(ioctx, sobj, "striper.size", numbuf, 128) > 0) {
-		sscanf(numbuf, "%lu", &file_size);
+		sscanf(numbuf, "%lu", size);
 	} else {
 		ret = -1;
-		debug("no remote file or the file is not striped: %s\n", key);
-		goto out1;;
 	}
+	free(sobj);
+	return ret;
+}
 
-	int fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
-	if (fd < 0) {
-		debug("error writing file %s\n", filename);
-		ret = -1;
-		goto out1;
+int sums_store(rados_striper_t striper, const char *key, struct chunk_sums *sums) {
+	size_t len;
+	char *buf;
+	int ret;
+
+	if (sums_finish(sums) < 0 || (buf = sums_encode(sums, &len)) == NULL)
+		return -1;
+	ret = rados_striper_setxattr(striper, key, SUMS_XATTR, buf, len);
+	free(buf);
+	if (ret < 0 || sums->strong == NULL)
+		return ret;
+	if ((buf = strong_encode(sums, &len)) == NULL)
+		return -1;
+	ret = rados_striper_setxattr(striper, key, STRONG_XATTR, buf, len);
+	free(buf);
+	return ret;
+}
+
+/* the strong digests that go with sums loaded from key */
+int strong_load(rados_striper_t striper, const char *key, struct chunk_sums *sums) {
+	size_t len = 8 + (size_t)sums->count * STRONG_LEN;
+	char *buf = malloc(len);
+	int ret;
+
+	if (buf == NULL)
+		return -1;
+	ret = rados_striper_getxattr(striper, key, STRONG_XATTR, buf, len);
+	ret = ret <= 0 ? -1 : strong_decode(sums, buf, ret);
+	free(buf);
+	return ret;
+}
+
+/* the stored sums of key, only when they cover exactly size bytes */
+int sums_load(rados_striper_t striper, const char *key, uint64_t size, struct chunk_sums *sums) {
+	size_t len = 20 + SUMS_MAX_COUNT * 4 * 4;
+	char *buf = malloc(len);
+	int ret;
+
+	if (buf == NULL)
+		return -1;
+	ret = rados_striper_getxattr(striper, key, SUMS_XATTR, buf, len);
+	if (ret <= 0 || sums_decode(sums, buf, ret) < 0) {
+		free(buf);
+		return -1;
 	}
-	
-	while (!quit) {
-		count = rados_striper_read(striper, key, buf, BUFFSIZE, offset);
-		if (count < 0) {
-			debug("error reading rados file %s", key);
+	free(buf);
+	if (sums->size != size) {
+		sums_free(sums);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * download in a pipeline: GET_WINDOW reads of BUFFSIZE are in flight while
+ * the oldest one is verified against the stored chunk sums and written.
+ */
+#define GET_WINDOW 4
+/* one read of the get window: a single aio read, or one per chunk of a compressed object */
+struct get_slot {
+	char *buf;
+	char *zbuf;
+	uint64_t len;
+	double issued;
+	rados_completion_t comps[BUFFSIZE / CZ_CHUNK];
+	size_t expect[BUFFSIZE / CZ_CHUNK];
+	int ncomps;
+};
+
+/*
+ * the reads of one slot, a request of the shared reactor so that the
+ * bytes in flight of all downloads stay within its budget. It ends when
+ * its reads are done, get_fd waits for them on its own.
+ */
+struct get_read {
+	struct reactor_req req;
+	rados_striper_t striper;
+	const char *key;
+	/* valid in the first step only */
+	struct get_slot *s;
+	const struct chunk_map *map;
+	uint64_t offset;
+};
+
+static int get_read_step(struct reactor_req *r) {
+	struct get_read *q = (struct get_read *)r;
+	struct get_slot *s = q->s;
+	int ret;
+
+	if (r->state++ > 0)
+		return REQ_DONE;
+	if (q->map != NULL) {
+		s->ncomps = cmap_read_chunks(q->striper, q->key, q->map, q->offset, s->len, s->buf, s->zbuf, s->comps, s->expect, r);
+		return s->ncomps < 0 ? REQ_DONE : REQ_MORE;
+	}
+	s->ncomps = -1;
+	s->comps[0] = reactor_completion(r);
+	if (s->comps[0] == NULL)
+		return REQ_DONE;
+	ret = rados_striper_aio_read(q->striper, q->key, s->comps[0], s->buf, s->len, q->offset);
+	if (ret < 0) {
+		/* the completion never fires */
+		debug("error reading rados file %s at %lu: %d\n", q->key, q->offset, ret);
+		reactor_unused(r, s->comps[0]);
+		return REQ_DONE;
+	}
+	s->expect[0] = s->len;
+	s->ncomps = 1;
+	return REQ_MORE;
+}
+
+static void get_read_done(struct reactor_req *r) {
+	free(r);
+}
+
+/* issue the reads of s at offset, s->ncomps is -1 when they did not go out */
+static void get_read_start(struct reactor *reactor, rados_striper_t striper, const char *key, struct get_slot *s,
+		const struct chunk_map *map, uint64_t offset, struct hedge *h) {
+	struct get_read *q = calloc(1, sizeof(struct get_read));
+
+	s->ncomps = -1;
+	if (q == NULL)
+		return;
+	q->req.step = get_read_step;
+	q->req.done = get_read_done;
+	q->req.bytes = s->len;
+	if (h != NULL) {
+		q->req.notify = hedge_wake;
+		q->req.notify_arg = h;
+	}
+	q->striper = striper;
+	q->key = key;
+	q->s = s;
+	q->map = map;
+	q->offset = offset;
+	reactor_start(reactor, NULL, &q->req);
+}
+
+int get_fd(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, int fd, uint64_t file_size) {
+
+	uint64_t offset = 0, issued = 0;
+	struct get_slot slots[GET_WINDOW], *s;
+	struct chunk_sums want, got;
+	struct chunk_map map;
+	struct crypt_info ci;
+	struct hedge *h = NULL;
+	struct reactor *reactor = reactor_shared();
+	uint32_t checked = 0;
+	int verify, holes, compressed, crypted, head = 0, inflight = 0, slot, i;
+	int count = 0;
+	int ret = 0;
+
+	memset(slots, 0, sizeof(slots));
+	if (reactor == NULL)
+		return -1;
+	compressed = cmap_load(striper, key, file_size, &map);
+	if (compressed < 0)
+		return -1;
+	compressed = compressed == 0;
+	crypted = crypt_load(striper, key, &ci);
+	if (crypted < 0) {
+		if (compressed)
+			cmap_free(&map);
+		return -1;
+	}
+	crypted = crypted == 0;
+	/* deadlines for the plain reads, without one they just wait */
+	if (!compressed)
+		h = hedge_new(ioctx, key);
+	for (slot = 0; slot < GET_WINDOW; slot++) {
+		slots[slot].buf = malloc(BUFFSIZE);
+		if (compressed)
+			slots[slot].zbuf = malloc(BUFFSIZE);
+		if (slots[slot].buf == NULL || (compressed && slots[slot].zbuf == NULL)) {
 			ret = -1;
+			goto out;
+		}
+	}
+
+	holes = fd_can_hole(fd);
+	verify = sums_load(striper, key, file_size, &want) == 0;
+	if (verify && sums_init(&got, file_size) < 0) {
+		sums_free(&want);
+		verify = 0;
+	}
+	if (verify)
+		got.chunk = want.chunk;
+
+	while (!quit && offset < file_size) {
+		/* keep the window full */
+		while (inflight < GET_WINDOW && issued < file_size) {
+			s = &slots[(head + inflight) % GET_WINDOW];
+			s->len = file_size - issued < BUFFSIZE ? file_size - issued : BUFFSIZE;
+			s->issued = qos_wait(s->len);
+			get_read_start(reactor, striper, key, s, compressed ? &map : NULL, issued, h);
+			if (s->ncomps < 0) {
+				ret = -1;
+				break;
+			}
+			issued += s->len;
+			inflight++;
+		}
+		if (inflight == 0 || ret < 0)
 			break;
+
+		s = &slots[head];
+		if (h != NULL) {
+			count = hedge_read(h, striper, s->comps[0], &s->buf, s->len, offset, s->issued);
+			if (count < 0 || (size_t)count != s->len) {
+				debug("error reading rados file %s at %lu: %d\n", key, offset, count);
+				ret = -1;
+			}
 		}
-		if (count == 0) {
-			ret = 0;
+		for (i = 0; h == NULL && i < s->ncomps; i++) {
+			/* the reactor callback still touches its request */
+			rados_aio_wait_for_complete_and_cb(s->comps[i]);
+			count = rados_aio_get_return_value(s->comps[i]);
+			rados_aio_release(s->comps[i]);
+			if (count < 0 || (size_t)count != s->expect[i]) {
+				debug("error reading rados file %s at %lu: %d\n", key, offset, count);
+				ret = -1;
+			}
+		}
+		qos_done(s->issued);
+		head = (head + 1) % GET_WINDOW;
+		inflight--;
+		if (ret < 0)
+			break;
+		if (crypted && (compressed ? crypt_chunks(&ci, &map, offset, s->len, s->buf, s->zbuf) :
+					crypt_buffer(&ci, s->buf, s->len, offset)) < 0) {
+			ret = -1;
 			break;
 		}
-		if (write(fd, buf, count) < 0){ 
+		if (compressed && decompress_buffer(&map, offset, s->len, s->buf, s->zbuf) < 0) {
+			debug("corrupt compressed data in %s at %lu\n", key, offset);
+			ret = -1;
+			break;
+		}
+		count = s->len;
+
+		if (verify) {
+			sums_update(&got, s->buf, count);
+			if (offset + count == file_size)
+				sums_finish(&got);
+			for (; checked < got.count; checked++) {
+				if (got.crcs[checked] != want.crcs[checked]) {
+					debug("checksum mismatch in %s at offset %lu\n", key, (uint64_t)checked * want.chunk);
+					ret = -1;
+					break;
+				}
+			}
+			if (ret < 0)
+				break;
+		}
+
+		if ((holes ? write_sparse(fd, s->buf, count) : write_full(fd, s->buf, count)) < 0) {
 			ret = -1;
 			break;
 		}
 		offset += count;
-		debug("%lu%%\r", offset*100/file_size);
-		fflush(stdout);
+		if (progress) {
+			debug("%lu%%\r", offset*100/file_size);
+			fflush(stdout);
+		}
 	}
 
-	close(fd);
-out1:
-	free(sobj);
+	/* a trailing hole was only seeked over */
+	if (holes && ret == 0 && !quit && ftruncate(fd, offset) < 0)
+		ret = -1;
+
+	/* the buffers belong to the reads still in flight */
+	for (; inflight > 0; inflight--) {
+		s = &slots[head];
+		for (i = 0; i < s->ncomps; i++) {
+			/* the callback may still use the hedge */
+			rados_aio_wait_for_complete_and_cb(s->comps[i]);
+			rados_aio_release(s->comps[i]);
+		}
+		head = (head + 1) % GET_WINDOW;
+	}
+	if (verify) {
+		if (ret == 0 && !quit)
+			debug("%s verified, crc32c %08x\n", key, sums_whole(&got));
+		sums_free(&want);
+		sums_free(&got);
+	}
 out:
-	free(buf);
+	hedge_free(h);
+	for (slot = 0; slot < GET_WINDOW; slot++) {
+		free(slots[slot].buf);
+		free(slots[slot].zbuf);
+	}
+	if (compressed)
+		cmap_free(&map);
 
 	/* if interrupted, return -1 */
 	if (quit == 1)
@@ -548,12 +1179,134 @@ out:
 	return ret;
 }
 
-int do_delete(rados_ioctx_t ioctx, rados_striper_t striper, char *key, const char * file) {
+int do_get(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename) {
+
+	uint64_t file_size;
+	time_t mtime = 0;
+	uint32_t sum = 0;
+	struct chunk_sums sums;
+	char cipher[64];
+	int ret = 0, packed = 0, cached = cache_dir != NULL;
+
+	/* the cache needs the mtime as well, one stat gives both */
+	if (cached)
+		ret = rados_striper_stat(striper, key, &file_size, &mtime);
+	else
+		ret = striper_size(ioctx, key, &file_size);
+	if (ret < 0 && pack_stat(ioctx, key, &file_size, &mtime) == 0)
+		packed = 1;
+	else if (ret < 0) {
+		debug("no remote file or the file is not striped: %s\n", key);
+		return -1;
+	}
+	/* a hit is not decrypted with the caller's key, and plaintext stays off the disk */
+	if (cached && !packed && rados_striper_getxattr(striper, key, CIPHER_XATTR, cipher, sizeof(cipher)) > 0)
+		cached = 0;
+	/* the mtime has whole seconds only, the content sum completes the fingerprint */
+	if (cached && !packed) {
+		if (sums_load(striper, key, file_size, &sums) == 0) {
+			sum = sums_whole(&sums);
+			sums_free(&sums);
+		} else {
+			cached = 0;
+		}
+	}
+
+	/* readable as well, a fresh download is copied into the cache */
+	int fd = open(filename, (cached ? O_RDWR : O_WRONLY)|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		debug("error writing file %s\n", filename);
+		return -1;
+	}
+
+	if (packed) {
+		ret = pack_get_fd(ioctx, key, fd) < 0 ? -1 : 0;
+		close(fd);
+		return ret;
+	}
+
+	if (cached && cache_fetch(cache_dir, key, file_size, mtime, sum, fd) == 0) {
+		debug("%s served from cache\n", key);
+		close(fd);
+		return 0;
+	}
+
+	ret = get_fd(ioctx, striper, key, fd, file_size);
+	if (ret == 0 && cached)
+		cache_store(cache_dir, cache_limit, key, file_size, mtime, sum, fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * the removes of -d with a list and of -e as requests of the shared
+ * reactor, REMOVE_REQUESTS at a time with -m and one by one without it
+ */
+#define REMOVE_REQUESTS 50
+
+struct remove_batch {
+	rados_ioctx_t ioctx;
+	rados_striper_t striper;
+	struct reactor *r;
+	struct reactor_group group;
+	int removed;
+};
+
+static void remove_batch_done(void *arg, const char *key, int ret) {
+	struct remove_batch *rb = (struct remove_batch *)arg;
+	/* a lock to break, the way of a single -d */
+	if (ret == -EBUSY && force == 1) {
+		ret = striprados_remove(rb->ioctx, rb->striper, (char *)key);
+		goto out;
+	}
+	/* not striped, it may be packed */
+	if (ret == -ENOENT && pack_remove(rb->ioctx, key) == 0)
+		ret = 0;
+	if (ret < 0)
+		debug("%s delete failed errno: %d \n", key, ret);
+	else
+		debug("%s deleted\n", key);
+out:
+	if (ret == 0)
+		__sync_add_and_fetch(&rb->removed, 1);
+}
+
+static struct remove_batch *remove_batch_new(rados_ioctx_t ioctx, rados_striper_t striper) {
+	struct remove_batch *rb = calloc(1, sizeof(struct remove_batch));
+	if (rb == NULL)
+		return NULL;
+	rb->ioctx = ioctx;
+	rb->striper = striper;
+	rb->r = reactor_shared();
+	if (rb->r == NULL) {
+		free(rb);
+		return NULL;
+	}
+	reactor_group_init(&rb->group, multi ? REMOVE_REQUESTS : 1);
+	return rb;
+}
+
+/* blocks while the reactor or the batch is full */
+static void remove_batch_add(struct remove_batch *rb, const char *key) {
+	if (remove_submit(rb->r, &rb->group, rb->ioctx, key, remove_batch_done, rb) < 0)
+		debug("%s delete failed\n", key);
+}
+
+/* the number of keys removed */
+static int remove_batch_finish(struct remove_batch *rb) {
+	int removed;
+	reactor_drain(rb->r, &rb->group);
+	removed = rb->removed;
+	free(rb);
+	return removed;
+}
+
+int do_delete(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char * file) {
 	int ret;
 	/* delete single key */
 	if (file == NULL) {
 		debug("deleting %s\n",key);
-		ret = striprados_remove(ioctx, striper, key);
+		ret = striprados_remove(ioctx, striper, (char *)key);
 		if (ret < 0) {
 			debug("%s delete failed\n", key);
 			return -1;
@@ -570,11 +1323,17 @@ int do_delete(rados_ioctx_t ioctx, rados_striper_t striper, char *key, const cha
 	size_t len = 0;
 	ssize_t read;
 	FILE *fp = fopen(file, "r");
-	int counts = 0;
+	struct remove_batch *rb;
+	int counts, failed = 0;
 	if (fp == NULL) {
 		debug("can not open %s\n", file);
 		return -1;
 	}
+	rb = remove_batch_new(ioctx, striper);
+	if (rb == NULL) {
+		fclose(fp);
+		return -1;
+	}
 
 	while(!quit && (read = getline(&line, &len, fp)) != -1) {
 
@@ -587,7 +1346,8 @@ int do_delete(rados_ioctx_t ioctx, rados_striper_t striper, char *key, const cha
 				line[read -2 ] = '\0';
 		} else {
 			debug("read file line %s failed\n",  line);
-			return -1;
+			failed = 1;
+			break;
 		}
 
 		p = line;
@@ -605,17 +1365,16 @@ int do_delete(rados_ioctx_t ioctx, rados_striper_t striper, char *key, const cha
 			continue;
 
 		debug("deleting key:%s\n", real_key);
-		ret = striprados_remove(ioctx, striper, real_key);
-		if (ret < 0) {
-			debug("deleting:%s failed\n", real_key);
-			continue;
-		}
-		counts ++;
+		remove_batch_add(rb, real_key);
 	}
 
 	if (line)
 		free(line);
 	fclose(fp);
+	/* the keys submitted so far are still removed */
+	counts = remove_batch_finish(rb);
+	if (failed)
+		return -1;
 
 	if (counts == 0) {
 		debug("No Object was deleted\n");
@@ -625,94 +1384,68 @@ int do_delete(rados_ioctx_t ioctx, rados_striper_t striper, char *key, const cha
 	return 0;
 }
 
-int do_info(rados_striper_t striper, const char *key) {
-	uint64_t size;
-	time_t mod_time;
-	int ret;
+void print_info(FILE *out, const char *key, uint64_t size, time_t mod_time) {
 	char buffer[50];
-	ret = rados_striper_stat(striper, key, &size, &mod_time);
+	strftime(buffer, 50, "%Y/%m/%d-%H:%M:%S", localtime(&mod_time));
+	fprintf(out, "%-s|%"PRIu64"|%s\n", key, size, buffer);
+}
+
+int do_info(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, FILE *out) {
+	struct object_meta m;
+	int ret;
+	ret = meta_fetch(ioctx, key, &m);
+	if (ret < 0)
+		ret = pack_stat(ioctx, key, &m.size, &m.mtime);
 	if (ret < 0) {
 		debug("no such object\n");
 		return -1;
 	}
-	strftime(buffer, 50, "%Y/%m/%d-%H:%M:%S", localtime(&mod_time));
-	output("%-s|%"PRIu64"|%s\n", key, size, buffer);
+	print_info(out, key, m.size, m.mtime);
 	return 0;
 }
 
-void add_obj_to_list(remove_list_t plist, char *oid){
-	remove_node_t pnode = (remove_node_t)malloc(sizeof(remove_node));
-	if (pnode == NULL) {
-		debug("malloc failed in %d",__LINE__);
-		return;
-	}
-	pnode->oid = strdup(oid);
-	pthread_mutex_lock(&plist->job_mutex);
-	list_add_tail(&pnode->list,&plist->job_list);
-	plist->count++;
-	pthread_mutex_unlock(&plist->job_mutex);
-}
+struct clear_args {
+	struct remove_batch *rb;
+	int date_of_expiry;
+};
 
-char *get_obj_from_list(remove_list_t plist)
-{
-	remove_node_t pos,n;
-	char *ret = NULL;
-	int find = 0;
-	pthread_mutex_lock(&plist->job_mutex);
-	list_for_each_entry_safe(pos, n, &plist->job_list, list){
-		find = 1;
-		ret = pos->oid;
-		break;
-	}
-	if (find == 1){
-		
-		list_del(&pos->list);
-		plist->count--;
-		free(pos);
-	}
-	pthread_mutex_unlock(&plist->job_mutex);
-	return ret;
-}
+static void clear_one(void *arg, const char *key, int ret, const struct object_meta *m) {
+	struct clear_args *c = (struct clear_args *)arg;
+	time_t now_time;
 
-void process_remove_ver_objs(void *arg){
-	rm_args_t agrs = (rm_args_t)arg;
-	rados_ioctx_t io_ctx = agrs->io_ctx;
-	rados_striper_t striper = agrs->striper;
-	char *oid = NULL;
-	int ret = 0;
-	while(1){
-		oid = get_obj_from_list(&rlist);
-		if (oid == NULL){
-			break;
-		}
-		ret = striprados_remove(io_ctx, striper, oid);
-		free(oid);
-		if (ret != 0){
-			break;
-		}
-			
+	/* removed while we were listing */
+	if (ret < 0) {
+		debug("no such object %s\n", key);
+		return;
 	}
-	free(arg);
-	return;
+	time(&now_time);
+	if ((now_time - m->mtime) > c->date_of_expiry)
+		remove_batch_add(c->rb, key);
 }
 
-
 int do_clear_old_files(rados_striper_t striper, rados_ioctx_t ioctx, const char *key, int force) {
 	int ret;
 	const char *entry;
 	rados_list_ctx_t list_ctx;
 	char buf[128];
 	int length;
-	uint64_t size;
-	time_t mod_time;
-	time_t now_time;
-	int date_of_expiry = atoi(key)*24*60*60;
-	rm_args_t args = NULL;
-	threadpool tp;
-	tp = create_threadpool(50);
+	struct clear_args c;
+	struct meta_batch *batch;
+	c.date_of_expiry = atoi(key)*24*60*60;
+	c.rb = remove_batch_new(ioctx, striper);
+	if (c.rb == NULL)
+		return -1;
+	/* the mtimes of LIST_WINDOW old versions are read at once */
+	batch = meta_batch_new(ioctx, LIST_WINDOW, clear_one, &c);
+	if (batch == NULL) {
+		remove_batch_finish(c.rb);
+		return -1;
+	}
 	ret = rados_objects_list_open(ioctx, &list_ctx);
 	if (ret < 0) {
 			debug("error reading list");
+			meta_batch_finish(batch);
+			remove_batch_finish(c.rb);
 			return -1;
 	}
 	debug("===start delete objects ===\n");
@@ -723,53 +1456,86 @@ int do_clear_old_files(rados_striper_t striper, rados_ioctx_t ioctx, const char
 			continue;
 		memset(buf, 0, sizeof(buf));
 		strncpy(buf, entry, length);
-		if (!is_ver_object(buf))
+		if (!is_ver_object(buf) || !key_selected(entry, length))
 			continue;
-		ret = rados_striper_stat(striper, buf, &size, &mod_time);
-		if (ret < 0) {
-			debug("no such object\n");
-			return -1;
-		}
-		time(&now_time);
-		if ((now_time - mod_time) > date_of_expiry){
-			if (multi){
-				add_obj_to_list(&rlist, buf);
-				args = (rm_args_t)malloc(sizeof(rm_args));
-				args->io_ctx = ioctx;
-				args->striper = striper;
-				dispatch_threadpool(tp, process_remove_ver_objs, (void *)args);
-			}else{
-				striprados_remove(ioctx, striper, buf);
-			}
-		}
+		/* the stat of the sweep counts against --limit-ops too */
+		qos_wait(0);
+		meta_batch_add(batch, entry, length);
 	}
 	
 	rados_objects_list_close(list_ctx);
-	while(!list_empty(&rlist.job_list)){
-		sleep(5);
-	}
-	destroy_threadpool(tp);
+	meta_batch_finish(batch);
+	remove_batch_finish(c.rb);
 	debug("===all objects deleted complete ===\n");
 	return 0;
 }
 
+int open_pool(rados_t rados, const char *pool_name, rados_ioctx_t *io_ctx, rados_striper_t *striper) {
+	struct layout layout;
+	int ret;
+	ret = rados_ioctx_create(rados, pool_name, io_ctx);
+	if (ret < 0) {
+		debug("couldn't set up ioctx! error %d\n", ret);
+		*io_ctx = NULL;
+		return ret;
+	} else
+		debug("created an ioctx for our pool\n");
+
+	ret = rados_striper_create(*io_ctx, striper);
+	if (ret < 0) {
+		debug("couldn't set up striper error %d\n", ret);
+		*striper = NULL;
+		return ret;
+	} else {
+		debug("created a striper for our pool\n");
+	}
+
+
+	layout_default(*io_ctx, &layout);
+	layout_apply(*striper, &layout);
+	write_align = pool_alignment(*io_ctx);
+	if (write_align > 1)
+		debug("erasure coded pool, writes aligned to %" PRIu64 " bytes\n", write_align);
+	return 0;
+}
+
 int main(int argc, const char **argv)
 {
 
 	int opt;
 	char *pool_name = NULL;
-	char *key = NULL;
+	const char *key = NULL;
 	const char *filename = NULL;
 	const char *to_delete_file_list = NULL;
+	const char *listen_addr = NULL;
+	int cache_mb = 256;
+	int follow = 0;
+	int follow_timeout = 60;
+	int depth = 1;
+	const char *delimiter = "/";
+	regex_t match;
+	const char *key_file = NULL;
+	static struct crypt_key loaded_key;
 	int ret = 0;
+	int i;
 	enum act action = NOOPS;
-	pthread_mutex_init(&rlist.job_mutex, NULL);
-	INIT_LIST_HEAD(&rlist.job_list);
-	rlist.count = 0;
 	time_t startT, endT;
 	double totalT;
 	startT = time(NULL);
-	while ((opt = getopt(argc, (char* const *) argv, "d:p:u:g:mflr:i:e:")) != -1) {
+
+	/* "striprados <command> [options]": the command takes the place of argv[0] */
+	if (argc > 1 && argv[1][0] != '-') {
+		for (i = 0; commands[i].name != NULL; i++) {
+			if (strcmp(argv[1], commands[i].name) == 0) {
+				action = commands[i].action;
+				argc--;
+				argv++;
+				break;
+			}
+		}
+	}
+
+	while ((opt = getopt_long(argc, (char* const *) argv, "d:p:u:g:mflr:i:e:s:c:C:Z:DUz", long_options, NULL)) != -1) {
 		switch (opt) {
 			case 'd':
 				action = DELETE;
@@ -807,6 +1573,79 @@ int main(int argc, const char **argv)
 			case 'm':
 				multi = 1;
 				break;
+			case 's':
+				listen_addr = optarg;
+				break;
+			case 'c':
+				cache_mb = atoi(optarg);
+				break;
+			case 'C':
+				cache_dir = optarg;
+				break;
+			case 'Z':
+				cache_limit = strtoull(optarg, NULL, 10) << 20;
+				break;
+			case 'D':
+				dedup = 1;
+				break;
+			case 'U':
+				delta = 1;
+				break;
+			case 'z':
+				compression = 1;
+				break;
+			case OPT_FOLLOW:
+				follow = 1;
+				break;
+			case OPT_FOLLOW_TIMEOUT:
+				follow_timeout = atoi(optarg);
+				break;
+			case OPT_NO_SPARSE:
+				sparse = 0;
+				break;
+			case OPT_KEY_FILE:
+				key_file = optarg;
+				break;
+			case OPT_PACK:
+				pack = 1;
+				break;
+			case OPT_DEPTH:
+				depth = atoi(optarg);
+				break;
+			case OPT_DELIMITER:
+				delimiter = optarg;
+				break;
+			case OPT_PREFIX:
+				key_prefix = optarg;
+				break;
+			case OPT_MATCH:
+				if (key_match != NULL)
+					regfree(key_match);
+				if (regcomp(&match, optarg, REG_EXTENDED | REG_NOSUB) != 0) {
+					debug("bad regular expression %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				key_match = &match;
+				break;
+			case OPT_LAYOUT:
+				if (layout_load(optarg) < 0)
+					return EXIT_FAILURE;
+				break;
+			case OPT_LIMIT_BYTES:
+				if (parse_size(optarg, &qos_bytes) < 0 || qos_bytes == UINT64_MAX) {
+					debug("bad --limit-bytes %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_LIMIT_OPS:
+				qos_ops = strtoull(optarg, NULL, 10);
+				break;
+			case OPT_YIELD_LATENCY:
+				qos_latency = atoi(optarg);
+				break;
+			case OPT_READ_DEADLINE:
+				read_deadline = atoi(optarg);
+				break;
 			default:
 				usage();
 				return EXIT_FAILURE;
@@ -821,8 +1660,26 @@ int main(int argc, const char **argv)
 			usage();
 			return EXIT_FAILURE;
 		}
-	} else if ((action == LIST || action == DELETE || action == INFO ) && pool_name) {
+	} else if ((action == LIST || action == DELETE || action == INFO || action == SERVE) && pool_name) {
+		/* pass */
+	} else if ((action == COMPACT || action == DU) && pool_name) {
 		/* pass */
+	} else if (action == TUNE && pool_name && (argc == optind + 1 || argc == optind + 2)) {
+		filename = argv[optind];
+	} else if (action == MOUNT || action == PACK) {
+		if (argc == optind + 1 && pool_name) {
+			filename = argv[optind];
+		} else {
+			usage();
+			return EXIT_FAILURE;
+		}
+	} else if (action == VERIFY && pool_name && (argc == optind + 1 || argc == optind + 2)) {
+		key = argv[optind];
+		filename = argc == optind + 2 ? argv[optind + 1] : NULL;
+	} else if (action == COPY && (argc == optind + 1 || argc == optind + 2)) {
+		/* pass, the pools are part of the arguments */
+	} else if (action == HTTP) {
+		/* pass, the pool is part of every request */
 		
 	} else if (action == DELETE || to_delete_file_list != NULL) {
 		/* pass */
@@ -835,6 +1692,14 @@ int main(int argc, const char **argv)
 			return EXIT_FAILURE;
 	}
 
+	if (key_file != NULL) {
+		if (crypt_load_key(key_file, &loaded_key) < 0)
+			return EXIT_FAILURE;
+		crypt_key = &loaded_key;
+		if (dedup)
+			debug("-D is ignored with --key-file, encrypted uploads are not deduplicated\n");
+	}
+
 	rados_ioctx_t io_ctx = NULL;
 	rados_striper_t striper = NULL;
 
@@ -860,29 +1725,15 @@ int main(int argc, const char **argv)
 	debug("connected to the rados cluster\n");
 
 
-	ret = rados_ioctx_create(rados, pool_name, &io_ctx);
-	if (ret < 0) {
-		debug("couldn't set up ioctx! error %d\n", ret);
-		ret = EXIT_FAILURE;
-		goto out;
-	} else
-		debug("created an ioctx for our pool\n");
-
-	ret = rados_striper_create(io_ctx, &striper);
-	if (ret < 0) {
-		debug("couldn't set up striper error %d\n", ret);
-		ret = EXIT_FAILURE;
-		goto out;
-	} else {
-		debug("created a striper for our pool\n");
+	/* the http gateway opens pools on demand from the request path */
+	if (pool_name != NULL) {
+		ret = open_pool(rados, pool_name, &io_ctx, &striper);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
 	}
 
-
-	rados_striper_set_object_layout_stripe_unit(striper, STRIPEUNIT);
-	rados_striper_set_object_layout_object_size(striper, OBJECTSIZE);
-	rados_striper_set_object_layout_stripe_count(striper, STRIPECOUNT);
-
-
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(sa) );
 	sa.sa_handler = quit_handler;
@@ -891,13 +1742,20 @@ int main(int argc, const char **argv)
 	sigaction(SIGTERM,&sa,NULL);
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGQUIT, &sa, NULL);
+	/* SIGUSR1 halves the qos limits, SIGUSR2 doubles them */
+	sa.sa_handler = qos_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
 
 	switch (action) {
 		case LIST:
-			ret = do_ls(io_ctx);
+			ret = do_ls(io_ctx, stdout);
 			break;
 		case UPLOAD:
-			ret = do_put2(striper, key, filename, 4, 0);
+			if (follow)
+				ret = put_follow(striper, key, filename, follow_timeout);
+			else
+				ret = do_put2(io_ctx, striper, key, filename, upload_concurrency, 0);
 			break;
 		case DONWLOAD:
 			ret = do_get(io_ctx, striper, key, filename);
@@ -906,11 +1764,41 @@ int main(int argc, const char **argv)
 			ret = do_delete(io_ctx, striper, key, to_delete_file_list);
 			break;
 		case INFO:
-			ret = do_info(striper, key);
+			if (strcmp(key, "-") == 0 || key[0] == '@')
+				ret = do_info_list(io_ctx, striper, key[0] == '@' ? key + 1 : key, stdout);
+			else
+				ret = do_info(io_ctx, striper, key, stdout);
 			break;
 		case CLEAR:
 			ret = do_clear_old_files(striper, io_ctx, key, force);
 			break;
+		case SERVE:
+			ret = do_serve(io_ctx, striper, listen_addr);
+			break;
+		case HTTP:
+			ret = do_http(rados, listen_addr);
+			break;
+		case MOUNT:
+			ret = do_mount(io_ctx, striper, pool_name, filename, cache_mb);
+			break;
+		case PACK:
+			ret = do_pack(io_ctx, striper, filename);
+			break;
+		case COMPACT:
+			ret = do_compact(io_ctx);
+			break;
+		case TUNE:
+			ret = do_tune(io_ctx, striper, filename, argc == optind + 2 ? argv[optind + 1] : NULL);
+			break;
+		case DU:
+			ret = do_du(io_ctx, delimiter, depth, stdout);
+			break;
+		case VERIFY:
+			ret = do_verify(io_ctx, striper, key, filename);
+			break;
+		case COPY:
+			ret = do_cp(rados, argv[optind], argc == optind + 2 ? argv[optind + 1] : NULL);
+			break;
 		default:
 			output("fail\n");
 			ret = -1;
@@ -919,12 +1807,17 @@ int main(int argc, const char **argv)
 	
 
 out:
+	/* the hedge reads that lost and the reactor requests still use the ioctx */
+	hedge_drain();
+	reactor_shutdown();
 	if (striper) 
 		rados_striper_destroy(striper);
 	if (io_ctx) 
 		rados_ioctx_destroy(io_ctx);
 	if (rados) 
 			rados_shutdown(rados);
+	if (key_match)
+		regfree(key_match);
 	endT = time(NULL);
 	totalT = endT-startT;
 	debug("time cost %lf second\n",totalT);
@@ -0,0 +1,272 @@
+/*
+ * striprados.h
+ *
+ * shared definitions between the striprados command line front end
+ * and the long running modes (serve, http, mount).
+ */
+
+#ifndef __striprados_h__
+#define __striprados_h__
+
+#include <radosstriper/libradosstriper.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <regex.h>
+#include <sys/types.h>
+
+#define debug(f, arg...) fprintf(stderr, f, ## arg)
+#define output(f, arg...) fprintf(stdout, f, ## arg)
+
+#define BUFFSIZE (32 << 20) /* 32M */
+#define STRIPEUNIT (512 << 10) /* 512K */
+#define OBJECTSIZE (64 << 20) /* 64M */
+#define STRIPECOUNT 4
+
+extern int quit;
+extern int force;
+/* print the n% progress line while transferring */
+extern int progress;
+/* -C/-Z: local download cache directory and its size bound in bytes */
+extern const char *cache_dir;
+extern uint64_t cache_limit;
+/* -D: skip uploads of data the pool already holds */
+extern int dedup;
+/* -U: upload only the chunks whose stored sums differ */
+extern int delta;
+/* --no-sparse clears it: zero blocks are sent and written like data */
+extern int sparse;
+/* -z: lz4 compress the chunks of an upload that look compressible */
+extern int compression;
+/* --key-file: encrypt uploads, decrypt encrypted objects. NULL without it */
+extern struct crypt_key *crypt_key;
+/* --pack: uploads up to PACK_MAX_FILE bytes go into pack objects */
+extern int pack;
+/* --prefix, --match: keys list, du and expiry work on, NULL for all */
+extern const char *key_prefix;
+extern regex_t *key_match;
+int key_selected(const char *key, size_t len);
+
+int open_pool(rados_t rados, const char *pool_name, rados_ioctx_t *io_ctx, rados_striper_t *striper);
+int is_head_object(const char * entry);
+int striprados_remove(rados_ioctx_t io_ctx, rados_striper_t striper, char *oid);
+
+/* read/write exactly len bytes unless EOF, retrying short transfers */
+ssize_t read_full(int fd, char *buf, size_t len);
+ssize_t write_full(int fd, const char *buf, size_t len);
+
+/* size of a striped object from the striper.size xattr of its head object */
+int striper_size(rados_ioctx_t ioctx, const char *key, uint64_t *size);
+
+/* upload size bytes read from fd, download a whole object into fd */
+int put_fd(rados_striper_t striper, const char *key, int fd, uint64_t size, uint16_t concurrent, int overwrite);
+int get_fd(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, int fd, uint64_t size);
+
+/* chunk sums on the head object, see crc32c.h */
+struct chunk_sums;
+int sums_store(rados_striper_t striper, const char *key, struct chunk_sums *sums);
+int sums_load(rados_striper_t striper, const char *key, uint64_t size, struct chunk_sums *sums);
+int strong_load(rados_striper_t striper, const char *key, struct chunk_sums *sums);
+
+int do_ls(rados_ioctx_t ioctx, FILE *out);
+int do_info(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, FILE *out);
+/* the "key|size|mtime" line of -i */
+void print_info(FILE *out, const char *key, uint64_t size, time_t mod_time);
+
+/* info.c: -i for every key of a list, "-" is stdin */
+int do_info_list(rados_ioctx_t ioctx, rados_striper_t striper, const char *list, FILE *out);
+
+/* dedup.c */
+/* SHA-256 of the content, set by uploads with -D and dropped by every writer */
+#define DIGEST_XATTR "striprados.sha256"
+#define DIGEST_LEN 32
+int sums_file(int fd, uint64_t size, uint32_t chunk, int strong, struct chunk_sums *s);
+int hash_file(int fd, uint64_t size, struct chunk_sums *s, unsigned char *digest);
+int dedup_lookup(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const struct chunk_sums *local,
+		const unsigned char *digest, char **dup);
+int dedup_record(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const struct chunk_sums *local,
+		const unsigned char *digest);
+
+/* delta.c */
+int put_delta(rados_striper_t striper, const char *key, int fd, uint64_t size, uint16_t concurrent);
+
+/* follow.c */
+int put_follow(rados_striper_t striper, const char *key, const char *filename, int timeout);
+
+/* sparse.c */
+int buffer_is_zero(const char *buf, size_t len);
+int fd_can_hole(int fd);
+int range_is_hole(int fd, uint64_t offset, uint64_t len);
+ssize_t write_sparse(int fd, const char *buf, size_t len);
+
+/* compress.c */
+#define CODEC_XATTR "striprados.codec"
+#define CMAP_XATTR "striprados.cmap"
+#define CZ_CHUNK (4 << 20)
+
+/* stored length of every CZ_CHUNK of a compressed object */
+struct chunk_map {
+	uint32_t chunk;
+	uint32_t count;
+	uint64_t size;
+	uint32_t *lens;
+};
+int cmap_init(struct chunk_map *map, uint64_t size);
+void cmap_free(struct chunk_map *map);
+int cmap_store(rados_striper_t striper, const char *key, const struct chunk_map *map);
+int cmap_load(rados_striper_t striper, const char *key, uint64_t size, struct chunk_map *map);
+size_t compress_bound(size_t len);
+int compress_buffer(struct chunk_map *map, const char *buf, size_t len, uint64_t offset, char *zbuf, const char **out, uint32_t *outlen);
+struct reactor_req;
+int cmap_read_chunks(rados_striper_t striper, const char *key, const struct chunk_map *map, uint64_t offset, size_t len,
+		char *buf, char *zbuf, rados_completion_t *comps, size_t *expect, struct reactor_req *q);
+int decompress_buffer(const struct chunk_map *map, uint64_t offset, size_t len, char *buf, const char *zbuf);
+struct crypt_info;
+/* ci may be NULL for an object that is not encrypted */
+int read_logical(rados_striper_t striper, const char *key, const struct chunk_map *map, const struct crypt_info *ci,
+		char *buf, size_t len, uint64_t offset);
+/* fn(arg, 0..n-1) on the worker threads, returns when all are done */
+void run_parallel(void (*fn)(void *arg, int i), void *arg, int n);
+
+/* crypt.c */
+#define CIPHER_XATTR "striprados.cipher"
+#define NONCE_XATTR "striprados.nonce"
+#define KEYID_XATTR "striprados.keyid"
+#define CRYPT_KEY_LEN 32
+#define CRYPT_NONCE_LEN 16
+#define CRYPT_KEYID_LEN 16
+
+struct crypt_key {
+	unsigned char key[CRYPT_KEY_LEN];
+	char id[CRYPT_KEYID_LEN + 1];
+};
+struct crypt_info {
+	const struct crypt_key *key;
+	unsigned char nonce[CRYPT_NONCE_LEN];
+};
+int crypt_load_key(const char *path, struct crypt_key *k);
+int crypt_new(const struct crypt_key *k, struct crypt_info *ci);
+int crypt_store(rados_striper_t striper, const char *key, const struct crypt_info *ci);
+int crypt_parse(struct crypt_info *ci, const char *key, const char *cipher, size_t cipher_len,
+		const char *nonce, size_t nonce_len, const char *keyid, size_t keyid_len);
+int crypt_load(rados_striper_t striper, const char *key, struct crypt_info *ci);
+int crypt_buffer(const struct crypt_info *ci, char *buf, size_t len, uint64_t offset);
+int crypt_chunks(const struct crypt_info *ci, const struct chunk_map *map, uint64_t offset, size_t len, char *buf, char *zbuf);
+
+/* layout.c */
+struct layout {
+	uint32_t stripe_unit;
+	uint32_t stripe_count;
+	uint32_t object_size;
+};
+/* a pool as the osd map has it */
+struct pool_info {
+	int64_t id;
+	int erasure;
+	uint64_t stripe_width;
+};
+int pool_lookup(rados_ioctx_t ioctx, struct pool_info *pi);
+/* stripe width of an erasure coded pool, 0 on replicated pools */
+extern uint64_t write_align;
+uint64_t pool_alignment(rados_ioctx_t ioctx);
+size_t write_step(void);
+/* concurrency line of --layout, upload buffers in flight */
+extern int upload_concurrency;
+int parse_size(const char *s, uint64_t *v);
+int layout_valid(const struct layout *l);
+void layout_override(const struct layout *l);
+void layout_default(rados_ioctx_t ioctx, struct layout *l);
+int layout_load(const char *path);
+void layout_pick(rados_ioctx_t ioctx, uint64_t size, struct layout *l);
+int layout_apply(rados_striper_t striper, const struct layout *l);
+int layout_striper(rados_ioctx_t ioctx, uint64_t size, rados_striper_t *striper);
+
+/* meta.c: size, mtime and layout of a striped object in one read op */
+struct object_meta {
+	uint64_t size;
+	time_t mtime;
+	struct layout layout;
+};
+int meta_fetch(rados_ioctx_t ioctx, const char *key, struct object_meta *m);
+/* ret is 0 or a negative errno, -ENOENT when key is not a striped object */
+typedef void (*meta_fn)(void *arg, const char *key, int ret, const struct object_meta *m);
+struct meta_batch;
+struct meta_batch *meta_batch_new(rados_ioctx_t ioctx, int window, meta_fn fn, void *arg);
+int meta_batch_add(struct meta_batch *b, const char *key, size_t len);
+void meta_batch_finish(struct meta_batch *b);
+/* one read with the completion c, NULL when it could not be issued; meta_op_end releases c */
+struct meta_slot;
+struct meta_slot *meta_op_start(rados_ioctx_t ioctx, const char *key, rados_completion_t c);
+int meta_op_end(struct meta_slot *s, struct object_meta *m);
+
+/* qos.c: --limit-bytes, --limit-ops, --yield-latency, 0 is no limit */
+extern uint64_t qos_bytes;
+extern uint64_t qos_ops;
+extern int qos_latency;
+double qos_now(void);
+/* returns early on quit */
+void qos_sleep(double seconds);
+/* before an op of bytes is issued, may sleep; returns its start for qos_done */
+double qos_wait(uint64_t bytes);
+void qos_done(double start);
+void qos_set(uint64_t bytes, uint64_t ops, int latency);
+void qos_signal(int sig);
+
+/* hedge.c: --read-deadline in ms, 0 follows the reads of the download */
+extern int read_deadline;
+struct hedge;
+struct hedge *hedge_new(rados_ioctx_t ioctx, const char *key);
+void hedge_wake(rados_completion_t c, void *arg);
+int hedge_read(struct hedge *h, rados_striper_t striper, rados_completion_t c, char **buf, size_t len, uint64_t off, double issued);
+void hedge_free(struct hedge *h);
+void hedge_drain(void);
+
+/* remove.c: rados_striper_remove with the tail objects removed in parallel */
+int fast_remove(rados_ioctx_t ioctx, const char *key);
+/* the same as a request of r within g, done is called on a worker of r with the result */
+struct reactor;
+struct reactor_group;
+typedef void (*remove_done)(void *arg, const char *key, int ret);
+int remove_submit(struct reactor *r, struct reactor_group *g, rados_ioctx_t ioctx, const char *key, remove_done done, void *arg);
+
+/* pack.c */
+/* larger files are not packed */
+#define PACK_MAX_FILE (1 << 20)
+int pack_put(rados_ioctx_t ioctx, rados_striper_t striper, char **keys, char **files, int n);
+int pack_read(rados_ioctx_t ioctx, const char *key, char **data, uint32_t *len, time_t *mtime);
+int pack_stat(rados_ioctx_t ioctx, const char *key, uint64_t *size, time_t *mtime);
+int pack_get_fd(rados_ioctx_t ioctx, const char *key, int fd);
+int pack_remove(rados_ioctx_t ioctx, const char *key);
+int pack_list(rados_ioctx_t ioctx, FILE *out);
+int pack_each(rados_ioctx_t ioctx, int (*fn)(const char *key, uint64_t len, void *arg), void *arg);
+int do_pack(rados_ioctx_t ioctx, rados_striper_t striper, const char *list);
+int do_compact(rados_ioctx_t ioctx);
+
+/* tune.c */
+int do_put2(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename, uint16_t concurrent, int overwrite);
+int do_get(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename);
+int do_tune(rados_ioctx_t ioctx, rados_striper_t striper, const char *config, const char *sizes);
+
+/* copy.c */
+int do_cp(rados_t rados, const char *from, const char *to);
+
+/* du.c */
+int do_du(rados_ioctx_t ioctx, const char *delimiter, int depth, FILE *out);
+
+/* verify.c */
+int do_verify(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename);
+
+/* cache.c */
+int copy_fd(int in, int out, uint64_t size);
+int cache_fetch(const char *dir, const char *key, uint64_t size, time_t mtime, uint32_t sum, int fd);
+void cache_store(const char *dir, uint64_t limit, const char *key, uint64_t size, time_t mtime, uint32_t sum, int fd);
+
+/* serve.c */
+int do_serve(rados_ioctx_t ioctx, rados_striper_t striper, const char *sock_path);
+
+/* http.c */
+int do_http(rados_t rados, const char *listen_addr);
+
+/* mount.c */
+int do_mount(rados_ioctx_t ioctx, rados_striper_t striper, const char *pool_name, const char *mountpoint, int cache_mb);
+
+#endif
@@ -10,6 +10,11 @@ do
 		echo "upload wrong"
 	fi
 
+	./striprados verify -p$poolname $i file
+	if [[ $? -ne 0 ]] ;then
+		echo "verify wrong"
+	fi
+
 	./striprados -p$poolname -g$i file.out
 	if [[ $? -ne 0 ]] ;then
 		echo "download wrong"
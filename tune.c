@@ -0,0 +1,333 @@
+/*
+ * tune.c
+ *
+ * "striprados tune" measures layouts instead of guessing them. For every
+ * size class of the target distribution, "<size>:<count>,...", count
+ * files of that size are uploaded with do_put2 and read back with do_get
+ * under scratch keys, once per layout of the grid. The best layout of
+ * each class and then the best upload concurrency are written as a
+ * --layout file.
+ *
+ * The sweep has two steps: every layout at the default concurrency, then
+ * every concurrency with the chosen layouts. The full product would take
+ * hours on the large classes. Throughput decides, but a layout whose p99
+ * latency is over TUNE_TAIL_SLACK times the best p99 of its class is
+ * never picked.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include "striprados.h"
+
+#define TUNE_DEFAULT_SIZES "1M:16,16M:4,128M:2"
+#define TUNE_MAX_CLASSES 16
+#define TUNE_TAIL_SLACK 1.5
+#define TUNE_FILL (1 << 20)
+
+static const uint32_t grid_su[] = {256 << 10, 512 << 10, 1 << 20, 4 << 20};
+static const uint32_t grid_sc[] = {1, 2, 4, 8};
+static const uint32_t grid_os[] = {4 << 20, 16 << 20, 64 << 20};
+static const int grid_concurrency[] = {1, 2, 4, 8, 16};
+
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+struct tune_class {
+	uint64_t size;
+	int count;
+	char path[64];
+	struct layout best;
+};
+
+struct tune_result {
+	uint64_t bytes;
+	double seconds;
+	double *lat;
+	int n;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double p99(struct tune_result *r) {
+	int i;
+	if (r->n == 0)
+		return 0;
+	qsort(r->lat, r->n, sizeof(double), cmp_double);
+	/* the rank ceil(n * 0.99) */
+	i = (r->n * 99 + 99) / 100 - 1;
+	return r->lat[i];
+}
+
+static double mbps(const struct tune_result *r) {
+	return r->seconds > 0 ? r->bytes / r->seconds / (1 << 20) : 0;
+}
+
+/* 512K rather than 524288 in the config */
+static void size_str(uint64_t v, char *s, size_t len) {
+	if (v == UINT64_MAX)
+		snprintf(s, len, "max");
+	else if (v && v % (1ULL << 30) == 0)
+		snprintf(s, len, "%" PRIu64 "G", v >> 30);
+	else if (v && v % (1 << 20) == 0)
+		snprintf(s, len, "%" PRIu64 "M", v >> 20);
+	else if (v && v % (1 << 10) == 0)
+		snprintf(s, len, "%" PRIu64 "K", v >> 10);
+	else
+		snprintf(s, len, "%" PRIu64, v);
+}
+
+static int cmp_class(const void *a, const void *b) {
+	const struct tune_class *x = a, *y = b;
+	return x->size < y->size ? -1 : x->size > y->size;
+}
+
+static int parse_classes(const char *spec, struct tune_class *classes) {
+	char *copy = strdup(spec), *tok, *save = NULL, *colon;
+	int n = 0;
+
+	if (copy == NULL)
+		return -1;
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if (n == TUNE_MAX_CLASSES)
+			goto bad;
+		memset(&classes[n], 0, sizeof(classes[n]));
+		classes[n].count = 1;
+		colon = strchr(tok, ':');
+		if (colon != NULL) {
+			*colon = '\0';
+			classes[n].count = atoi(colon + 1);
+		}
+		if (parse_size(tok, &classes[n].size) < 0 || classes[n].size == 0 ||
+				classes[n].size == UINT64_MAX || classes[n].count < 1)
+			goto bad;
+		n++;
+	}
+	free(copy);
+	if (n == 0)
+		return -1;
+	qsort(classes, n, sizeof(classes[0]), cmp_class);
+	return n;
+bad:
+	debug("bad size distribution %s, expected <size>:<count>,...\n", spec);
+	free(copy);
+	return -1;
+}
+
+/* a scratch file of random bytes, every MB different */
+static int make_file(struct tune_class *c) {
+	char *buf = malloc(TUNE_FILL);
+	uint64_t done;
+	size_t n;
+	int fd, rnd, ret = -1;
+
+	snprintf(c->path, sizeof(c->path), "/tmp/striprados.tune.XXXXXX");
+	fd = mkstemp(c->path);
+	rnd = open("/dev/urandom", O_RDONLY);
+	if (buf == NULL || fd < 0 || rnd < 0 || read_full(rnd, buf, TUNE_FILL) != TUNE_FILL)
+		goto out;
+	for (done = 0; done < c->size; done += n) {
+		n = c->size - done < TUNE_FILL ? c->size - done : TUNE_FILL;
+		memcpy(buf, &done, sizeof(done));
+		if (write_full(fd, buf, n) != (ssize_t)n)
+			goto out;
+	}
+	ret = 0;
+out:
+	if (ret < 0)
+		debug("can not write the scratch file %s\n", c->path);
+	if (rnd >= 0)
+		close(rnd);
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+/* count uploads and downloads of the class under scratch keys, removed again */
+static int tune_run(rados_ioctx_t ioctx, rados_striper_t striper, const struct tune_class *c,
+		int concurrency, struct tune_result *r) {
+	char key[128], out[80];
+	double t0, t1, t2;
+	int i, ret = 0;
+
+	snprintf(out, sizeof(out), "%s.out", c->path);
+	for (i = 0; i < c->count && ret == 0 && !quit; i++) {
+		snprintf(key, sizeof(key), "striprados.tune.%d.%d", (int)getpid(), i);
+		t0 = now();
+		ret = do_put2(ioctx, striper, key, c->path, concurrency, 1);
+		t1 = now();
+		if (ret == 0)
+			ret = do_get(ioctx, striper, key, out);
+		t2 = now();
+		striprados_remove(ioctx, striper, key);
+		if (ret < 0)
+			break;
+		r->lat[r->n++] = t1 - t0;
+		r->lat[r->n++] = t2 - t1;
+		r->bytes += c->size * 2;
+		r->seconds += t2 - t0;
+	}
+	unlink(out);
+	if (quit)
+		return -1;
+	return ret < 0 ? -1 : 0;
+}
+
+static int tune_layouts(rados_ioctx_t ioctx, rados_striper_t striper, struct tune_class *c, double *lat) {
+	struct layout l;
+	struct tune_result r;
+	double tput[NELEM(grid_su) * NELEM(grid_sc) * NELEM(grid_os)];
+	double tail[NELEM(tput)], best_tail = 0, best_tput = -1;
+	struct layout tried[NELEM(tput)];
+	char s[3][16];
+	unsigned int a, b, d, n = 0, i;
+
+	for (a = 0; a < NELEM(grid_su); a++)
+	for (b = 0; b < NELEM(grid_sc); b++)
+	for (d = 0; d < NELEM(grid_os); d++) {
+		l.stripe_unit = grid_su[a];
+		l.stripe_count = grid_sc[b];
+		l.object_size = grid_os[d];
+		/* stripes the file never reaches give the same layout as fewer of them */
+		if (!layout_valid(&l) || (uint64_t)l.stripe_unit * (l.stripe_count - 1) >= c->size)
+			continue;
+		memset(&r, 0, sizeof(r));
+		r.lat = lat;
+		layout_override(&l);
+		if (tune_run(ioctx, striper, c, upload_concurrency, &r) < 0)
+			return -1;
+		size_str(l.stripe_unit, s[0], sizeof(s[0]));
+		size_str(l.object_size, s[1], sizeof(s[1]));
+		size_str(c->size, s[2], sizeof(s[2]));
+		tried[n] = l;
+		tput[n] = mbps(&r);
+		tail[n] = p99(&r);
+		debug("%s: %s %u %s %.1f MB/s p99 %.3f s\n", s[2], s[0], l.stripe_count, s[1], tput[n], tail[n]);
+		if (n == 0 || tail[n] < best_tail)
+			best_tail = tail[n];
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		if (tail[i] <= best_tail * TUNE_TAIL_SLACK && tput[i] > best_tput) {
+			best_tput = tput[i];
+			c->best = tried[i];
+		}
+	}
+	return n > 0 ? 0 : -1;
+}
+
+/* the chosen layouts for the whole distribution at each concurrency */
+static int tune_concurrency(rados_ioctx_t ioctx, rados_striper_t striper, struct tune_class *classes, int nclasses,
+		double *lat, int *best) {
+	struct tune_result r;
+	double tput, tail, best_tput = -1;
+	int i, j;
+
+	for (i = 0; i < (int)NELEM(grid_concurrency); i++) {
+		memset(&r, 0, sizeof(r));
+		r.lat = lat;
+		for (j = 0; j < nclasses; j++) {
+			layout_override(&classes[j].best);
+			if (tune_run(ioctx, striper, &classes[j], grid_concurrency[i], &r) < 0)
+				return -1;
+		}
+		tput = mbps(&r);
+		tail = p99(&r);
+		debug("concurrency %d: %.1f MB/s p99 %.3f s\n", grid_concurrency[i], tput, tail);
+		if (tput > best_tput) {
+			best_tput = tput;
+			*best = grid_concurrency[i];
+		}
+	}
+	return 0;
+}
+
+static int write_config(rados_ioctx_t ioctx, const char *path, const struct tune_class *classes, int nclasses, int concurrency) {
+	struct pool_info pi;
+	const char *pool;
+	char s[4][16];
+	FILE *fp = fopen(path, "w");
+	int i;
+
+	pool_lookup(ioctx, &pi);
+	pool = pi.erasure ? "erasure" : "replicated";
+
+	if (fp == NULL) {
+		debug("can not write %s\n", path);
+		return -1;
+	}
+	fprintf(fp, "# written by striprados tune\n");
+	fprintf(fp, "# max_size stripe_unit stripe_count object_size pool\n");
+	for (i = 0; i < nclasses; i++) {
+		size_str(i == nclasses - 1 ? UINT64_MAX : classes[i].size, s[0], sizeof(s[0]));
+		size_str(classes[i].best.stripe_unit, s[1], sizeof(s[1]));
+		size_str(classes[i].best.object_size, s[2], sizeof(s[2]));
+		fprintf(fp, "%s %s %u %s %s\n", s[0], s[1], classes[i].best.stripe_count, s[2], pool);
+	}
+	fprintf(fp, "concurrency %d\n", concurrency);
+	if (fclose(fp) != 0) {
+		debug("can not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int do_tune(rados_ioctx_t ioctx, rados_striper_t striper, const char *config, const char *sizes) {
+	struct tune_class classes[TUNE_MAX_CLASSES];
+	double *lat = NULL;
+	int nclasses, i, made = 0, concurrency = upload_concurrency, ret = -1, maxcount = 0;
+	/* measure the plain upload path, not these */
+	int saved_pack = pack, saved_dedup = dedup, saved_delta = delta, saved_progress = progress;
+	const char *saved_cache = cache_dir;
+
+	nclasses = parse_classes(sizes ? sizes : TUNE_DEFAULT_SIZES, classes);
+	if (nclasses < 0)
+		return -1;
+	for (i = 0; i < nclasses; i++)
+		maxcount += classes[i].count;
+	/* an upload and a download per file */
+	lat = malloc(sizeof(double) * maxcount * 2);
+	if (lat == NULL)
+		return -1;
+
+	pack = dedup = delta = progress = 0;
+	cache_dir = NULL;
+	for (made = 0; made < nclasses; made++) {
+		if (make_file(&classes[made]) < 0) {
+			unlink(classes[made].path);
+			goto out;
+		}
+	}
+	for (i = 0; i < nclasses; i++) {
+		if (tune_layouts(ioctx, striper, &classes[i], lat) < 0)
+			goto out;
+	}
+	if (tune_concurrency(ioctx, striper, classes, nclasses, lat, &concurrency) < 0)
+		goto out;
+	ret = write_config(ioctx, config, classes, nclasses, concurrency);
+
+out:
+	layout_override(NULL);
+	for (i = 0; i < made; i++)
+		unlink(classes[i].path);
+	pack = saved_pack;
+	dedup = saved_dedup;
+	delta = saved_delta;
+	progress = saved_progress;
+	cache_dir = saved_cache;
+	free(lat);
+	return ret;
+}
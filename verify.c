@@ -0,0 +1,266 @@
+/*
+ * verify.c
+ *
+ * "striprados verify -p <pool> <key> <filename>" checks that an object
+ * holds the same data as a local file without writing anything to disk.
+ *
+ * When the object carries chunk sums the local file is summed with the
+ * same chunk size on all cores and only the sums are compared; the first
+ * chunk that differs is then read to find the exact byte, if the object
+ * is stored plain. Without sums the object is read with VERIFY_WINDOW
+ * aio reads in flight and compared with preads of the file. Either way
+ * the check stops at the first difference and prints its offset:
+ *
+ *	<key>|ok
+ *	<key>|mismatch|<offset>
+ *
+ * "striprados verify -p <pool> <list>" checks every "<key> <filename>"
+ * line of the list.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "striprados.h"
+
+#define VERIFY_WINDOW 4
+#define VERIFY_PIECE (4 << 20)
+
+struct verify_slot {
+	char *buf;
+	size_t len;
+	uint64_t offset;
+	rados_completion_t completion;
+};
+
+/* offset of the first byte that differs, len when none does */
+static size_t first_diff(const char *a, const char *b, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (a[i] != b[i])
+			break;
+	}
+	return i;
+}
+
+static int verify_issue(rados_striper_t striper, const char *key, struct verify_slot *s, uint64_t offset, uint64_t size) {
+	int ret;
+	s->offset = offset;
+	s->len = size - offset < VERIFY_PIECE ? size - offset : VERIFY_PIECE;
+	if (rados_aio_create_completion(NULL, NULL, NULL, &s->completion) < 0) {
+		s->completion = NULL;
+		return -1;
+	}
+	ret = rados_striper_aio_read(striper, key, s->completion, s->buf, s->len, offset);
+	if (ret < 0) {
+		/* a read that was never queued never completes */
+		rados_aio_release(s->completion);
+		s->completion = NULL;
+	}
+	return ret;
+}
+
+/* compare [from, to) of the plain object with the file: 1 same, 0 differs at *where, -1 error */
+static int verify_stream(rados_striper_t striper, const char *key, int fd, uint64_t from, uint64_t to, uint64_t *where) {
+	struct verify_slot slots[VERIFY_WINDOW], *s;
+	char *local = malloc(VERIFY_PIECE);
+	uint64_t issued = from;
+	size_t diff;
+	int i, k, ret = 1;
+
+	memset(slots, 0, sizeof(slots));
+	if (local == NULL)
+		ret = -1;
+	for (i = 0; i < VERIFY_WINDOW; i++) {
+		slots[i].buf = malloc(VERIFY_PIECE);
+		if (slots[i].buf == NULL)
+			ret = -1;
+	}
+	for (i = 0; ret == 1 && i < VERIFY_WINDOW && issued < to; i++) {
+		if (verify_issue(striper, key, &slots[i], issued, to) < 0)
+			ret = -1;
+		issued += slots[i].len;
+	}
+	if (ret < 0)
+		goto out;
+	/* the local read of a piece overlaps the remote reads in flight */
+	for (k = 0; ret == 1 && !quit; k = (k + 1) % VERIFY_WINDOW) {
+		s = &slots[k];
+		if (s->completion == NULL)
+			break;
+		if (pread(fd, local, s->len, s->offset) != (ssize_t)s->len) {
+			debug("failed to read the local file at %" PRIu64 "\n", s->offset);
+			ret = -1;
+			break;
+		}
+		rados_aio_wait_for_complete(s->completion);
+		if (rados_aio_get_return_value(s->completion) != (int)s->len) {
+			debug("failed to read %s at %" PRIu64 "\n", key, s->offset);
+			ret = -1;
+		}
+		rados_aio_release(s->completion);
+		s->completion = NULL;
+		if (ret < 0)
+			break;
+		diff = first_diff(local, s->buf, s->len);
+		if (diff < s->len) {
+			*where = s->offset + diff;
+			ret = 0;
+			break;
+		}
+		if (issued < to) {
+			if (verify_issue(striper, key, s, issued, to) < 0) {
+				ret = -1;
+				break;
+			}
+			issued += s->len;
+		}
+	}
+	if (quit)
+		ret = -1;
+out:
+	for (i = 0; i < VERIFY_WINDOW; i++) {
+		if (slots[i].completion != NULL) {
+			rados_aio_wait_for_complete(slots[i].completion);
+			rados_aio_release(slots[i].completion);
+		}
+		free(slots[i].buf);
+	}
+	free(local);
+	return ret;
+}
+
+/* the stored sums against sums of the file, SHA-256 too when stored, 1 same, 0 differs, -1 error */
+static int verify_sums(rados_striper_t striper, const char *key, int fd, const struct chunk_sums *remote, int plain, uint64_t *where) {
+	struct chunk_sums local;
+	uint32_t i;
+	uint64_t end;
+	int ret = 1;
+
+	if (sums_file(fd, remote->size, remote->chunk, remote->strong != NULL, &local) < 0)
+		return -1;
+	for (i = 0; i < remote->count; i++) {
+		if (local.crcs[i] != remote->crcs[i])
+			break;
+		if (remote->strong && memcmp(local.strong + (size_t)i * STRONG_LEN, remote->strong + (size_t)i * STRONG_LEN, STRONG_LEN) != 0)
+			break;
+	}
+	if (i < remote->count) {
+		*where = (uint64_t)i * remote->chunk;
+		ret = 0;
+		/* the exact byte, when the stored bytes are the data */
+		end = *where + remote->chunk < remote->size ? *where + remote->chunk : remote->size;
+		if (plain && verify_stream(striper, key, fd, *where, end, where) == 1)
+			debug("the sums of %s differ but the data at %" PRIu64 " does not\n", key, *where);
+	}
+	sums_free(&local);
+	return ret;
+}
+
+static int verify_packed(rados_ioctx_t ioctx, const char *key, int fd, uint64_t size, uint64_t *where) {
+	char *data = NULL, *local = malloc(size ? size : 1);
+	uint32_t len;
+	time_t mtime;
+	size_t diff;
+	int ret = -1;
+
+	if (local == NULL || pack_read(ioctx, key, &data, &len, &mtime) < 0)
+		goto out;
+	if (len != size || pread(fd, local, size, 0) != (ssize_t)size)
+		goto out;
+	diff = first_diff(local, data, size);
+	*where = diff;
+	ret = diff == size ? 1 : 0;
+out:
+	free(data);
+	free(local);
+	return ret;
+}
+
+static int verify_one(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename) {
+	struct chunk_sums remote;
+	struct stat sb;
+	uint64_t size, where = 0;
+	time_t mtime;
+	char val[32];
+	int fd, plain, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		debug("error reading file %s\n", filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (rados_striper_stat(striper, key, &size, &mtime) == 0) {
+		plain = rados_striper_getxattr(striper, key, CODEC_XATTR, val, sizeof(val)) <= 0 &&
+			rados_striper_getxattr(striper, key, CIPHER_XATTR, val, sizeof(val)) <= 0;
+		if ((uint64_t)sb.st_size != size)
+			ret = 0;
+		else if (sums_load(striper, key, size, &remote) == 0) {
+			/* objects uploaded with -U have them, the others are checked by CRC32C only */
+			strong_load(striper, key, &remote);
+			ret = verify_sums(striper, key, fd, &remote, plain, &where);
+			sums_free(&remote);
+		} else if (plain)
+			ret = verify_stream(striper, key, fd, 0, size, &where);
+		else {
+			debug("%s has no chunk sums and is not stored plain\n", key);
+			ret = -1;
+		}
+	} else if (pack_stat(ioctx, key, &size, &mtime) == 0) {
+		ret = (uint64_t)sb.st_size != size ? 0 : verify_packed(ioctx, key, fd, size, &where);
+	} else {
+		debug("no remote file or the file is not striped: %s\n", key);
+		ret = -1;
+	}
+	close(fd);
+
+	/* the sizes differ: the first byte one of them lacks */
+	if (ret == 0 && (uint64_t)sb.st_size != size)
+		where = (uint64_t)sb.st_size < size ? (uint64_t)sb.st_size : size;
+	if (ret == 1)
+		output("%s|ok\n", key);
+	else if (ret == 0)
+		output("%s|mismatch|%" PRIu64 "\n", key, where);
+	return ret == 1 ? 0 : -1;
+}
+
+/* filename NULL: list holds "<key> <filename>" lines */
+int do_verify(rados_ioctx_t ioctx, rados_striper_t striper, const char *key, const char *filename) {
+	char *line = NULL, k[1024], f[4096];
+	size_t len = 0;
+	int lineno = 0, failed = 0, total = 0;
+	FILE *fp;
+
+	if (filename != NULL)
+		return verify_one(ioctx, striper, key, filename);
+
+	fp = fopen(key, "r");
+	if (fp == NULL) {
+		debug("can not open %s\n", key);
+		return -1;
+	}
+	while (!quit && getline(&line, &len, fp) != -1) {
+		lineno++;
+		if (sscanf(line, "%1023s %4095s", k, f) != 2) {
+			if (sscanf(line, "%1023s", k) == 1) {
+				debug("bad verify line %s:%d, expected \"<key> <filename>\"\n", key, lineno);
+				failed++;
+			}
+			continue;
+		}
+		total++;
+		if (verify_one(ioctx, striper, k, f) < 0)
+			failed++;
+	}
+	free(line);
+	fclose(fp);
+	debug("%d of %d objects verified\n", total - failed, total);
+	return failed || quit ? -1 : 0;
+}